@@ -0,0 +1,790 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include "image.h"
+#include "matrix.h"
+#include "classifier.h"
+#include "bench.h"
+
+// Wall clock time in seconds.
+double what_time_is_it_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec*1e-9;
+}
+
+// Print a timing comparison between a reference path and its fast version.
+// double reference, fast: seconds taken by each.
+void print_bench(const char *name, double reference, double fast)
+{
+    printf("%-40s reference %9.2f ms   fast %9.2f ms   %6.1fx\n",
+            name, 1000*reference, 1000*fast, reference/fast);
+}
+
+// Largest absolute difference between two same-sized images.
+float max_abs_diff(image a, image b)
+{
+    int i;
+    float m = 0;
+    for(i = 0; i < a.w*a.h*a.c; ++i){
+        float d = fabsf(a.data[i] - b.data[i]);
+        if(d > m) m = d;
+    }
+    return m;
+}
+
+void bench_convolve_case(const char *name, image im, image f, int preserve)
+{
+    double t = what_time_is_it_now();
+    image ref = convolve_image_reference(im, f, preserve);
+    double reference = what_time_is_it_now() - t;
+
+    t = what_time_is_it_now();
+    image fast = convolve_image(im, f, preserve);
+    double engine = what_time_is_it_now() - t;
+
+    print_bench(name, reference, engine);
+    printf("%-40s max abs diff %g\n", "", max_abs_diff(ref, fast));
+    free_image(ref);
+    free_image(fast);
+}
+
+void bench_convolve()
+{
+    image im = make_random_image(1024, 768, 3);
+
+    image g = make_gaussian_filter(3);
+    bench_convolve_case("convolve 19x19 gaussian, 1024x768x3", im, g, 1);
+    free_image(g);
+
+    image box = make_box_filter(7);
+    bench_convolve_case("convolve 7x7 box, 1024x768x3", im, box, 1);
+    free_image(box);
+
+    image hp = make_highpass_filter();
+    bench_convolve_case("convolve 3x3 highpass, 1024x768x3 -> 1", im, hp, 0);
+    free_image(hp);
+
+    free_image(im);
+}
+
+void bench_harris()
+{
+    image im = make_random_image(2048, 1536, 3);
+
+    double t = what_time_is_it_now();
+    image S = structure_matrix(im, 2);
+    image ref = cornerness_response(S);
+    double reference = what_time_is_it_now() - t;
+
+    t = what_time_is_it_now();
+    image fused = harris_response(im, 2);
+    double fast = what_time_is_it_now() - t;
+
+    print_bench("harris response, 2048x1536x3", reference, fast);
+    printf("%-40s max abs diff %g\n", "", max_abs_diff(ref, fused));
+    free_image(S);
+    free_image(ref);
+    free_image(fused);
+    free_image(im);
+}
+
+void bench_nms()
+{
+    image im = make_random_image(1024, 768, 1);
+    int w = 7;
+
+    double t = what_time_is_it_now();
+    image ref = nms_image_reference(im, w);
+    double reference = what_time_is_it_now() - t;
+
+    t = what_time_is_it_now();
+    image fast = nms_image(im, w);
+    double window = what_time_is_it_now() - t;
+
+    print_bench("nms w=7, 1024x768", reference, window);
+    printf("%-40s max abs diff %g\n", "", max_abs_diff(ref, fast));
+    free_image(ref);
+    free_image(fast);
+    free_image(im);
+}
+
+// Time a distance kernel over pairs of random rows.
+double bench_distance_kernel(DISTANCE metric, int hamming, float *data, int rows, int n, int reps)
+{
+    unsigned char *bits = (unsigned char *)data;
+    float sum = 0;
+    int r, i;
+    double t = what_time_is_it_now();
+    for(r = 0; r < reps; ++r){
+        for(i = 0; i + 1 < rows; ++i){
+            if(hamming) sum += hamming_distance(bits + i*n, bits + (i+1)*n, n);
+            else sum += descriptor_distance(metric, data + i*n, data + (i+1)*n, n, INFINITY);
+        }
+    }
+    t = what_time_is_it_now() - t;
+    // Keep the loop from being optimized out.
+    if(sum == -1) printf("%f\n", sum);
+    return t;
+}
+
+void bench_distance()
+{
+    int rows = 1024, n = 128, reps = 200;
+    float *data = calloc(rows*n, sizeof(float));
+    int i, isa, k;
+    for(i = 0; i < rows*n; ++i) data[i] = (float)rand()/RAND_MAX;
+
+    const char *names[] = {"l1", "l2sq", "hamming"};
+    DISTANCE_ISA active = get_distance_isa();
+    for(k = 0; k < 3; ++k){
+        set_distance_isa(DISTANCE_SCALAR);
+        double scalar = bench_distance_kernel(k == 1 ? DISTANCE_L2 : DISTANCE_L1, k == 2, data, rows, n, reps);
+        for(isa = DISTANCE_SCALAR + 1; isa < DISTANCE_ISAS; ++isa){
+            if(!set_distance_isa(isa)) continue;
+            char name[64];
+            sprintf(name, "%s distance, %s, n=%d", names[k], distance_isa_name(isa), n);
+            print_bench(name, scalar, bench_distance_kernel(k == 1 ? DISTANCE_L2 : DISTANCE_L1, k == 2, data, rows, n, reps));
+        }
+    }
+    set_distance_isa(active);
+    free(data);
+}
+
+void bench_match_case(const char *name, descriptor *a, int an, descriptor *b, int bn,
+        match_params p, double reference, match *ref, int rn)
+{
+    int *truth = calloc(an, sizeof(int));
+    int i, mn = 0, hits = 0;
+    for(i = 0; i < an; ++i) truth[i] = -1;
+    for(i = 0; i < rn; ++i) truth[ref[i].ai] = ref[i].bi;
+
+    double t = what_time_is_it_now();
+    match *m = match_descriptors_params(a, an, b, bn, p, &mn);
+    double fast = what_time_is_it_now() - t;
+
+    for(i = 0; i < mn; ++i) hits += truth[m[i].ai] == m[i].bi;
+    print_bench(name, reference, fast);
+    printf("%-40s recall %.3f (%d of %d)\n", "", rn ? (float)hits/rn : 1, hits, rn);
+    free(truth);
+    free(m);
+}
+
+void bench_match()
+{
+    int an = 4000, bn = 4000, len = 75;
+    descriptor *b = make_random_descriptors(bn, len);
+    descriptor *a = make_random_descriptors(an, len);
+    int i, j;
+    // Like two overlapping frames: most points reappear with some noise.
+    for(i = 0; i < 3*an/4; ++i){
+        for(j = 0; j < len; ++j) a[i].data[j] = b[i].data[j] + .1*((float)rand()/RAND_MAX - .5);
+    }
+
+    int rn = 0;
+    double t = what_time_is_it_now();
+    match *ref = match_descriptors_reference(a, an, b, bn, &rn);
+    double reference = what_time_is_it_now() - t;
+
+    match_params p = default_match_params();
+    bench_match_case("match brute force, 4000x4000x75", a, an, b, bn, p, reference, ref, rn);
+    p.backend = MATCH_KDTREE;
+    bench_match_case("match kd-trees, 4000x4000x75", a, an, b, bn, p, reference, ref, rn);
+    p.backend = MATCH_KMEANS;
+    bench_match_case("match k-means tree, 4000x4000x75", a, an, b, bn, p, reference, ref, rn);
+
+    free(ref);
+    free_descriptors(a, an);
+    free_descriptors(b, bn);
+}
+
+// Largest distance between where two homographies send the image corners.
+float corner_error(matrix H, const double *truth)
+{
+    float err = 0;
+    int i;
+    for(i = 0; i < 4; ++i){
+        point c = {(i & 1)*640, (i/2)*480};
+        double w = truth[6]*c.x + truth[7]*c.y + truth[8];
+        point t = {(truth[0]*c.x + truth[1]*c.y + truth[2])/w, (truth[3]*c.x + truth[4]*c.y + truth[5])/w};
+        point e = project_point(H, c);
+        err = MAX(err, sqrtf((e.x - t.x)*(e.x - t.x) + (e.y - t.y)*(e.y - t.y)));
+    }
+    return err;
+}
+
+void bench_ransac_case(const char *name, const double *truth, int n, float ratio, ransac_params p)
+{
+    match *m = make_synthetic_matches(truth, n, ratio, 1);
+    match *copy = calloc(n, sizeof(match));
+    memcpy(copy, m, n*sizeof(match));
+
+    double t = what_time_is_it_now();
+    matrix R = RANSAC_reference(copy, n, p.thresh, p.max_iters, n);
+    double reference = what_time_is_it_now() - t;
+    int ref_inliers = model_inliers(R, copy, n, p.thresh);
+
+    int inliers = 0;
+    t = what_time_is_it_now();
+    matrix H = ransac_homography(m, n, p, &inliers);
+    double fast = what_time_is_it_now() - t;
+
+    print_bench(name, reference, fast);
+    printf("%-40s inliers %d vs %d, corner error %.2f vs %.2f px\n", "",
+            ref_inliers, inliers, corner_error(R, truth), corner_error(H, truth));
+    free_matrix(R);
+    free_matrix(H);
+    free(copy);
+    free(m);
+}
+
+void bench_ransac()
+{
+    double truth[9] = {.9, -.1, 300, .08, 1.05, -20, 1e-4, -5e-5, 1};
+    ransac_params p = default_ransac_params();
+    p.thresh = 3;
+    p.max_iters = 10000;
+    bench_ransac_case("ransac 1000 matches, 50% inliers", truth, 1000, .5, p);
+    bench_ransac_case("ransac 1000 matches, 20% inliers", truth, 1000, .2, p);
+    p.prosac = 0;
+    bench_ransac_case("ransac uniform sampling, 20% inliers", truth, 1000, .2, p);
+    p.prosac = 1;
+    p.preemptive = 500;
+    bench_ransac_case("ransac preemptive 500, 50% inliers", truth, 1000, .5, p);
+
+    // Thread scaling on a hard case: few inliers, no quality order.
+    match *m = make_synthetic_matches(truth, 4000, .2, 1);
+    match *copy = calloc(4000, sizeof(match));
+    memcpy(copy, m, 4000*sizeof(match));
+    p = default_ransac_params();
+    p.thresh = 3;
+    p.prosac = 0;
+    p.max_iters = 20000;
+    p.threads = 1;
+    double t = what_time_is_it_now();
+    matrix H1 = ransac_homography(m, 4000, p, 0);
+    double serial = what_time_is_it_now() - t;
+    p.threads = 0;
+    t = what_time_is_it_now();
+    matrix Hn = ransac_homography(copy, 4000, p, 0);
+    double parallel = what_time_is_it_now() - t;
+    print_bench("ransac 4000 matches 20%, 1 vs all threads", serial, parallel);
+    double diff = 0;
+    int i;
+    for(i = 0; i < 9; ++i) diff = MAX(diff, fabs(H1.data[i/3][i%3] - Hn.data[i/3][i%3]));
+    printf("%-40s max H difference %g\n", "", diff);
+    free_matrix(H1);
+    free_matrix(Hn);
+    free(copy);
+    free(m);
+}
+
+void bench_combine()
+{
+    image a = make_random_image(1600, 1200, 3);
+    image b = make_random_image(1600, 1200, 3);
+    matrix H = make_identity_homography();
+    H.data[0][0] = .95; H.data[0][1] = .05; H.data[0][2] = 900;
+    H.data[1][0] = -.04; H.data[1][1] = 1.02; H.data[1][2] = -30;
+    H.data[2][0] = 1e-5; H.data[2][1] = 2e-5;
+
+    double t = what_time_is_it_now();
+    image ref = combine_images_reference(a, b, H);
+    double reference = what_time_is_it_now() - t;
+
+    t = what_time_is_it_now();
+    image fast = combine_images(a, b, H);
+    double warp = what_time_is_it_now() - t;
+
+    print_bench("combine images, 1600x1200x3 pair", reference, warp);
+    printf("%-40s max abs diff %g\n", "", max_abs_diff(ref, fast));
+    free_image(ref);
+    free_image(fast);
+    free_matrix(H);
+    free_image(a);
+    free_image(b);
+}
+
+// A textured frame and the same frame moved by (dx, dy).
+static void moved_frames(int w, int h, float dx, float dy, image *prev, image *im)
+{
+    image noise = make_random_image(w + 40, h + 40, 1);
+    image scene = smooth_image(noise, 2);
+    *prev = make_image(w, h, 1);
+    *im = make_image(w, h, 1);
+    int x, y;
+    for(y = 0; y < h; ++y){
+        for(x = 0; x < w; ++x){
+            set_pixel(*prev, x, y, 0, get_pixel(scene, x + 20, y + 20, 0));
+            set_pixel(*im, x, y, 0, bilinear_interpolate(scene, x + 20 - dx, y + 20 - dy, 0));
+        }
+    }
+    free_image(scene);
+    free_image(noise);
+}
+
+// Mean error of a velocity image against a uniform motion, skipping a
+// border where content leaves the frame.
+static float flow_error(image v, float dx, float dy)
+{
+    float err = 0;
+    int x, y, n = 0;
+    for(y = v.h/8; y < v.h - v.h/8; ++y){
+        for(x = v.w/8; x < v.w - v.w/8; ++x){
+            err += hypotf(get_pixel(v, x, y, 0) - dx, get_pixel(v, x, y, 1) - dy);
+            ++n;
+        }
+    }
+    return err/n;
+}
+
+void bench_flow()
+{
+    float dx = 6.4, dy = -4.3;
+    image prev, im;
+    moved_frames(640, 360, dx, dy, &prev, &im);
+    flow_params p = default_flow_params();
+
+    double t = what_time_is_it_now();
+    image single = optical_flow_images(im, prev, 15, p.stride);
+    double reference = what_time_is_it_now() - t;
+
+    t = what_time_is_it_now();
+    image lk = optical_flow_lk(im, prev, p);
+    double fast = what_time_is_it_now() - t;
+
+    print_bench("flow 640x360, single scale vs LK", reference, fast);
+    printf("%-40s mean error %.2f px single scale, %.3f px pyramidal\n", "",
+            flow_error(single, dx, dy), flow_error(lk, dx, dy));
+    free_image(single);
+    free_image(lk);
+    free_image(prev);
+    free_image(im);
+
+    moved_frames(1920, 1080, dx, dy, &prev, &im);
+    t = what_time_is_it_now();
+    lk = optical_flow_lk(im, prev, p);
+    double dense = what_time_is_it_now() - t;
+    int n = 2000, i;
+    point *pts = calloc(n, sizeof(point));
+    point *out = calloc(n, sizeof(point));
+    int *status = calloc(n, sizeof(int));
+    for(i = 0; i < n; ++i) pts[i] = make_point(100 + rand()%1720, 100 + rand()%880);
+    t = what_time_is_it_now();
+    track_points_lk(im, prev, pts, n, p, out, status);
+    double sparse = what_time_is_it_now() - t;
+    printf("%-40s 1080p: dense every %d px %.2f ms (%.3f px), %d points %.2f ms\n", "",
+            p.stride, 1000*dense, flow_error(lk, dx, dy), n, 1000*sparse);
+    free(pts);
+    free(out);
+    free(status);
+    free_image(lk);
+    free_image(prev);
+    free_image(im);
+}
+
+void bench_gemm()
+{
+    int n = 512;
+    matrix a = random_matrix(n, n, 1);
+    matrix b = random_matrix(n, n, 1);
+    double t = what_time_is_it_now();
+    matrix ref = matrix_mult_matrix_reference(a, b);
+    double reference = what_time_is_it_now() - t;
+    t = what_time_is_it_now();
+    matrix p = matrix_mult_matrix(a, b);
+    double fast = what_time_is_it_now() - t;
+    print_bench("gemm 512x512x512", reference, fast);
+    free_matrix(a);
+    free_matrix(b);
+    free_matrix(ref);
+    free_matrix(p);
+
+    // MNIST sized layer: batch 128, 784 inputs, 256 outputs.
+    n = 1024;
+    a = random_matrix(n, n, 1);
+    b = random_matrix(n, n, 1);
+    matrix x = random_matrix(128, 784, 1);
+    matrix w = random_matrix(784, 256, 1);
+    int i, reps = 20;
+    p = matrix_mult_matrix(a, b);
+    free_matrix(p);
+    t = what_time_is_it_now();
+    p = matrix_mult_matrix(a, b);
+    double big = what_time_is_it_now() - t;
+    t = what_time_is_it_now();
+    for(i = 0; i < reps; ++i){
+        matrix y = matrix_mult_matrix(x, w);
+        free_matrix(y);
+    }
+    double layer = (what_time_is_it_now() - t)/reps;
+    printf("%-40s 1024^3 %.1f GFLOP/s, 128x784x256 %.1f GFLOP/s\n", "",
+            2e-9*n*n*n/big, 2e-9*128*784*256/layer);
+    free_matrix(a);
+    free_matrix(b);
+    free_matrix(p);
+    free_matrix(x);
+    free_matrix(w);
+
+    fmatrix fa = random_fmatrix(n, n, 1);
+    fmatrix fb = random_fmatrix(n, n, 1);
+    fmatrix fx = random_fmatrix(128, 784, 1);
+    fmatrix fw = random_fmatrix(784, 256, 1);
+    fmatrix fp = fmatrix_mult_fmatrix(fa, fb);
+    free_fmatrix(fp);
+    t = what_time_is_it_now();
+    fp = fmatrix_mult_fmatrix(fa, fb);
+    big = what_time_is_it_now() - t;
+    t = what_time_is_it_now();
+    for(i = 0; i < reps; ++i){
+        fmatrix y = fmatrix_mult_fmatrix(fx, fw);
+        free_fmatrix(y);
+    }
+    layer = (what_time_is_it_now() - t)/reps;
+    printf("%-40s float: 1024^3 %.1f GFLOP/s, 128x784x256 %.1f GFLOP/s\n", "",
+            2e-9*n*n*n/big, 2e-9*128*784*256/layer);
+    free_fmatrix(fa);
+    free_fmatrix(fb);
+    free_fmatrix(fp);
+    free_fmatrix(fx);
+    free_fmatrix(fw);
+}
+
+void bench_backprop()
+{
+    // First layer of the CIFAR net: batch 128, 3073 inputs, 64 outputs.
+    fmatrix in = random_fmatrix(128, 3073, 1);
+    fmatrix w = random_fmatrix(3073, 64, 1);
+    fmatrix delta = random_fmatrix(128, 64, 1);
+    fmatrix dw = make_fmatrix(3073, 64);
+    int i, reps = 20;
+
+    // Transposed copies and fresh outputs, the way backward_layer did it.
+    double t = what_time_is_it_now();
+    for(i = 0; i < reps; ++i){
+        fmatrix xt = transpose_fmatrix(in);
+        fmatrix d = fmatrix_mult_fmatrix(xt, delta);
+        fmatrix wt = transpose_fmatrix(w);
+        fmatrix dx = fmatrix_mult_fmatrix(delta, wt);
+        free_fmatrix(xt);
+        free_fmatrix(d);
+        free_fmatrix(wt);
+        free_fmatrix(dx);
+    }
+    double reference = (what_time_is_it_now() - t)/reps;
+
+    fmatrix dx = make_fmatrix(128, 3073);
+    t = what_time_is_it_now();
+    for(i = 0; i < reps; ++i){
+        sgemm(1, 0, 1, in, delta, 0, dw);
+        sgemm(0, 1, 1, delta, w, 0, dx);
+    }
+    double fast = (what_time_is_it_now() - t)/reps;
+    print_bench("backprop dW and dX, 128x3073x64", reference, fast);
+    free_fmatrix(in);
+    free_fmatrix(w);
+    free_fmatrix(delta);
+    free_fmatrix(dw);
+    free_fmatrix(dx);
+}
+
+// CIFAR sized data set and the three layer net from tryml.py.
+static data bench_data(int n)
+{
+    data d;
+    d.X = random_fmatrix(n, 3073, .5);
+    d.y = make_fmatrix(n, 10);
+    int i;
+    for(i = 0; i < n; ++i) d.y.data[i][i % 10] = 1;
+    return d;
+}
+
+void bench_train()
+{
+    data d = bench_data(2000);
+    layer l[3] = {make_layer(3073, 64, LRELU), make_layer(64, 32, LRELU), make_layer(32, 10, SOFTMAX)};
+    model m = {l, 3};
+    int i, batch = 128, reps = 20;
+
+    // Fresh batch, outputs and gradients every step, the way train_model
+    // used to run.
+    double t = what_time_is_it_now();
+    for(i = 0; i < reps; ++i){
+        data b = random_batch(d, batch);
+        fmatrix p = forward_model(m, b.X);
+        fmatrix dL = axpy_fmatrix(-1, p, b.y);
+        backward_model(m, dL);
+        update_model(m, .001/batch, .9, 0);
+        free_fmatrix(dL);
+        free_data(b);
+    }
+    double reference = (what_time_is_it_now() - t)/reps;
+
+    train_workspace w = make_train_workspace(m, batch);
+    train_step(m, &w, d, .001, .9, 0);
+    t = what_time_is_it_now();
+    for(i = 0; i < reps; ++i) train_step(m, &w, d, .001, .9, 0);
+    double fast = (what_time_is_it_now() - t)/reps;
+    print_bench("train step, CIFAR MLP batch 128", reference, fast);
+    free_train_workspace(w);
+
+    // The same steps split across every thread, reduced, and lock-free.
+    t = what_time_is_it_now();
+    train_model_parallel(m, d, batch, reps, .001, .9, 0, 0, 0);
+    double parallel = (what_time_is_it_now() - t)/reps;
+    print_bench("  data-parallel, all threads", fast, parallel);
+    t = what_time_is_it_now();
+    train_model_parallel(m, d, batch, reps, .001, .9, 0, 0, 1);
+    double hogwild = (what_time_is_it_now() - t)/reps;
+    print_bench("  hogwild, all threads", fast, hogwild);
+    for(i = 0; i < m.n; ++i){
+        free_fmatrix(l[i].w);
+        free_fmatrix(l[i].v);
+        free_fmatrix(l[i].dw);
+        free_fmatrix(l[i].out);
+    }
+    free_data(d);
+}
+
+// The integral image as it was built before: every entry sums its column
+// from the top again.
+static image integral_by_columns(image im)
+{
+    image integ = make_image(im.w, im.h, im.c);
+    int i, j, k, m;
+    for(i = 0; i < im.w; ++i){
+        for(j = 0; j < im.h; ++j){
+            for(k = 0; k < im.c; ++k){
+                float sum = i == 0 ? 0 : get_pixel(integ, i - 1, j, k);
+                for(m = 0; m <= j; ++m) sum += get_pixel(im, i, m, k);
+                set_pixel(integ, i, j, k, sum);
+            }
+        }
+    }
+    return integ;
+}
+
+void bench_integral()
+{
+    image im = make_random_image(640, 360, 5);
+    double t = what_time_is_it_now();
+    image ref = integral_by_columns(im);
+    double reference = what_time_is_it_now() - t;
+    t = what_time_is_it_now();
+    integral_image fast = integral_table(view_image(im));
+    double table = what_time_is_it_now() - t;
+    print_bench("integral image 640x360x5", reference, table);
+    free_integral_table(fast);
+    free_image(ref);
+    free_image(im);
+
+    im = make_random_image(1920, 1080, 5);
+    t = what_time_is_it_now();
+    fast = integral_table(view_image(im));
+    table = what_time_is_it_now() - t;
+    double last = fast.data[(size_t)1920*1080 - 1];
+    printf("%-40s 1080p x5: %.2f ms, sum %.1f\n", "", 1000*table, last);
+    free_integral_table(fast);
+    free_image(im);
+}
+
+void bench_box_filter()
+{
+    // All five channels of a 1080p time-structure matrix.
+    image im = make_random_image(1920, 1080, 5);
+    int s = 15;
+    double t = what_time_is_it_now();
+    image ref = box_filter_image_reference(im, s);
+    double reference = what_time_is_it_now() - t;
+    t = what_time_is_it_now();
+    image fast = box_filter_image(im, s);
+    double running = what_time_is_it_now() - t;
+    print_bench("box filter 1080p x5, 15x15", reference, running);
+    free_image(ref);
+    free_image(fast);
+    free_image(im);
+}
+
+void bench_velocity()
+{
+    // Positive definite structure matrices at 1080p.
+    image S = make_random_image(1920, 1080, 5);
+    int i, s = S.w*S.h;
+    for(i = 0; i < s; ++i){
+        S.data[i + 2*s] = (S.data[i + 2*s] - .5)*sqrtf(S.data[i]*S.data[i + s]);
+    }
+    int stride = 2;
+    double t = what_time_is_it_now();
+    image ref = velocity_image_reference(S, stride);
+    double reference = what_time_is_it_now() - t;
+    t = what_time_is_it_now();
+    image v = velocity_image(S, stride);
+    double fast = what_time_is_it_now() - t;
+    print_bench("velocity 1080p stride 2", reference, fast);
+    free_image(ref);
+    free_image(v);
+    free_image(S);
+}
+
+void bench_pyramid()
+{
+    image im = make_random_image(1600, 1200, 3);
+    int levels = 5, i;
+
+    // Smoothing and resizing separately, the way it was done before.
+    double t = what_time_is_it_now();
+    image cur = copy_image(im);
+    for(i = 1; i < levels; ++i){
+        image s = smooth_image(cur, 1);
+        image d = bilinear_resize(s, (cur.w + 1)/2, (cur.h + 1)/2);
+        free_image(s);
+        free_image(cur);
+        cur = d;
+    }
+    double reference = what_time_is_it_now() - t;
+    free_image(cur);
+
+    t = what_time_is_it_now();
+    pyramid p = make_pyramid(im, levels);
+    double fast = what_time_is_it_now() - t;
+
+    t = what_time_is_it_now();
+    update_pyramid(p, im);
+    double reuse = what_time_is_it_now() - t;
+
+    print_bench("pyramid, 5 levels of 1600x1200x3", reference, fast);
+    print_bench("pyramid, reused buffers", reference, reuse);
+    free_pyramid(p);
+    free_image(im);
+}
+
+void bench_cylindrical()
+{
+    image im = make_random_image(1600, 1200, 3);
+    double t = what_time_is_it_now();
+    image ref = cylindrical_project_reference(im, 1000);
+    double reference = what_time_is_it_now() - t;
+
+    t = what_time_is_it_now();
+    image fast = cylindrical_project(im, 1000);
+    double once = what_time_is_it_now() - t;
+
+    // Frames of a fixed rig reuse the map.
+    remap_map m = make_cylindrical_map(im.w, im.h, 1000);
+    t = what_time_is_it_now();
+    image cached = remap_image(im, m);
+    double reuse = what_time_is_it_now() - t;
+
+    print_bench("cylindrical project, 1600x1200x3", reference, once);
+    print_bench("cylindrical remap, cached map", reference, reuse);
+    printf("%-40s max abs diff %g\n", "", max_abs_diff(ref, cached));
+    free_remap_map(m);
+    free_image(ref);
+    free_image(fast);
+    free_image(cached);
+    free_image(im);
+}
+
+void bench_blend()
+{
+    image a = make_random_image(1600, 1200, 3);
+    image b = make_random_image(1600, 1200, 3);
+    matrix H = make_translation_homography(-900, 30);
+
+    double t = what_time_is_it_now();
+    image paste = combine_images(a, b, H);
+    double reference = what_time_is_it_now() - t;
+
+    t = what_time_is_it_now();
+    image feather = combine_images_blend(a, b, H, BLEND_FEATHER, 0);
+    double f = what_time_is_it_now() - t;
+
+    t = what_time_is_it_now();
+    image multiband = combine_images_blend(a, b, H, BLEND_MULTIBAND, 5);
+    double m = what_time_is_it_now() - t;
+
+    // Blending costs more than pasting, reference here is the paste.
+    print_bench("feather blend vs paste, 1600x1200x3", reference, f);
+    print_bench("multi-band blend vs paste, 5 bands", reference, m);
+    free_image(paste);
+    free_image(feather);
+    free_image(multiband);
+    free_matrix(H);
+    free_image(a);
+    free_image(b);
+}
+
+void bench_panorama()
+{
+    // Six overlapping crops of one textured scene, stitched left to right.
+    int n = 6, w = 400, h = 300, step = 250;
+    image noise = make_random_image(step*(n-1) + w, h, 3);
+    image scene = smooth_image(noise, 1);
+    image *ims = calloc(n, sizeof(image));
+    int i;
+    for(i = 0; i < n; ++i){
+        ims[i] = make_image(w, h, 3);
+        copy_view(view_roi(view_image(scene), step*i, 0, w, h), view_image(ims[i]));
+    }
+
+    double t = what_time_is_it_now();
+    image chained = copy_image(ims[0]);
+    for(i = 1; i < n; ++i){
+        image next = panorama_image(chained, ims[i], 2, .01, 3, 2, 10000, 30);
+        free_image(chained);
+        chained = next;
+    }
+    double reference = what_time_is_it_now() - t;
+
+    panorama_params p = default_panorama_params();
+    p.thresh = .01;
+    t = what_time_is_it_now();
+    image built = panorama_build(ims, n, p);
+    double fast = what_time_is_it_now() - t;
+
+    print_bench("panorama, 6 images 400x300x3", reference, fast);
+    printf("%-40s chained %dx%d   built %dx%d   scene %dx%d\n", "",
+            chained.w, chained.h, built.w, built.h, scene.w, scene.h);
+
+    // Streaming to disk keeps only a strip of the canvas in memory.
+    panorama_layout l = panorama_plan(ims, n, p);
+    t = what_time_is_it_now();
+    save_panorama_ppm(ims, l, "bench_panorama", 64);
+    double stream = what_time_is_it_now() - t;
+    remove("bench_panorama.ppm");
+    printf("%-40s render to ppm in 64 row strips %.2f ms, %.1f MB buffered of %.1f MB canvas\n", "",
+            1000*stream, l.w*64*l.c*5/1e6, (double)l.w*l.h*l.c*4/1e6);
+    free_panorama_layout(l);
+    free_image(chained);
+    free_image(built);
+    for(i = 0; i < n; ++i) free_image(ims[i]);
+    free(ims);
+    free_image(scene);
+    free_image(noise);
+}
+
+void run_benchmarks()
+{
+    srand(0);
+    bench_convolve();
+    bench_harris();
+    bench_nms();
+    bench_distance();
+    bench_match();
+    bench_ransac();
+    bench_combine();
+    bench_pyramid();
+    bench_flow();
+    bench_velocity();
+    bench_integral();
+    bench_box_filter();
+    bench_gemm();
+    bench_backprop();
+    bench_train();
+    bench_cylindrical();
+    bench_blend();
+    bench_panorama();
+}
@@ -0,0 +1,8 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+double what_time_is_it_now();
+void print_bench(const char *name, double reference, double fast);
+
+void run_benchmarks();
+#endif
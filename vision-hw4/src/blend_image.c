@@ -0,0 +1,248 @@
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+
+// Blending overlapping warped images. The canvas is processed in tiles:
+// each tile warps the images that reach it into scratch layers from the
+// arena, blends them, and writes its interior, so memory depends on the
+// tile size and not on the canvas. Multi-band tiles are padded by the
+// footprint of the coarsest pyramid level.
+
+#define BLEND_TILE 512
+
+// Weight of every pixel of a region by distance to the border of the image
+// it comes from, measured in that image's coordinates. This is the distance
+// transform of the image's rectangular footprint.
+// image im: source image, only its size is used.
+// matrix G: map from canvas to image coordinates.
+// image_view dst: 1 channel weights, 0 where the image doesn't reach.
+// int ox, oy: canvas coordinates of dst pixel (0, 0).
+static void border_weight(image im, matrix G, image_view dst, int ox, int oy)
+{
+    double h[9];
+    int i;
+    for(i = 0; i < 9; ++i) h[i] = G.data[i/3][i%3];
+    #pragma omp parallel for
+    for(i = 0; i < dst.h; ++i){
+        double X = ox, Y = i + oy;
+        double u = h[0]*X + h[1]*Y + h[2];
+        double v = h[3]*X + h[4]*Y + h[5];
+        double z = h[6]*X + h[7]*Y + h[8];
+        float *out = view_row(dst, i, 0);
+        int x;
+        for(x = 0; x < dst.w; ++x, u += h[0], v += h[3], z += h[6]){
+            double r = 1/z;
+            float sx = u*r, sy = v*r;
+            // Same coverage test as warp_homography_view.
+            if(!(sx >= 0 && sx < im.w && sy >= 0 && sy < im.h)){
+                out[x] = 0;
+                continue;
+            }
+            out[x] = MIN(MIN(sx + 1, im.w - sx), MIN(sy + 1, im.h - sy));
+        }
+    }
+}
+
+// Add a weighted layer into running sums.
+static void accumulate(image layer, image weight, image sum, image wsum)
+{
+    int i, k;
+    #pragma omp parallel for private(k)
+    for(i = 0; i < layer.w*layer.h; ++i){
+        float w = weight.data[i];
+        if(w <= 0) continue;
+        for(k = 0; k < layer.c; ++k) sum.data[i + k*sum.w*sum.h] += w*layer.data[i + k*layer.w*layer.h];
+        wsum.data[i] += w;
+    }
+}
+
+// Divide running sums by their weights in place, 0 where nothing landed.
+static void normalize_sum(image sum, image wsum)
+{
+    int i, k;
+    #pragma omp parallel for private(k)
+    for(i = 0; i < sum.w*sum.h; ++i){
+        float w = wsum.data[i];
+        for(k = 0; k < sum.c; ++k){
+            float *v = sum.data + i + k*sum.w*sum.h;
+            *v = w > 1e-6f ? *v / w : 0;
+        }
+    }
+}
+
+// One level down a pyramid: blur, then halve.
+static image pyramid_down(image im)
+{
+    image s = smooth_image(im, 1);
+    return bilinear_resize(s, (im.w + 1)/2, (im.h + 1)/2);
+}
+
+// Blend a region with a Laplacian pyramid per image. Each layer is first
+// filled outside its own footprint with the feathered blend, so the only
+// edges its pyramid sees are real ones. The mask of a layer is where it
+// has the largest border weight.
+// image *layers, *weights: warped images and their border weights.
+// image feather: feathered blend of the region.
+// image out: blended region.
+static void multiband_region(image *layers, image *weights, int n, image feather, int bands, image out)
+{
+    int w = feather.w, h = feather.h, c = feather.c;
+    int l, k, i, j;
+    image *sum = calloc(bands + 1, sizeof(image));
+    image *wsum = calloc(bands + 1, sizeof(image));
+    for(l = 0; l <= bands; ++l){
+        sum[l] = make_image(w, h, c);
+        wsum[l] = make_image(w, h, 1);
+        w = (w + 1)/2;
+        h = (h + 1)/2;
+    }
+    w = feather.w;
+    h = feather.h;
+
+    for(k = 0; k < n; ++k){
+        if(!layers[k].data) continue;
+        image_arena_begin();
+        image g = make_image_uninit(w, h, c);
+        image m = make_image(w, h, 1);
+        int any = 0;
+        #pragma omp parallel for private(j) reduction(|:any)
+        for(i = 0; i < w*h; ++i){
+            float wk = weights[k].data[i];
+            int mine = wk > 0;
+            for(j = 0; mine && j < n; ++j){
+                if(j == k || !weights[j].data) continue;
+                // Ties go to the later image, like pasting.
+                float wj = weights[j].data[i];
+                mine = wj < wk || (wj == wk && j < k);
+            }
+            m.data[i] = mine;
+            any |= mine;
+            for(j = 0; j < c; ++j){
+                g.data[i + j*w*h] = weights[k].data[i] > 0 ? layers[k].data[i + j*w*h] : feather.data[i + j*w*h];
+            }
+        }
+        for(l = 0; any && l < bands; ++l){
+            // Band l is the detail lost by going one level down.
+            image gd = pyramid_down(g);
+            image up = bilinear_resize(gd, g.w, g.h);
+            image md = pyramid_down(m);
+            int s = g.w*g.h;
+            #pragma omp parallel for private(j)
+            for(i = 0; i < s; ++i){
+                float mv = m.data[i];
+                for(j = 0; j < c; ++j) sum[l].data[i + j*s] += mv*(g.data[i + j*s] - up.data[i + j*s]);
+                wsum[l].data[i] += mv;
+            }
+            g = gd;
+            m = md;
+        }
+        if(any) accumulate(g, m, sum[bands], wsum[bands]);
+        image_arena_end();
+    }
+
+    // Collapse from the coarsest level.
+    for(l = 0; l <= bands; ++l) normalize_sum(sum[l], wsum[l]);
+    for(l = bands - 1; l >= 0; --l){
+        image up = bilinear_resize(sum[l+1], sum[l].w, sum[l].h);
+        int s = sum[l].w*sum[l].h;
+        #pragma omp parallel for
+        for(i = 0; i < s*c; ++i) sum[l].data[i] += up.data[i];
+    }
+    copy_view(view_image(sum[0]), view_image(out));
+    free(sum);
+    free(wsum);
+}
+
+// Draw placed images into a canvas view, blending where they overlap.
+// image *ims: images to draw, in order.
+// matrix *G: map from canvas to image i coordinates, rows = 0 to skip it.
+// int n: number of images.
+// BLEND mode: BLEND_NONE pastes later images over earlier ones,
+//             BLEND_FEATHER averages by distance to each image's border,
+//             BLEND_MULTIBAND blends each frequency band over its own width.
+// int bands: pyramid levels for BLEND_MULTIBAND.
+// image_view dst: output, its pixel (i, j) has canvas coordinates (i + ox, j + oy).
+void blend_images_view(image *ims, matrix *G, int n, BLEND mode, int bands, image_view dst, int ox, int oy)
+{
+    int i, k;
+    if(mode == BLEND_NONE){
+        for(k = 0; k < n; ++k){
+            if(G[k].rows) warp_homography_view(view_image(ims[k]), G[k], dst, ox, oy);
+        }
+        return;
+    }
+    bands = mode == BLEND_MULTIBAND ? MAX(bands, 1) : 0;
+    int margin = bands ? 4 << bands : 0;
+    int c = dst.c;
+
+    // Canvas footprint of every image, to skip the ones a tile misses.
+    point *lo = calloc(n, sizeof(point));
+    point *hi = calloc(n, sizeof(point));
+    for(k = 0; k < n; ++k){
+        if(!G[k].rows) continue;
+        matrix Ginv = matrix_invert(G[k]);
+        lo[k].x = lo[k].y = INFINITY;
+        hi[k].x = hi[k].y = -INFINITY;
+        for(i = 0; i < 4; ++i){
+            point p = project_point(Ginv, make_point((i & 1) ? ims[k].w : 0, (i & 2) ? ims[k].h : 0));
+            lo[k].x = MIN(lo[k].x, p.x); lo[k].y = MIN(lo[k].y, p.y);
+            hi[k].x = MAX(hi[k].x, p.x); hi[k].y = MAX(hi[k].y, p.y);
+        }
+        free_matrix(Ginv);
+    }
+
+    image *layers = calloc(n, sizeof(image));
+    image *weights = calloc(n, sizeof(image));
+    int tx, ty;
+    for(ty = 0; ty < dst.h; ty += BLEND_TILE){
+        for(tx = 0; tx < dst.w; tx += BLEND_TILE){
+            int tw = MIN(BLEND_TILE, dst.w - tx), th = MIN(BLEND_TILE, dst.h - ty);
+            // Region the tile depends on, in canvas coordinates.
+            int rx = tx + ox - margin, ry = ty + oy - margin;
+            int rw = tw + 2*margin, rh = th + 2*margin;
+            image_arena_begin();
+            image sum = make_image(rw, rh, c);
+            image wsum = make_image(rw, rh, 1);
+            int used = 0;
+            for(k = 0; k < n; ++k){
+                layers[k].data = weights[k].data = 0;
+                if(!G[k].rows) continue;
+                if(hi[k].x < rx || lo[k].x > rx + rw || hi[k].y < ry || lo[k].y > ry + rh) continue;
+                layers[k] = make_image(rw, rh, c);
+                weights[k] = make_image_uninit(rw, rh, 1);
+                warp_homography_view(view_image(ims[k]), G[k], view_image(layers[k]), rx, ry);
+                border_weight(ims[k], G[k], view_image(weights[k]), rx, ry);
+                accumulate(layers[k], weights[k], sum, wsum);
+                ++used;
+            }
+            if(used){
+                normalize_sum(sum, wsum);
+                image out = sum;
+                // A region only one image reaches is that image.
+                if(bands && used > 1){
+                    out = make_image_uninit(rw, rh, c);
+                    multiband_region(layers, weights, n, sum, bands, out);
+                }
+                // Only pixels some image reaches are written.
+                int y;
+                #pragma omp parallel for private(k)
+                for(y = 0; y < th; ++y){
+                    int x;
+                    const float *cover = wsum.data + (y + margin)*rw + margin;
+                    for(k = 0; k < c; ++k){
+                        const float *src = out.data + k*rw*rh + (y + margin)*rw + margin;
+                        float *o = view_row(dst, ty + y, k) + tx;
+                        for(x = 0; x < tw; ++x) if(cover[x] > 0) o[x] = src[x];
+                    }
+                }
+            }
+            image_arena_end();
+        }
+    }
+    free(layers);
+    free(weights);
+    free(lo);
+    free(hi);
+}
@@ -1,31 +1,35 @@
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 #include "image.h"
 #include "matrix.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 // Run an activation function on each element in a matrix,
 // modifies the matrix in place
 // matrix m: Input to activation function
 // ACTIVATION a: function to run
-void activate_matrix(matrix m, ACTIVATION a)
+void activate_matrix(fmatrix m, ACTIVATION a)
 {
 #pragma omp parallel for
     for(int i = 0; i < m.rows; ++i){
-        double sum = 0;
+        float sum = 0;
         for(int j = 0; j < m.cols; ++j){
-            double x = m.data[i][j];
+            float x = m.data[i][j];
 	        switch (a) {
 	        	case LOGISTIC:
-	        		m.data[i][j] = 1.0 / (1.0 + exp(-x));
+	        		m.data[i][j] = 1.0f / (1.0f + expf(-x));
 			        break;
 	        	case RELU:
-			        m.data[i][j] = x <= 0 ? 0.0 : x;
+			        m.data[i][j] = x <= 0 ? 0.0f : x;
 			        break;
 	        	case LRELU:
-			        m.data[i][j] = x <= 0 ? 0.1 * x : x;
+			        m.data[i][j] = x <= 0 ? 0.1f * x : x;
 			        break;
 	        	case SOFTMAX:
-	        		m.data[i][j] = exp(x);
+	        		m.data[i][j] = expf(x);
 			        break;
 		        case LINEAR:
 			        break;
@@ -45,30 +49,30 @@ void activate_matrix(matrix m, ACTIVATION a)
 // matrix m: an activated layer output
 // ACTIVATION a: activation function for a layer
 // matrix d: delta before activation gradient
-void gradient_matrix(matrix m, ACTIVATION a, matrix d)
+void gradient_matrix(fmatrix m, ACTIVATION a, fmatrix d)
 {
 #pragma omp parallel for
     for(int i = 0; i < m.rows; ++i){
 #pragma omp parallel for
         for(int j = 0; j < m.cols; ++j){
-            double x = m.data[i][j];
-            double gradient;
+            float x = m.data[i][j];
+            float gradient;
 
 	        switch (a) {
 		        case LOGISTIC: {
-			        double r = 1.0 / (1.0 + exp(-x));
+			        float r = 1.0f / (1.0f + expf(-x));
 			        gradient = r * (1 - r);
 		        }
 			        break;
 		        case RELU:
-			        gradient = x <= 0? 0.0 : 1.0;
+			        gradient = x <= 0? 0.0f : 1.0f;
 			        break;
 		        case LRELU:
-		        	gradient = x <= 0? 0.1 : 1.0;
+		        	gradient = x <= 0? 0.1f : 1.0f;
 			        break;
 		        case SOFTMAX:
 		        case LINEAR:
-			        gradient = 1.0;
+			        gradient = 1.0f;
 			        break;
 	        }
 
@@ -78,20 +82,49 @@ void gradient_matrix(matrix m, ACTIVATION a, matrix d)
     }
 }
 
+// Forward propagate a layer into a given output.
+// fmatrix out: in.rows x outputs, overwritten.
+static void forward_into(layer *l, fmatrix in, fmatrix out)
+{
+    // multiply input by weights and apply activation function.
+    sgemm(0, 0, 1, in, l->w, 0, out);
+    activate_matrix(out, l->activation);
+}
+
+// Backward propagate a layer given the input and output of its forward
+// pass.
+// fmatrix delta: dL/dy, turned into dL/d(xw) in place.
+// fmatrix dw: filled with dL/dw.
+// fmatrix dx: filled with dL/dx, rows = 0 to skip it.
+static void backward_into(layer *l, fmatrix in, fmatrix out, fmatrix delta, fmatrix dw, fmatrix dx)
+{
+    // 1.4.1
+    // delta is dL/dy
+    // modify it in place to be dL/d(xw)
+    gradient_matrix(out, l->activation, delta);
+
+    // 1.4.2
+    // then calculate dL/dw = in^T delta and save it over dw
+    sgemm(1, 0, 1, in, delta, 0, dw);
+
+    // 1.4.3
+    // dL/dx = delta w^T
+    if(dx.rows) sgemm(0, 1, 1, delta, l->w, 0, dx);
+}
+
 // Forward propagate information through a layer
 // layer *l: pointer to the layer
 // matrix in: input to layer
 // returns: matrix that is output of the layer
-matrix forward_layer(layer *l, matrix in)
+fmatrix forward_layer(layer *l, fmatrix in)
 {
 
     l->in = in;  // Save the input for backpropagation
 
-    // multiply input by weights and apply activation function.
-    matrix out = matrix_mult_matrix(in, l->w);
-	activate_matrix(out, l->activation);
+    fmatrix out = make_fmatrix(in.rows, l->w.cols);
+    forward_into(l, in, out);
 
-    free_matrix(l->out);// free the old output
+    free_fmatrix(l->out);// free the old output
     l->out = out;       // Save the current output for gradient calculation
     return out;
 }
@@ -100,30 +133,26 @@ matrix forward_layer(layer *l, matrix in)
 // layer *l: pointer to the layer
 // matrix delta: partial derivative of loss w.r.t. output of layer
 // returns: matrix, partial derivative of loss w.r.t. input to layer
-matrix backward_layer(layer *l, matrix delta)
+fmatrix backward_layer(layer *l, fmatrix delta)
 {
-    // 1.4.1
-    // delta is dL/dy
-    // modify it in place to be dL/d(xw)
-    gradient_matrix(l->out, l->activation, delta);
-
-    // 1.4.2
-    // then calculate dL/dw and save it in l->dw
-    free_matrix(l->dw);
-    matrix xt = transpose_matrix(l->in);
-    matrix dw = matrix_mult_matrix(xt, delta);
-    l->dw = dw;
-	free_matrix(xt);
-
-    
-    // 1.4.3
-    matrix wt = transpose_matrix(l->w);
-    matrix dx = matrix_mult_matrix(delta, wt);
-    free_matrix(wt);
-
+    fmatrix dx = make_fmatrix(delta.rows, l->w.rows);
+    backward_into(l, l->in, l->out, delta, l->dw, dx);
     return dx;
 }
 
+// Update one row of the weights at layer l from a gradient row.
+static void update_row(layer *l, const float *dw, int i, float r, float m, float lambda)
+{
+    // Calculate Δw_t = dL/dw_t - λw_t + mΔw_{t-1}, save it to l->v and
+    // step l->w along it, in one pass.
+    float *w = l->w.data[i], *v = l->v.data[i];
+    int j;
+    for (j = 0; j < l->w.cols; ++j) {
+        v[j] = dw[j] - lambda * w[j] + m * v[j];
+        w[j] += r * v[j];
+    }
+}
+
 // Update the weights at layer l
 // layer *l: pointer to the layer
 // double rate: learning rate
@@ -131,30 +160,10 @@ matrix backward_layer(layer *l, matrix delta)
 // double decay: value for weight decay
 void update_layer(layer *l, double rate, double momentum, double decay)
 {
-    // Calculate Δw_t = dL/dw_t - λw_t + mΔw_{t-1}
-    // save it to l->v
-	matrix deltaw_t = make_matrix(l->w.rows, l->w.cols);
-#pragma omp parallel for
-	for (int i = 0; i < l->w.rows; ++i) {
-#pragma omp parallel for
-		for (int j = 0; j < l->w.cols; ++j) {
-			deltaw_t.data[i][j] = l->dw.data[i][j] - decay * l->w.data[i][j] + momentum * l->v.data[i][j];
-		}
-	}
-	free_matrix(l->v);
-	l->v = deltaw_t;
-
-    // Update l->w
 #pragma omp parallel for
 	for (int i = 0; i < l->w.rows; ++i) {
-#pragma omp parallel for
-		for (int j = 0; j < l->w.cols; ++j) {
-			l->w.data[i][j] += rate * l->v.data[i][j];
-		}
+		update_row(l, l->dw.data[i], i, rate, momentum, decay);
 	}
-
-    // Remember to free any intermediate results to avoid memory leaks
-
 }
 
 // Make a new layer for our model
@@ -164,11 +173,11 @@ void update_layer(layer *l, double rate, double momentum, double decay)
 layer make_layer(int input, int output, ACTIVATION activation)
 {
     layer l;
-    l.in  = make_matrix(1,1);
-    l.out = make_matrix(1,1);
-    l.w   = random_matrix(input, output, sqrt(2./input));
-    l.v   = make_matrix(input, output);
-    l.dw  = make_matrix(input, output);
+    l.in  = make_fmatrix(1,1);
+    l.out = make_fmatrix(1,1);
+    l.w   = random_fmatrix(input, output, sqrt(2./input));
+    l.v   = make_fmatrix(input, output);
+    l.dw  = make_fmatrix(input, output);
     l.activation = activation;
     return l;
 }
@@ -177,7 +186,7 @@ layer make_layer(int input, int output, ACTIVATION activation)
 // model m: model to run
 // matrix X: input to model
 // returns: result matrix
-matrix forward_model(model m, matrix X)
+fmatrix forward_model(model m, fmatrix X)
 {
     int i;
     for(i = 0; i < m.n; ++i){
@@ -189,16 +198,16 @@ matrix forward_model(model m, matrix X)
 // Run a model backward given gradient dL
 // model m: model to run
 // matrix dL: partial derivative of loss w.r.t. model output dL/dy
-void backward_model(model m, matrix dL)
+void backward_model(model m, fmatrix dL)
 {
-    matrix d = copy_matrix(dL);
+    fmatrix d = copy_fmatrix(dL);
     int i;
     for(i = m.n-1; i >= 0; --i){
-        matrix prev = backward_layer(m.layers + i, d);
-        free_matrix(d);
+        fmatrix prev = backward_layer(m.layers + i, d);
+        free_fmatrix(d);
         d = prev;
     }
-    free_matrix(d);
+    free_fmatrix(d);
 }
 
 // Update the model weights
@@ -215,15 +224,15 @@ void update_model(model m, double rate, double momentum, double decay)
 }
 
 // Find the index of the maximum element in an array
-// double *a: array
+// float *a: array
 // int n: size of a, |a|
 // returns: index of maximum element
-int max_index(double *a, int n)
+int max_index(float *a, int n)
 {
     if(n <= 0) return -1;
     int i;
     int max_i = 0;
-    double max = a[0];
+    float max = a[0];
     for (i = 1; i < n; ++i) {
         if (a[i] > max){
             max = a[i];
@@ -239,7 +248,7 @@ int max_index(double *a, int n)
 // returns: accuracy, number correct / total
 double accuracy_model(model m, data d)
 {
-    matrix p = forward_model(m, d.X);
+    fmatrix p = forward_model(m, d.X);
     int i;
     int correct = 0;
     for(i = 0; i < d.y.rows; ++i){
@@ -252,19 +261,101 @@ double accuracy_model(model m, data d)
 // matrix y: the correct values
 // matrix p: the predictions
 // returns: average cross-entropy loss over data points, 1/n Σ(-ylog(p))
-double cross_entropy_loss(matrix y, matrix p)
+double cross_entropy_loss(fmatrix y, fmatrix p)
 {
     int i, j;
     double sum = 0;
     for(i = 0; i < y.rows; ++i){
         for(j = 0; j < y.cols; ++j){
-            sum += -y.data[i][j]*log(p.data[i][j]);
+            sum += -y.data[i][j]*logf(p.data[i][j]);
         }
     }
     return sum/y.rows;
 }
 
 
+// Make the buffers for training a model at one batch size.
+// model m: model to train.
+// int batch: batch size.
+// returns: workspace, free with free_train_workspace.
+train_workspace make_train_workspace(model m, int batch)
+{
+    train_workspace w = {0};
+    w.n = m.n;
+    w.batch = batch;
+    w.X.rows = w.y.rows = batch;
+    w.X.cols = m.layers[0].w.rows;
+    w.y.cols = m.layers[m.n-1].w.cols;
+    w.X.shallow = w.y.shallow = 1;
+    w.X.data = calloc(batch, sizeof(float *));
+    w.y.data = calloc(batch, sizeof(float *));
+    w.out = calloc(m.n, sizeof(fmatrix));
+    w.delta = calloc(m.n, sizeof(fmatrix));
+    int i;
+    for(i = 0; i < m.n; ++i){
+        w.out[i] = make_fmatrix(batch, m.layers[i].w.cols);
+        w.delta[i] = make_fmatrix(batch, m.layers[i].w.cols);
+    }
+    return w;
+}
+
+void free_train_workspace(train_workspace w)
+{
+    int i;
+    for(i = 0; i < w.n; ++i){
+        free_fmatrix(w.out[i]);
+        free_fmatrix(w.delta[i]);
+    }
+    free(w.out);
+    free(w.delta);
+    free_fmatrix(w.X);
+    free_fmatrix(w.y);
+}
+
+// Forward and backward pass over the batch in a workspace.
+// fmatrix *dw: gradient of each layer's weights, 0 for the layers' own dw.
+// returns: cross-entropy loss of the batch.
+static double batch_gradient(model m, train_workspace *w, fmatrix *dw)
+{
+    int i, j, k;
+    fmatrix in = w->X;
+    for(i = 0; i < m.n; ++i){
+        forward_into(m.layers + i, in, w->out[i]);
+        in = w->out[i];
+    }
+    fmatrix p = w->out[m.n-1];
+    double loss = cross_entropy_loss(w->y, p);
+
+    // partial derivative of loss dL/dy
+    fmatrix dL = w->delta[m.n-1];
+    for(j = 0; j < dL.rows; ++j){
+        for(k = 0; k < dL.cols; ++k) dL.data[j][k] = w->y.data[j][k] - p.data[j][k];
+    }
+    fmatrix none = {0};
+    for(i = m.n-1; i >= 0; --i){
+        backward_into(m.layers + i, i ? w->out[i-1] : w->X, w->out[i], w->delta[i],
+                dw ? dw[i] : m.layers[i].dw, i ? w->delta[i-1] : none);
+    }
+    return loss;
+}
+
+// One SGD step on a random batch, entirely in workspace buffers.
+// train_workspace *w: workspace made for m.
+// returns: cross-entropy loss of the batch before the step.
+double train_step(model m, train_workspace *w, data d, double rate, double momentum, double decay)
+{
+    int i;
+    // Same draws as random_batch.
+    for(i = 0; i < w->batch; ++i){
+        int ind = rand()%d.X.rows;
+        w->X.data[i] = d.X.data[ind];
+        w->y.data[i] = d.y.data[ind];
+    }
+    double loss = batch_gradient(m, w, 0);
+    update_model(m, rate/w->batch, momentum, decay);
+    return loss;
+}
+
 // Train a model on a dataset using SGD
 // model m: model to train
 // data d: dataset to train on
@@ -275,15 +366,142 @@ double cross_entropy_loss(matrix y, matrix p)
 // double decay: weight decay
 void train_model(model m, data d, int batch, int iters, double rate, double momentum, double decay)
 {
+    train_workspace w = make_train_workspace(m, batch);
     int e;
     for(e = 0; e < iters; ++e){
-        data b = random_batch(d, batch);
-        matrix p = forward_model(m, b.X);
-        fprintf(stderr, "%06d: Loss: %f\n", e, cross_entropy_loss(b.y, p));
-        matrix dL = axpy_matrix(-1, p, b.y); // partial derivative of loss dL/dy
-        backward_model(m, dL);
-        update_model(m, rate/batch, momentum, decay);
-        free_matrix(dL);
-        free_data(b);
+        double loss = train_step(m, &w, d, rate, momentum, decay);
+        fprintf(stderr, "%06d: Loss: %f\n", e, loss);
+    }
+    free_train_workspace(w);
+}
+
+// Data-parallel training. Each worker owns a workspace for its share of the
+// batch and a gradient buffer per layer; worker 0 uses the layers' dw so
+// the reduced gradient ends up where update_layer expects it.
+typedef struct {
+    train_workspace w;
+    fmatrix *dw;
+    double loss;
+    unsigned seed;
+} train_worker;
+
+// Add the gradients of worker t + s into worker t for every t that is a
+// multiple of 2s, one level of a pairwise tree. Called by every thread of
+// the team, the rows are shared out between them.
+static void reduce_level(model m, train_worker *workers, int threads, int s)
+{
+    int pairs = (threads - s + 2*s - 1)/(2*s);
+    int i;
+    for(i = 0; i < m.n; ++i){
+        int rows = m.layers[i].w.rows, cols = m.layers[i].w.cols;
+        int k;
+        #pragma omp for schedule(static) nowait
+        for(k = 0; k < pairs*rows; ++k){
+            int t = (k / rows)*2*s, r = k % rows, j;
+            float *a = workers[t].dw[i].data[r];
+            const float *b = workers[t + s].dw[i].data[r];
+            for(j = 0; j < cols; ++j) a[j] += b[j];
+        }
+    }
+    #pragma omp barrier
+}
+
+// Train a model with data-parallel SGD. Every batch is split between the
+// threads, they run forward and backward against the same weights, then
+// the gradients are summed in a tree and one update is applied, so this
+// is train_model with a different summation order. With hogwild, threads
+// instead draw their own batches of batch/threads rows and update the
+// shared weights as soon as their gradient is ready, without any locking;
+// updates may read weights another thread is half way through writing,
+// which SGD tolerates. Each of those updates is an ordinary step of size
+// rate on its own small batch, so the step size doesn't depend on threads,
+// and every iteration makes threads steps over batch rows in all.
+// int threads: worker threads, 0 for the OpenMP default.
+// int hogwild: lock-free asynchronous updates instead of a reduction.
+void train_model_parallel(model m, data d, int batch, int iters, double rate, double momentum,
+        double decay, int threads, int hogwild)
+{
+    if(threads <= 0){
+        threads = 1;
+#ifdef _OPENMP
+        threads = omp_get_max_threads();
+#endif
+    }
+    threads = MAX(1, MIN(threads, batch));
+    int *rows = calloc(batch, sizeof(int));
+    train_worker *workers = calloc(threads, sizeof(train_worker));
+    int t, i;
+    for(t = 0; t < threads; ++t){
+        int b0 = (long)batch*t/threads, b1 = (long)batch*(t+1)/threads;
+        workers[t].w = make_train_workspace(m, b1 - b0);
+        workers[t].dw = calloc(m.n, sizeof(fmatrix));
+        for(i = 0; i < m.n; ++i){
+            workers[t].dw[i] = t ? make_fmatrix(m.layers[i].w.rows, m.layers[i].w.cols) : m.layers[i].dw;
+        }
+        if(hogwild) workers[t].seed = rand();
+    }
+
+    #pragma omp parallel num_threads(threads)
+    {
+        int t = 0, e, i, j, s;
+#ifdef _OPENMP
+        t = omp_get_thread_num();
+#endif
+        train_worker *me = workers + t;
+        int b0 = (long)batch*t/threads;
+        for(e = 0; e < iters; ++e){
+            if(hogwild){
+                for(i = 0; i < me->w.batch; ++i){
+                    int ind = rand_r(&me->seed)%d.X.rows;
+                    me->w.X.data[i] = d.X.data[ind];
+                    me->w.y.data[i] = d.y.data[ind];
+                }
+                double loss = batch_gradient(m, &me->w, me->dw);
+                for(i = 0; i < m.n; ++i){
+                    for(j = 0; j < m.layers[i].w.rows; ++j){
+                        update_row(m.layers + i, me->dw[i].data[j], j, rate/me->w.batch, momentum, decay);
+                    }
+                }
+                if(t == 0) fprintf(stderr, "%06d: Loss: %f\n", e, loss);
+                continue;
+            }
+
+            // Same draws as train_step, so one thread reproduces train_model.
+            #pragma omp single
+            for(i = 0; i < batch; ++i) rows[i] = rand()%d.X.rows;
+
+            for(i = 0; i < me->w.batch; ++i){
+                me->w.X.data[i] = d.X.data[rows[b0 + i]];
+                me->w.y.data[i] = d.y.data[rows[b0 + i]];
+            }
+            me->loss = batch_gradient(m, &me->w, me->dw)*me->w.batch;
+            #pragma omp barrier
+
+            for(s = 1; s < threads; s *= 2) reduce_level(m, workers, threads, s);
+
+            for(i = 0; i < m.n; ++i){
+                #pragma omp for schedule(static) nowait
+                for(j = 0; j < m.layers[i].w.rows; ++j){
+                    update_row(m.layers + i, m.layers[i].dw.data[j], j, rate/batch, momentum, decay);
+                }
+            }
+            #pragma omp master
+            {
+                double loss = 0;
+                for(i = 0; i < threads; ++i) loss += workers[i].loss;
+                fprintf(stderr, "%06d: Loss: %f\n", e, loss/batch);
+            }
+            #pragma omp barrier
+        }
+        // The packing buffers sgemm grew on this thread.
+        gemm_release();
+    }
+
+    for(t = 0; t < threads; ++t){
+        if(t) for(i = 0; i < m.n; ++i) free_fmatrix(workers[t].dw[i]);
+        free(workers[t].dw);
+        free_train_workspace(workers[t].w);
     }
+    free(workers);
+    free(rows);
 }
@@ -2,7 +2,15 @@
 #define VISION_HW4_CLASSIFIER_H
 
 layer make_layer(int input, int output, ACTIVATION activation);
+fmatrix forward_model(model m, fmatrix X);
+void backward_model(model m, fmatrix dL);
+void update_model(model m, double rate, double momentum, double decay);
+train_workspace make_train_workspace(model m, int batch);
+void free_train_workspace(train_workspace w);
+double train_step(model m, train_workspace *w, data d, double rate, double momentum, double decay);
 void train_model(model m, data d, int batch, int iters, double rate, double momentum, double decay);
+void train_model_parallel(model m, data d, int batch, int iters, double rate, double momentum,
+        double decay, int threads, int hogwild);
 double accuracy_model(model m, data d);
 
 #endif //VISION_HW4_CLASSIFIER_H
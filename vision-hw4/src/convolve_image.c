@@ -0,0 +1,266 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define CONV_X86
+#include <immintrin.h>
+#endif
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "image.h"
+
+// Tiles are sized so the ring of filter rows a tile keeps live fits in L2.
+#define CONV_L2_BYTES (256*1024)
+#define CONV_MIN_BAND 64
+#define CONV_MIN_STRIP 64
+
+// Accumulate a scaled row into another, the inner loop of every pass.
+// float *dst: row to accumulate into.
+// float *src: row to scale.
+// float k: scale.
+// int n: number of elements.
+typedef void (*row_axpy_fn)(float *restrict dst, const float *restrict src, float k, int n);
+
+// How one filter channel gets applied.
+// float *taps: fw*fh filter values, row-major.
+// float *col, *row: rank-1 factors, taps[y*fw + x] == col[y]*row[x].
+// int separable: whether col and row are valid.
+// row_axpy_fn axpy: row kernel picked for this CPU.
+typedef struct{
+    const float *taps;
+    float *col, *row;
+    int separable;
+    row_axpy_fn axpy;
+} conv_plan;
+
+static void row_axpy_scalar(float *restrict dst, const float *restrict src, float k, int n)
+{
+    int i = 0;
+#ifdef __ARM_NEON
+    float32x4_t vk = vdupq_n_f32(k);
+    for(; i + 4 <= n; i += 4){
+        float32x4_t d = vld1q_f32(dst + i);
+        d = vmlaq_f32(d, vk, vld1q_f32(src + i));
+        vst1q_f32(dst + i, d);
+    }
+#endif
+    for(; i < n; ++i) dst[i] += k*src[i];
+}
+
+#ifdef CONV_X86
+__attribute__((target("avx2,fma")))
+static void row_axpy_avx2(float *restrict dst, const float *restrict src, float k, int n)
+{
+    int i = 0;
+    __m256 vk = _mm256_set1_ps(k);
+    for(; i + 8 <= n; i += 8){
+        __m256 d = _mm256_loadu_ps(dst + i);
+        d = _mm256_fmadd_ps(vk, _mm256_loadu_ps(src + i), d);
+        _mm256_storeu_ps(dst + i, d);
+    }
+    for(; i < n; ++i) dst[i] += k*src[i];
+}
+#endif
+
+// Copy (or add) part of an image row with clamp-to-edge padding.
+// float *dst: n output values.
+// float *src: image row of width w.
+// int start: source x of dst[0], may be negative or run past w.
+// int add: accumulate into dst instead of overwriting it.
+// row_axpy_fn axpy: row kernel for the add case.
+static void pad_row(float *restrict dst, const float *restrict src, int w, int start, int n, int add,
+        row_axpy_fn axpy)
+{
+    int lo = MAX(0, start);
+    int hi = MIN(w, start + n);
+    int left = lo - start;
+    int right = start + n - hi;
+    int i;
+    if(add){
+        for(i = 0; i < left; ++i) dst[i] += src[0];
+        axpy(dst + left, src + lo, 1, hi - lo);
+        for(i = 0; i < right; ++i) dst[left + hi - lo + i] += src[w-1];
+    } else {
+        for(i = 0; i < left; ++i) dst[i] = src[0];
+        memcpy(dst + left, src + lo, (hi - lo)*sizeof(float));
+        for(i = 0; i < right; ++i) dst[left + hi - lo + i] = src[w-1];
+    }
+}
+
+// Check whether a filter channel is rank 1 and factor it if so.
+// float *f: fw*fh filter values.
+// float *col, *row: filled with the factors on success.
+// returns: 1 if f == col*row^T up to float rounding, 0 otherwise.
+static int separate_filter(const float *f, int fw, int fh, float *col, float *row)
+{
+    int i, x, y;
+    int pivot = 0;
+    float big = 0;
+    for(i = 0; i < fw*fh; ++i){
+        if(fabsf(f[i]) > big){
+            big = fabsf(f[i]);
+            pivot = i;
+        }
+    }
+    if(big == 0){
+        memset(col, 0, fh*sizeof(float));
+        memset(row, 0, fw*sizeof(float));
+        return 1;
+    }
+    int px = pivot % fw;
+    int py = pivot / fw;
+    for(y = 0; y < fh; ++y) col[y] = f[px + y*fw];
+    for(x = 0; x < fw; ++x) row[x] = f[x + py*fw] / f[pivot];
+
+    float tol = big*1e-5f;
+    for(y = 0; y < fh; ++y){
+        for(x = 0; x < fw; ++x){
+            if(fabsf(f[x + y*fw] - col[y]*row[x]) > tol) return 0;
+        }
+    }
+    return 1;
+}
+
+// Convolve one tile of source channels [c0, c0+nc) (summed) into a
+// destination channel using a ring of fh rows.
+// float *dst: first pixel of the destination channel, rows dst_stride apart.
+// int add: accumulate into dst instead of overwriting it.
+// float *scratch: at least (fh+1)*(tw+fw-1) floats.
+static void convolve_tile(image_view im, image filter, conv_plan plan, int c0, int nc,
+        float *dst, int dst_stride, int add, int x0, int x1, int y0, int y1, float *scratch)
+{
+    int fw = filter.w, fh = filter.h;
+    int ox = fw/2, oy = fh/2;
+    int tw = x1 - x0;
+    int pw = tw + fw - 1;
+    int rows = y1 - y0 + fh - 1;
+    float *padrow = scratch;
+    float *ring = scratch + pw;
+    int r, k, l, m;
+
+    for(r = 0; r < rows; ++r){
+        int sy = y0 + r - oy;
+        sy = sy < 0 ? 0 : (sy >= im.h ? im.h - 1 : sy);
+
+        // Separable filters keep horizontally filtered rows in the ring,
+        // everything else keeps the padded rows themselves.
+        float *slot = ring + (r % fh)*pw;
+        float *p = (plan.separable && fw > 1) ? padrow : slot;
+        for(k = 0; k < nc; ++k){
+            pad_row(p, view_row(im, sy, c0 + k), im.w, x0 - ox, pw, k > 0, plan.axpy);
+        }
+        if(plan.separable && fw > 1){
+            memset(slot, 0, tw*sizeof(float));
+            for(l = 0; l < fw; ++l) plan.axpy(slot, padrow + l, plan.row[l], tw);
+        }
+        if(r < fh - 1) continue;
+
+        int first = r - (fh - 1);
+        float *out = dst + (y0 + first)*dst_stride + x0;
+        if(!add) memset(out, 0, tw*sizeof(float));
+        for(m = 0; m < fh; ++m){
+            float *src = ring + ((first + m) % fh)*pw;
+            if(plan.separable){
+                plan.axpy(out, src, plan.col[m]*(fw == 1 ? plan.row[0] : 1), tw);
+            } else {
+                for(l = 0; l < fw; ++l) plan.axpy(out, src + l, plan.taps[m*fw + l], tw);
+            }
+        }
+    }
+}
+
+// Convolve a view with a filter, clamping reads to the view edges.
+// Rank-1 filters run as a horizontal then vertical pass, and the work is
+// split into row bands and column strips that run in parallel.
+// image_view im: view to filter.
+// image filter: filter with 1 channel or im.c channels.
+// int preserve: keep im.c channels, otherwise sum them into one.
+// image_view dst: im.w x im.h view with im.c (preserve) or 1 channels,
+//                 must not overlap im.
+void convolve_view(image_view im, image filter, int preserve, image_view dst)
+{
+    assert(filter.c == 1 || filter.c == im.c);
+    assert(dst.w == im.w && dst.h == im.h && dst.c == (preserve ? im.c : 1));
+    int fw = filter.w, fh = filter.h;
+    int i;
+
+    row_axpy_fn axpy = row_axpy_scalar;
+#ifdef CONV_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) axpy = row_axpy_avx2;
+#endif
+    conv_plan *plans = image_arena_alloc(filter.c*sizeof(conv_plan));
+    float *factors = image_arena_alloc(filter.c*(fw + fh)*sizeof(float));
+    for(i = 0; i < filter.c; ++i){
+        plans[i].taps = filter.data + i*fw*fh;
+        plans[i].col = factors + i*(fw + fh);
+        plans[i].row = plans[i].col + fh;
+        plans[i].separable = separate_filter(plans[i].taps, fw, fh, plans[i].col, plans[i].row);
+        plans[i].axpy = axpy;
+    }
+
+    // A shared filter without preserve is linear in the channels, so the
+    // channels are summed while padding and convolved once.
+    int units = (filter.c == 1 && !preserve) ? 1 : im.c;
+
+    int tw = im.w;
+    while(tw > CONV_MIN_STRIP && (size_t)(fh + 1)*(tw + fw - 1)*sizeof(float) > CONV_L2_BYTES) tw /= 2;
+    int bh = MAX(CONV_MIN_BAND, 4*fh);
+    int strips = (im.w + tw - 1)/tw;
+    int bands = (im.h + bh - 1)/bh;
+
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    size_t scratch_size = (size_t)(fh + 1)*(tw + fw - 1);
+    float *scratch_all = image_arena_alloc(threads*scratch_size*sizeof(float));
+
+    #pragma omp parallel num_threads(threads)
+    {
+        float *scratch = scratch_all;
+#ifdef _OPENMP
+        scratch += omp_get_thread_num()*scratch_size;
+#endif
+        int t;
+        #pragma omp for schedule(dynamic)
+        for(t = 0; t < strips*bands; ++t){
+            int x0 = (t % strips)*tw;
+            int y0 = (t / strips)*bh;
+            int x1 = MIN(im.w, x0 + tw);
+            int y1 = MIN(im.h, y0 + bh);
+            int u;
+            for(u = 0; u < units; ++u){
+                int c0 = units == 1 ? 0 : u;
+                int nc = units == 1 ? im.c : 1;
+                float *out = view_row(dst, 0, preserve ? u : 0);
+                conv_plan plan = plans[filter.c == 1 ? 0 : u];
+                convolve_tile(im, filter, plan, c0, nc, out, dst.stride, !preserve && u > 0,
+                        x0, x1, y0, y1, scratch);
+            }
+        }
+    }
+
+    image_arena_free(scratch_all);
+    image_arena_free(plans);
+    image_arena_free(factors);
+}
+
+// Convolve an image with a filter, clamping reads to the image edges.
+// image im: image to filter.
+// image filter: filter with 1 channel or im.c channels.
+// int preserve: keep im.c channels, otherwise sum them into one.
+// returns: filtered image.
+image convolve_image(image im, image filter, int preserve)
+{
+    if(filter.c != 1 && filter.c != im.c) return make_image(1,1,1);
+
+    image result = make_image_uninit(im.w, im.h, preserve ? im.c : 1);
+    convolve_view(view_image(im), filter, preserve, view_image(result));
+    return result;
+}
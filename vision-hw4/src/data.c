@@ -7,14 +7,14 @@
 
 data random_batch(data d, int n)
 {
-    matrix X = {0};
-    matrix y = {0};
+    fmatrix X = {0};
+    fmatrix y = {0};
     X.shallow = y.shallow = 1;
     X.rows = y.rows = n;
     X.cols = d.X.cols;
     y.cols = d.y.cols;
-    X.data = calloc(n, sizeof(double*));
-    y.data = calloc(n, sizeof(double*));
+    X.data = calloc(n, sizeof(float*));
+    y.data = calloc(n, sizeof(float*));
     int i;
     for(i = 0; i < n; ++i){
         int ind = rand()%d.X.rows;
@@ -55,14 +55,14 @@ data load_classification_data(char *images, char *label_file, int bias)
     int cols = 0;
     int i;
     int count = 0;
-    matrix X;
-    matrix y = make_matrix(n, k);
+    fmatrix X;
+    fmatrix y = make_fmatrix(n, k);
     while(nd){
         char *path = (char *)nd->val;
         image im = load_image(path);
         if (!cols) {
             cols = im.w*im.h*im.c;
-            X = make_matrix(n, cols + (bias != 0));
+            X = make_fmatrix(n, cols + (bias != 0));
         }
         for (i = 0; i < cols; ++i){
             X.data[count][i] = im.data[i];
@@ -118,8 +118,8 @@ char *fgetl(FILE *fp)
 
 void free_data(data d)
 {
-    free_matrix(d.X);
-    free_matrix(d.y);
+    free_fmatrix(d.X);
+    free_fmatrix(d.y);
 }
 
 
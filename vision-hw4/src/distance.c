@@ -0,0 +1,342 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define DISTANCE_X86
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#define DISTANCE_NEON64
+#include <arm_neon.h>
+#endif
+#include "distance.h"
+
+// Bounded kernels compare the running sum against the bound once per block.
+#define DISTANCE_BLOCK 32
+
+typedef float (*float_kernel)(const float *a, const float *b, int n, float bound);
+typedef int (*bits_kernel)(const unsigned char *a, const unsigned char *b, int bytes);
+
+typedef struct{
+    const char *name;
+    float_kernel l1, l2;
+    bits_kernel hamming;
+} distance_kernels;
+
+static float l1_scalar(const float *a, const float *b, int n, float bound)
+{
+    float sum = 0;
+    int i = 0, j;
+    for(; i + DISTANCE_BLOCK <= n; i += DISTANCE_BLOCK){
+        float part = 0;
+        for(j = 0; j < DISTANCE_BLOCK; ++j) part += fabsf(a[i+j] - b[i+j]);
+        sum += part;
+        if(sum > bound) return sum;
+    }
+    for(; i < n; ++i) sum += fabsf(a[i] - b[i]);
+    return sum;
+}
+
+static float l2_scalar(const float *a, const float *b, int n, float bound)
+{
+    float sum = 0;
+    int i = 0, j;
+    for(; i + DISTANCE_BLOCK <= n; i += DISTANCE_BLOCK){
+        float part = 0;
+        for(j = 0; j < DISTANCE_BLOCK; ++j) part += (a[i+j] - b[i+j])*(a[i+j] - b[i+j]);
+        sum += part;
+        if(sum > bound) return sum;
+    }
+    for(; i < n; ++i) sum += (a[i] - b[i])*(a[i] - b[i]);
+    return sum;
+}
+
+static int hamming_scalar(const unsigned char *a, const unsigned char *b, int bytes)
+{
+    int count = 0, i = 0;
+    for(; i + 8 <= bytes; i += 8){
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        count += __builtin_popcountll(x ^ y);
+    }
+    for(; i < bytes; ++i) count += __builtin_popcount(a[i] ^ b[i]);
+    return count;
+}
+
+#ifdef DISTANCE_X86
+#define SSE2_L1(acc, d) acc = _mm_add_ps(acc, _mm_and_ps(d, _mm_castsi128_ps(_mm_set1_epi32(0x7fffffff))))
+#define SSE2_L2(acc, d) acc = _mm_add_ps(acc, _mm_mul_ps(d, d))
+
+__attribute__((target("sse2")))
+static float hsum_sse2(__m128 v)
+{
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+#define SSE2_KERNEL(name, ACC, tail) \
+__attribute__((target("sse2"))) \
+static float name(const float *a, const float *b, int n, float bound) \
+{ \
+    float sum = 0; \
+    int i = 0, j; \
+    for(; i + DISTANCE_BLOCK <= n; i += DISTANCE_BLOCK){ \
+        __m128 acc0 = _mm_setzero_ps(), acc1 = _mm_setzero_ps(); \
+        for(j = 0; j < DISTANCE_BLOCK; j += 8){ \
+            __m128 d0 = _mm_sub_ps(_mm_loadu_ps(a + i + j), _mm_loadu_ps(b + i + j)); \
+            __m128 d1 = _mm_sub_ps(_mm_loadu_ps(a + i + j + 4), _mm_loadu_ps(b + i + j + 4)); \
+            ACC(acc0, d0); \
+            ACC(acc1, d1); \
+        } \
+        sum += hsum_sse2(_mm_add_ps(acc0, acc1)); \
+        if(sum > bound) return sum; \
+    } \
+    __m128 acc = _mm_setzero_ps(); \
+    for(; i + 4 <= n; i += 4){ \
+        __m128 d = _mm_sub_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)); \
+        ACC(acc, d); \
+    } \
+    sum += hsum_sse2(acc); \
+    return sum + tail(a + i, b + i, n - i, INFINITY); \
+}
+
+SSE2_KERNEL(l1_sse2, SSE2_L1, l1_scalar)
+SSE2_KERNEL(l2_sse2, SSE2_L2, l2_scalar)
+
+#define AVX2_L1(acc, d) acc = _mm256_add_ps(acc, _mm256_andnot_ps(_mm256_set1_ps(-0.0f), d))
+#define AVX2_L2(acc, d) acc = _mm256_fmadd_ps(d, d, acc)
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+#define AVX2_KERNEL(name, ACC, tail) \
+__attribute__((target("avx2,fma"))) \
+static float name(const float *a, const float *b, int n, float bound) \
+{ \
+    float sum = 0; \
+    int i = 0, j; \
+    for(; i + DISTANCE_BLOCK <= n; i += DISTANCE_BLOCK){ \
+        __m256 acc0 = _mm256_setzero_ps(), acc1 = _mm256_setzero_ps(); \
+        for(j = 0; j < DISTANCE_BLOCK; j += 16){ \
+            __m256 d0 = _mm256_sub_ps(_mm256_loadu_ps(a + i + j), _mm256_loadu_ps(b + i + j)); \
+            __m256 d1 = _mm256_sub_ps(_mm256_loadu_ps(a + i + j + 8), _mm256_loadu_ps(b + i + j + 8)); \
+            ACC(acc0, d0); \
+            ACC(acc1, d1); \
+        } \
+        sum += hsum_avx2(_mm256_add_ps(acc0, acc1)); \
+        if(sum > bound) return sum; \
+    } \
+    __m256 acc = _mm256_setzero_ps(); \
+    for(; i + 8 <= n; i += 8){ \
+        __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)); \
+        ACC(acc, d); \
+    } \
+    sum += hsum_avx2(acc); \
+    return sum + tail(a + i, b + i, n - i, INFINITY); \
+}
+
+AVX2_KERNEL(l1_avx2, AVX2_L1, l1_scalar)
+AVX2_KERNEL(l2_avx2, AVX2_L2, l2_scalar)
+
+// Bytewise popcount with a nibble lookup table, summed with psadbw.
+__attribute__((target("avx2")))
+static int hamming_avx2(const unsigned char *a, const unsigned char *b, int bytes)
+{
+    const __m256i table = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+                                           0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i total = _mm256_setzero_si256();
+    int i = 0;
+    for(; i + 32 <= bytes; i += 32){
+        __m256i x = _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)(a + i)),
+                                     _mm256_loadu_si256((const __m256i *)(b + i)));
+        __m256i lo = _mm256_shuffle_epi8(table, _mm256_and_si256(x, low));
+        __m256i hi = _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(x, 4), low));
+        total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_add_epi8(lo, hi), _mm256_setzero_si256()));
+    }
+    int count = _mm256_extract_epi64(total, 0) + _mm256_extract_epi64(total, 1)
+              + _mm256_extract_epi64(total, 2) + _mm256_extract_epi64(total, 3);
+    return count + hamming_scalar(a + i, b + i, bytes - i);
+}
+
+#define AVX512_L1(acc, d) acc = _mm512_add_ps(acc, _mm512_abs_ps(d))
+#define AVX512_L2(acc, d) acc = _mm512_fmadd_ps(d, d, acc)
+
+// The tail is a masked load, so no scalar loop is needed.
+#define AVX512_KERNEL(name, ACC) \
+__attribute__((target("avx512f"))) \
+static float name(const float *a, const float *b, int n, float bound) \
+{ \
+    float sum = 0; \
+    int i = 0; \
+    for(; i + DISTANCE_BLOCK <= n; i += DISTANCE_BLOCK){ \
+        __m512 acc0 = _mm512_setzero_ps(), acc1 = _mm512_setzero_ps(); \
+        __m512 d0 = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i)); \
+        __m512 d1 = _mm512_sub_ps(_mm512_loadu_ps(a + i + 16), _mm512_loadu_ps(b + i + 16)); \
+        ACC(acc0, d0); \
+        ACC(acc1, d1); \
+        sum += _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1)); \
+        if(sum > bound) return sum; \
+    } \
+    __m512 acc = _mm512_setzero_ps(); \
+    for(; i < n; i += 16){ \
+        __mmask16 m = n - i >= 16 ? 0xffff : (__mmask16)((1u << (n - i)) - 1); \
+        __m512 d = _mm512_sub_ps(_mm512_maskz_loadu_ps(m, a + i), _mm512_maskz_loadu_ps(m, b + i)); \
+        ACC(acc, d); \
+    } \
+    return sum + _mm512_reduce_add_ps(acc); \
+}
+
+AVX512_KERNEL(l1_avx512, AVX512_L1)
+AVX512_KERNEL(l2_avx512, AVX512_L2)
+#endif
+
+#ifdef DISTANCE_NEON64
+#define NEON_L1(acc, d0, d1) acc = vaddq_f32(acc, vabdq_f32(d0, d1))
+#define NEON_L2(acc, d0, d1) do{ float32x4_t d = vsubq_f32(d0, d1); acc = vfmaq_f32(acc, d, d); }while(0)
+
+#define NEON_KERNEL(name, ACC, tail) \
+static float name(const float *a, const float *b, int n, float bound) \
+{ \
+    float sum = 0; \
+    int i = 0, j; \
+    for(; i + DISTANCE_BLOCK <= n; i += DISTANCE_BLOCK){ \
+        float32x4_t acc0 = vdupq_n_f32(0), acc1 = vdupq_n_f32(0); \
+        for(j = 0; j < DISTANCE_BLOCK; j += 8){ \
+            ACC(acc0, vld1q_f32(a + i + j), vld1q_f32(b + i + j)); \
+            ACC(acc1, vld1q_f32(a + i + j + 4), vld1q_f32(b + i + j + 4)); \
+        } \
+        sum += vaddvq_f32(vaddq_f32(acc0, acc1)); \
+        if(sum > bound) return sum; \
+    } \
+    float32x4_t acc = vdupq_n_f32(0); \
+    for(; i + 4 <= n; i += 4) ACC(acc, vld1q_f32(a + i), vld1q_f32(b + i)); \
+    sum += vaddvq_f32(acc); \
+    return sum + tail(a + i, b + i, n - i, INFINITY); \
+}
+
+NEON_KERNEL(l1_neon, NEON_L1, l1_scalar)
+NEON_KERNEL(l2_neon, NEON_L2, l2_scalar)
+
+static int hamming_neon(const unsigned char *a, const unsigned char *b, int bytes)
+{
+    int count = 0, i = 0;
+    for(; i + 16 <= bytes; i += 16){
+        count += vaddlvq_u8(vcntq_u8(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i))));
+    }
+    return count + hamming_scalar(a + i, b + i, bytes - i);
+}
+#endif
+
+// Kernels per instruction set, unsupported ones fall back to scalar code
+// and are never selected.
+static const distance_kernels kernels[DISTANCE_ISAS] = {
+    {"scalar", l1_scalar, l2_scalar, hamming_scalar},
+#ifdef DISTANCE_X86
+    {"sse2", l1_sse2, l2_sse2, hamming_scalar},
+    {"avx2", l1_avx2, l2_avx2, hamming_avx2},
+    {"avx512", l1_avx512, l2_avx512, hamming_avx2},
+#else
+    {"sse2", l1_scalar, l2_scalar, hamming_scalar},
+    {"avx2", l1_scalar, l2_scalar, hamming_scalar},
+    {"avx512", l1_scalar, l2_scalar, hamming_scalar},
+#endif
+#ifdef DISTANCE_NEON64
+    {"neon", l1_neon, l2_neon, hamming_neon},
+#else
+    {"neon", l1_scalar, l2_scalar, hamming_scalar},
+#endif
+};
+
+static DISTANCE_ISA active = DISTANCE_SCALAR;
+
+// Whether the CPU running this can use an instruction set.
+int distance_isa_supported(DISTANCE_ISA isa)
+{
+#ifdef DISTANCE_X86
+    __builtin_cpu_init();
+    if(isa == DISTANCE_SSE2) return __builtin_cpu_supports("sse2");
+    if(isa == DISTANCE_AVX2) return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+    if(isa == DISTANCE_AVX512) return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx2");
+#endif
+#ifdef DISTANCE_NEON64
+    if(isa == DISTANCE_NEON) return 1;
+#endif
+    return isa == DISTANCE_SCALAR;
+}
+
+// Pick the kernels used from now on, for tests and benchmarks. Must not
+// be called while other threads compute distances.
+// returns: 1 on success, 0 if the CPU does not support isa.
+int set_distance_isa(DISTANCE_ISA isa)
+{
+    if(isa < 0 || isa >= DISTANCE_ISAS || !distance_isa_supported(isa)) return 0;
+    active = isa;
+    return 1;
+}
+
+DISTANCE_ISA get_distance_isa()
+{
+    return active;
+}
+
+const char *distance_isa_name(DISTANCE_ISA isa)
+{
+    return kernels[isa].name;
+}
+
+// Select the best supported kernels before main runs.
+__attribute__((constructor))
+static void distance_init()
+{
+    int isa;
+    for(isa = DISTANCE_ISAS - 1; isa > DISTANCE_SCALAR; --isa){
+        if(set_distance_isa(isa)) return;
+    }
+    active = DISTANCE_SCALAR;
+}
+
+// L1 distance that gives up once it is known to exceed a bound.
+// float *a, *b: arrays to compare.
+// int n: number of values.
+// float bound: distances above this are not needed exactly.
+// returns: the distance, or some value > bound.
+float l1_distance_bounded(const float *a, const float *b, int n, float bound)
+{
+    return kernels[active].l1(a, b, n, bound);
+}
+
+// Squared L2 distance with the same early exit as l1_distance_bounded.
+float l2sq_distance_bounded(const float *a, const float *b, int n, float bound)
+{
+    return kernels[active].l2(a, b, n, bound);
+}
+
+float l2sq_distance(const float *a, const float *b, int n)
+{
+    return kernels[active].l2(a, b, n, INFINITY);
+}
+
+// Distance between float descriptors under a metric, L2 is squared.
+float descriptor_distance(DISTANCE metric, const float *a, const float *b, int n, float bound)
+{
+    if(metric == DISTANCE_L2) return kernels[active].l2(a, b, n, bound);
+    return kernels[active].l1(a, b, n, bound);
+}
+
+// Number of differing bits between two binary descriptors.
+// unsigned char *a, *b: packed bits.
+// int bytes: length of each descriptor in bytes.
+int hamming_distance(const unsigned char *a, const unsigned char *b, int bytes)
+{
+    return kernels[active].hamming(a, b, bytes);
+}
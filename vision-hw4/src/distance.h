@@ -0,0 +1,20 @@
+#ifndef DISTANCE_H
+#define DISTANCE_H
+
+// Descriptor distance kernels. Each kernel has a portable version and SIMD
+// versions, and the fastest one the CPU supports is picked at startup.
+
+typedef enum{DISTANCE_L1, DISTANCE_L2} DISTANCE;
+typedef enum{DISTANCE_SCALAR, DISTANCE_SSE2, DISTANCE_AVX2, DISTANCE_AVX512, DISTANCE_NEON, DISTANCE_ISAS} DISTANCE_ISA;
+
+int distance_isa_supported(DISTANCE_ISA isa);
+int set_distance_isa(DISTANCE_ISA isa);
+DISTANCE_ISA get_distance_isa();
+const char *distance_isa_name(DISTANCE_ISA isa);
+
+float l1_distance_bounded(const float *a, const float *b, int n, float bound);
+float l2sq_distance_bounded(const float *a, const float *b, int n, float bound);
+float l2sq_distance(const float *a, const float *b, int n);
+float descriptor_distance(DISTANCE metric, const float *a, const float *b, int n, float bound);
+int hamming_distance(const unsigned char *a, const unsigned char *b, int bytes);
+#endif
@@ -32,7 +32,9 @@ image make_box_filter(int w)
 	return im;
 }
 
-image convolve_image(image im, image filter, int preserve)
+// Straightforward get_pixel convolution. The fast engine lives in
+// convolve_image.c, this one is kept to check and benchmark it against.
+image convolve_image_reference(image im, image filter, int preserve)
 {
 	if (filter.c == 1 && im.c > 1) {
 		if(preserve) {
@@ -205,28 +207,16 @@ image make_gaussian_filter(float sigma)
 image add_image(image a, image b)
 {
 	assert(a.w == b.w && a.h == b.h && a.c == b.c);
-    image result = make_image(a.w, a.h, a.c);
-	for (int i = 0; i < a.w; ++i) {
-		for (int j = 0; j < a.h; ++j) {
-			for (int k = 0; k < a.c; ++k) {
-				set_pixel(result, i, j, k, get_pixel(a, i, j, k) + get_pixel(b, i, j, k));
-			}
-		}
-	}
-    return result;
+	image result = make_image_uninit(a.w, a.h, a.c);
+	add_view(view_image(a), view_image(b), view_image(result));
+	return result;
 }
 
 image sub_image(image a, image b)
 {
 	assert(a.w == b.w && a.h == b.h && a.c == b.c);
-	image result = make_image(a.w, a.h, a.c);
-	for (int i = 0; i < a.w; ++i) {
-		for (int j = 0; j < a.h; ++j) {
-			for (int k = 0; k < a.c; ++k) {
-				set_pixel(result, i, j, k, get_pixel(a, i, j, k) - get_pixel(b, i, j, k));
-			}
-		}
-	}
+	image result = make_image_uninit(a.w, a.h, a.c);
+	sub_view(view_image(a), view_image(b), view_image(result));
 	return result;
 }
 
@@ -298,17 +288,8 @@ void feature_normalize(image im)
 image mult_image(image a, image b)
 {
 	assert(a.w == b.w && a.h == b.h && a.c == b.c);
-	image result = make_image(a.w, a.h, a.c);
-
-#pragma omp parallel for
-	for (int i = 0; i < a.w; ++i) {
-#pragma omp parallel for
-		for (int j = 0; j < a.h; ++j) {
-			for (int k = 0; k < a.c; ++k) {
-				set_pixel(result, i, j, k, get_pixel(a, i, j, k) * get_pixel(b, i, j, k));
-			}
-		}
-	}
+	image result = make_image_uninit(a.w, a.h, a.c);
+	mult_view(view_image(a), view_image(b), view_image(result));
 	return result;
 }
 
@@ -41,62 +41,137 @@ void draw_line(image im, float x, float y, float dx, float dy)
     }
 }
 
-// Make an integral image or summed area table from an image
-// image im: image to process
-// returns: image I such that I[x,y] = sum{i<=x, j<=y}(im[i,j])
-image make_integral_image(image im)
+// Entry of a summed area table, clamped to the table like get_pixel.
+static double table_at(integral_image t, int x, int y, int k)
 {
-    image integ = make_image(im.w, im.h, im.c);
+    x = MIN(MAX(x, 0), t.w - 1);
+    y = MIN(MAX(y, 0), t.h - 1);
+    return t.data[(size_t)k*t.w*t.h + (size_t)y*t.w + x];
+}
 
-#pragma omp parallel for
-	for (int i = 0; i < im.w; ++i) {
-#pragma omp parallel for
-		for (int j = 0; j < im.h; ++j) {
-			for (int k = 0; k < im.c; ++k) {
-				float sum = i == 0? 0.0f : get_pixel(integ, i - 1, j, k);
+// Columns filtered per task in the vertical pass of box_filter_view.
+#define BOX_COLUMNS 256
 
-#pragma omp parallel for
-				for (int m = 0; m <= j; ++m) {
-					sum += get_pixel(im, i, m, k);
-				}
+// One step of a running box sum near the ends of a row, where the window
+// is cut. Returns the average of pixel x and slides the sum to x+1.
+static inline float box_cut(const float *src, int n, int l, int r, int x, double *sum)
+{
+    int lo = x - l, hi = x + r;
+    float v = *sum / (MIN(hi, n - 1) - MAX(lo, 0) + 1);
+    if(hi + 1 < n) *sum += src[hi + 1];
+    if(lo >= 0) *sum -= src[lo];
+    return v;
+}
 
-				set_pixel(integ, i, j, k, sum);
-			}
-		}
-	}
-    return integ;
+// Box filter one row with a running sum.
+// const float *src, float *dst: rows of n pixels.
+// int l, r: the window of pixel x is [x-l, x+r], cut to the row.
+static void box_row(const float *src, int n, int l, int r, float *dst)
+{
+    double sum = 0;
+    double norm = 1.0/(l + r + 1);
+    int x;
+    for(x = 0; x <= r && x < n; ++x) sum += src[x];
+    // Windows in the middle are whole, only the ends are cut.
+    int a = MIN(l, n), b = MAX(a, n - 1 - r);
+    for(x = 0; x < a; ++x) dst[x] = box_cut(src, n, l, r, x, &sum);
+    for(; x < b; ++x){
+        dst[x] = sum*norm;
+        sum += src[x + r + 1] - src[x - l];
+    }
+    for(; x < n; ++x) dst[x] = box_cut(src, n, l, r, x, &sum);
 }
 
-// Apply a box filter to an image using an integral image for speed
+// Apply a box filter to a view with running sums, a horizontal pass and
+// then a vertical one, so the cost per pixel doesn't depend on the window.
+// Windows are cut at the borders and averaged over the pixels they keep.
+// image_view im: view to smooth, every channel is filtered in one call.
+// int s: window size for box filter, odd sizes are centered.
+// image_view dst: view of the same size to write the result to
+void box_filter_view(image_view im, int s, image_view dst)
+{
+    assert(dst.w == im.w && dst.h == im.h && dst.c == im.c && s > 0);
+    int l = s/2, r = s - 1 - s/2;
+    int w = im.w, h = im.h;
+    int i;
+
+    image_arena_begin();
+    image rows = make_image_uninit(w, h, im.c);
+    #pragma omp parallel for
+    for(i = 0; i < h*im.c; ++i){
+        int y = i % h, k = i / h;
+        box_row(view_row(im, y, k), w, l, r, rows.data + (size_t)k*w*h + (size_t)y*w);
+    }
+
+    // Down blocks of columns, adding the row entering the window and
+    // dropping the one leaving it.
+    int blocks = (w + BOX_COLUMNS - 1)/BOX_COLUMNS;
+    #pragma omp parallel for
+    for(i = 0; i < blocks*im.c; ++i){
+        int k = i / blocks;
+        int x0 = (i % blocks)*BOX_COLUMNS, n = MIN(w - x0, BOX_COLUMNS);
+        const float *plane = rows.data + (size_t)k*w*h + x0;
+        double sum[BOX_COLUMNS] = {0};
+        int x, y;
+        for(y = 0; y <= r && y < h; ++y){
+            for(x = 0; x < n; ++x) sum[x] += plane[(size_t)y*w + x];
+        }
+        for(y = 0; y < h; ++y){
+            int lo = y - l, hi = y + r;
+            double norm = 1.0 / (MIN(hi, h - 1) - MAX(lo, 0) + 1);
+            float *out = view_row(dst, y, k) + x0;
+            for(x = 0; x < n; ++x) out[x] = sum[x]*norm;
+            if(hi + 1 < h){
+                const float *in = plane + (size_t)(hi + 1)*w;
+                for(x = 0; x < n; ++x) sum[x] += in[x];
+            }
+            if(lo >= 0){
+                const float *old = plane + (size_t)lo*w;
+                for(x = 0; x < n; ++x) sum[x] -= old[x];
+            }
+        }
+    }
+    image_arena_end();
+}
+
+// Apply a box filter to an image
 // image im: image to smooth
 // int s: window size for box filter
 // returns: smoothed image
 image box_filter_image(image im, int s)
 {
+    image S = make_image_uninit(im.w, im.h, im.c);
+    box_filter_view(view_image(im), s, view_image(S));
+    return S;
+}
+
+// Original box filter from an integral image, with clamped corners and a
+// fixed 1/s^2 scale, kept for benchmarks.
+image box_filter_image_reference(image im, int s)
+{
+	image S = make_image_uninit(im.w, im.h, im.c);
 	int halfWidth = s/2;
 
 	float boxConstant = 1.0f/(s*s);
 
-    image integ = make_integral_image(im);
-    image S = make_image(im.w, im.h, im.c);
+	integral_image integ = integral_table(view_image(im));
 
 #pragma omp parallel for
-	for (int i = 0; i < im.w; ++i) {
-#pragma omp parallel for
-		for (int j = 0; j < im.h; ++j) {
-			for (int k = 0; k < im.c; ++k) {
-				float a = get_pixel(integ, i - halfWidth, j - halfWidth, k);
-				float b = get_pixel(integ, i + halfWidth, j - halfWidth, k);
-				float c = get_pixel(integ, i - halfWidth, j + halfWidth, k);
-				float d = get_pixel(integ, i + halfWidth, j + halfWidth, k);
+	for (int j = 0; j < im.h; ++j) {
+		for (int k = 0; k < im.c; ++k) {
+			for (int i = 0; i < im.w; ++i) {
+				double a = table_at(integ, i - halfWidth, j - halfWidth, k);
+				double b = table_at(integ, i + halfWidth, j - halfWidth, k);
+				double c = table_at(integ, i - halfWidth, j + halfWidth, k);
+				double d = table_at(integ, i + halfWidth, j + halfWidth, k);
 
 				float boxSum = d - b - c + a;
 				set_pixel(S, i, j, k, boxConstant * boxSum);
 			}
 		}
 	}
-
-    return S;
+	free_integral_table(integ);
+	return S;
 }
 
 // Calculate the time-structure matrix of an image pair.
@@ -107,61 +182,91 @@ image box_filter_image(image im, int s)
 //          3rd channel is IxIy, 4th channel is IxIt, 5th channel is IyIt.
 image time_structure_matrix(image im, image prev, int s)
 {
-    int converted = 0;
+    image S = make_image_uninit(im.w, im.h, 5);
+
+    // Everything but the result is a temporary, keep them in the arena.
+    image_arena_begin();
     if(im.c == 3){
-        converted = 1;
         im = rgb_to_grayscale(im);
         prev = rgb_to_grayscale(prev);
     }
 
-    image S = make_image(im.w, im.h, 5);
-
 	image gxFilter = make_gx_filter();
-	image Ix = convolve_image(im, gxFilter, 0);
-	image Ix_2 = mult_image(Ix, Ix);
-	insert_channel(S, Ix_2, 0);
-	free_image(gxFilter);
-	free_image(Ix_2);
-
 	image gyFilter = make_gy_filter();
-	image Iy = convolve_image(im, gyFilter, 0);
-	image Iy_2 = mult_image(Iy, Iy);
-	insert_channel(S, Iy_2, 1);
-	free_image(gyFilter);
-	free_image(Iy_2);
-
-	image IxIy = mult_image(Ix, Iy);
-	insert_channel(S, IxIy, 2);
-	free_image(IxIy);
-
-	image It = sub_image(im, prev);
-	image IxIt = mult_image(Ix, It);
-	insert_channel(S, IxIt, 3);
-	free_image(Ix);
-	free_image(IxIt);
-
-	image IyIt = mult_image(Iy, It);
-	insert_channel(S, IyIt, 4);
-	free_image(Iy);
-	free_image(It);
-	free_image(IyIt);
-
-	//image smoothed = smooth_image(S, 2);
-	//free_image(S);
-
-	image box = box_filter_image(S, s);
-	free_image(S);
-
-    if(converted){
-        free_image(im); free_image(prev);
+	image Ix = make_image_uninit(im.w, im.h, 1);
+	image Iy = make_image_uninit(im.w, im.h, 1);
+	image It = make_image_uninit(im.w, im.h, 1);
+	convolve_view(view_image(im), gxFilter, 0, view_image(Ix));
+	convolve_view(view_image(im), gyFilter, 0, view_image(Iy));
+	sub_view(view_image(im), view_image(prev), view_image(It));
+
+	image products = make_image_uninit(im.w, im.h, 5);
+	image_view p = view_image(products);
+	mult_view(view_image(Ix), view_image(Ix), view_channel(p, 0));
+	mult_view(view_image(Iy), view_image(Iy), view_channel(p, 1));
+	mult_view(view_image(Ix), view_image(Iy), view_channel(p, 2));
+	mult_view(view_image(Ix), view_image(It), view_channel(p, 3));
+	mult_view(view_image(Iy), view_image(It), view_channel(p, 4));
+
+	box_filter_view(p, s, view_image(S));
+
+	image_arena_end();
+    return S;
+}
+
+// Structure matrices whose smaller eigenvalue is below this give no flow.
+#define VELOCITY_MIN_EIGEN 1e-6f
+
+// Solve the flow equations at every stride-th pixel of a time-structure
+// matrix. Each pixel is the symmetric system [Ixx Ixy; Ixy Iyy] v =
+// -[IxIt IyIt], solved in closed form. The loop has no branches, so it
+// vectorizes.
+// image_view S: time-structure matrix, 5 channels.
+// int stride: only calculate subset of pixels for speed.
+// float min_eigen: ill-conditioned pixels get 0 velocity.
+// image_view v: S.w/stride x S.h/stride view, x velocity in channel 0 and
+//               y in channel 1.
+void velocity_view(image_view S, int stride, float min_eigen, image_view v)
+{
+    assert(S.c == 5 && v.c >= 2 && v.w == S.w/stride && v.h == S.h/stride);
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < v.h; ++y){
+        int j = y*stride + (stride-1)/2;
+        const float *xx = view_row(S, j, 0) + (stride-1)/2;
+        const float *yy = view_row(S, j, 1) + (stride-1)/2;
+        const float *xy = view_row(S, j, 2) + (stride-1)/2;
+        const float *xt = view_row(S, j, 3) + (stride-1)/2;
+        const float *yt = view_row(S, j, 4) + (stride-1)/2;
+        float *vx = view_row(v, y, 0);
+        float *vy = view_row(v, y, 1);
+        int x;
+        for(x = 0; x < v.w; ++x){
+            int i = x*stride;
+            float a = xx[i], b = yy[i], c = xy[i];
+            float det = a*b - c*c;
+            float half = .5f*(a - b);
+            float lambda = .5f*(a + b) - sqrtf(half*half + c*c);
+            float inv = lambda > min_eigen ? 1/det : 0;
+            vx[x] = (c*yt[i] - b*xt[i])*inv;
+            vy[x] = (c*xt[i] - a*yt[i])*inv;
+        }
     }
-    return box;
 }
 
 // Calculate the velocity given a structure image
 // image S: time-structure image
 // int stride: only calculate subset of pixels for speed
 image velocity_image(image S, int stride)
+{
+    image v = make_image(S.w/stride, S.h/stride, 3);
+    velocity_view(view_image(S), stride, VELOCITY_MIN_EIGEN, view_image(v));
+    return v;
+}
+
+// Original velocity_image with a matrix_invert per pixel, kept for tests
+// and benchmarks.
+image velocity_image_reference(image S, int stride)
 {
     image v = make_image(S.w/stride, S.h/stride, 3);
     int i, j;
@@ -241,15 +346,266 @@ void constrain_image(image im, float v)
 // returns: velocity matrix
 image optical_flow_images(image im, image prev, int smooth, int stride)
 {
+    image vs = make_image_uninit(im.w/stride, im.h/stride, 3);
+
+    // Only the smoothed velocity outlives this call, the structure matrix
+    // and raw velocity go in the arena.
+    image_arena_begin();
     image S = time_structure_matrix(im, prev, smooth);
     image v = velocity_image(S, stride);
     constrain_image(v, 6);
-    image vs = smooth_image(v, 2);
-    free_image(v);
-    free_image(S);
+    smooth_view(view_image(v), 2, view_image(vs));
+    image_arena_end();
     return vs;
 }
 
+flow_params default_flow_params()
+{
+    flow_params p;
+    p.levels = 4;
+    p.window = 9;
+    p.iterations = 5;
+    p.stride = 8;
+    p.min_eigen = 1e-6;
+    return p;
+}
+
+// Largest window track_points_lk uses.
+#define LK_MAX_WINDOW 31
+
+// Bilinear sample of a 1 channel image, clamping reads to the edges.
+static inline float sample_gray(image im, float x, float y)
+{
+    x = MIN(MAX(x, 0), im.w - 1);
+    y = MIN(MAX(y, 0), im.h - 1);
+    int l = (int)x, t = (int)y;
+    int r = MIN(l + 1, im.w - 1), b = MIN(t + 1, im.h - 1);
+    float tx = x - l, ty = y - t;
+    const float *top = im.data + t*im.w, *bottom = im.data + b*im.w;
+    float u = top[l] + (top[r] - top[l])*tx;
+    float d = bottom[l] + (bottom[r] - bottom[l])*tx;
+    return u + (d - u)*ty;
+}
+
+// Sample a square window of a 1 channel image centred at (x, y). Every
+// sample has the same bilinear fractions, so away from the edges each one
+// is four reads and three lerps.
+// int r: window radius, the window is (2r+1) x (2r+1).
+// float *dst: window in row-major order.
+static void sample_window(image im, float x, float y, int r, float *dst)
+{
+    int n = 2*r + 1;
+    int l = (int)floorf(x) - r, t = (int)floorf(y) - r;
+    if(l < 0 || t < 0 || l + n >= im.w || t + n >= im.h){
+        int wx, wy;
+        for(wy = 0; wy < n; ++wy){
+            for(wx = 0; wx < n; ++wx) dst[wx + wy*n] = sample_gray(im, x - r + wx, y - r + wy);
+        }
+        return;
+    }
+    float tx = x - floorf(x), ty = y - floorf(y);
+    int wx, wy;
+    for(wy = 0; wy < n; ++wy){
+        const float *top = im.data + (t + wy)*im.w + l;
+        const float *bottom = top + im.w;
+        float *out = dst + wy*n;
+        for(wx = 0; wx < n; ++wx){
+            float u = top[wx] + (top[wx+1] - top[wx])*tx;
+            float d = bottom[wx] + (bottom[wx+1] - bottom[wx])*tx;
+            out[wx] = u + (d - u)*ty;
+        }
+    }
+}
+
+// Central difference gradients of a 1 channel image, clamped at the edges.
+static void gradient_images(image im, image gx, image gy)
+{
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < im.h; ++y){
+        const float *row = im.data + y*im.w;
+        const float *up = im.data + MAX(y-1, 0)*im.w;
+        const float *down = im.data + MIN(y+1, im.h-1)*im.w;
+        int x;
+        for(x = 0; x < im.w; ++x){
+            gx.data[x + y*im.w] = .5f*(row[MIN(x+1, im.w-1)] - row[MAX(x-1, 0)]);
+            gy.data[x + y*im.w] = .5f*(down[x] - up[x]);
+        }
+    }
+}
+
+// Pyramids and gradients of an image pair for Lucas-Kanade.
+// pyramid prev, im: grayscale pyramids.
+// image *gx, *gy: gradients of every level of prev.
+typedef struct{
+    pyramid prev, im;
+    image *gx, *gy;
+} lk_pyramids;
+
+// Gaussian pyramid of the grayscale version of an image.
+static pyramid gray_pyramid(image im, int levels)
+{
+    if(im.c == 3){
+        image gray = rgb_to_grayscale(im);
+        pyramid p = make_pyramid(gray, levels);
+        free_image(gray);
+        return p;
+    }
+    image first = im;
+    first.c = 1;
+    return make_pyramid(first, levels);
+}
+
+static lk_pyramids make_lk_pyramids(image im, image prev, int levels)
+{
+    lk_pyramids k;
+    k.prev = gray_pyramid(prev, levels);
+    k.im = gray_pyramid(im, k.prev.levels);
+    k.gx = calloc(k.prev.levels, sizeof(image));
+    k.gy = calloc(k.prev.levels, sizeof(image));
+    int l;
+    for(l = 0; l < k.prev.levels; ++l){
+        image a = k.prev.level[l];
+        k.gx[l] = make_image_uninit(a.w, a.h, 1);
+        k.gy[l] = make_image_uninit(a.w, a.h, 1);
+        gradient_images(a, k.gx[l], k.gy[l]);
+    }
+    return k;
+}
+
+static void free_lk_pyramids(lk_pyramids k)
+{
+    int l;
+    for(l = 0; l < k.prev.levels; ++l){
+        free_image(k.gx[l]);
+        free_image(k.gy[l]);
+    }
+    free(k.gx);
+    free(k.gy);
+    free_pyramid(k.im);
+    free_pyramid(k.prev);
+}
+
+// Track one point with pyramidal Lucas-Kanade: fit the motion of its window
+// on the coarsest level, then double it and refine on each finer level.
+// point pt: point in prev.
+// float *dx, *dy: motion of the point from prev to im.
+// returns: 0 if the window lacks texture on the finest level.
+static int track_point(lk_pyramids k, point pt, flow_params p, float *dx, float *dy)
+{
+    float T[LK_MAX_WINDOW*LK_MAX_WINDOW], GX[LK_MAX_WINDOW*LK_MAX_WINDOW];
+    float GY[LK_MAX_WINDOW*LK_MAX_WINDOW], W[LK_MAX_WINDOW*LK_MAX_WINDOW];
+    int r = MIN(MAX(p.window, 3), LK_MAX_WINDOW)/2;
+    int n = (2*r + 1)*(2*r + 1);
+    float min_eigen = p.min_eigen*n;
+    // Motion found so far, in level 0 pixels.
+    float gux = 0, guy = 0;
+    int l, i, it;
+    for(l = k.prev.levels - 1; l >= 0; --l){
+        float s = 1.f/(1 << l);
+        float ux = pt.x*s, uy = pt.y*s;
+        float vx = gux*s, vy = guy*s;
+        sample_window(k.prev.level[l], ux, uy, r, T);
+        sample_window(k.gx[l], ux, uy, r, GX);
+        sample_window(k.gy[l], ux, uy, r, GY);
+        float xx = 0, yy = 0, xy = 0;
+        for(i = 0; i < n; ++i){
+            xx += GX[i]*GX[i];
+            yy += GY[i]*GY[i];
+            xy += GX[i]*GY[i];
+        }
+        float det = xx*yy - xy*xy;
+        float tr = .5f*(xx + yy);
+        float lambda = tr - sqrtf(MAX(tr*tr - det, 0));
+        if(!(lambda > min_eigen) || det == 0){
+            // Keep the coarser guess, but a flat window on the finest
+            // level can't be tracked.
+            if(l == 0) return 0;
+            continue;
+        }
+        for(it = 0; it < p.iterations; ++it){
+            sample_window(k.im.level[l], ux + vx, uy + vy, r, W);
+            float bx = 0, by = 0;
+            for(i = 0; i < n; ++i){
+                float d = T[i] - W[i];
+                bx += GX[i]*d;
+                by += GY[i]*d;
+            }
+            float ex = (yy*bx - xy*by)/det;
+            float ey = (xx*by - xy*bx)/det;
+            vx += ex;
+            vy += ey;
+            if(ex*ex + ey*ey < 1e-4f) break;
+        }
+        gux = vx/s;
+        guy = vy/s;
+    }
+    *dx = gux;
+    *dy = guy;
+    return 1;
+}
+
+// Dense pyramidal Lucas-Kanade optical flow on a grid. The window around
+// every p.stride-th pixel is tracked from prev to im.
+// image im: current image.
+// image prev: previous image.
+// flow_params p: pyramid and solver settings.
+// returns: velocity image like optical_flow_images, 0 where the window is
+//          too flat to track.
+image optical_flow_lk(image im, image prev, flow_params p)
+{
+    assert(im.w == prev.w && im.h == prev.h && im.c == prev.c);
+    int stride = MAX(p.stride, 1);
+    image v = make_image(im.w/stride, im.h/stride, 3);
+    image_arena_begin();
+    lk_pyramids k = make_lk_pyramids(im, prev, p.levels);
+    int i;
+    #pragma omp parallel for schedule(dynamic, 16)
+    for(i = 0; i < v.w*v.h; ++i){
+        int x = i % v.w, y = i / v.w;
+        point pt = make_point(x*stride + (stride-1)/2, y*stride + (stride-1)/2);
+        float dx, dy;
+        if(track_point(k, pt, p, &dx, &dy)){
+            v.data[i] = dx;
+            v.data[i + v.w*v.h] = dy;
+        }
+    }
+    free_lk_pyramids(k);
+    image_arena_end();
+    return v;
+}
+
+// Track points, such as Harris corners, from one image to the next with
+// pyramidal Lucas-Kanade.
+// image im: current image.
+// image prev: previous image the points are in.
+// point *pts: n points to track.
+// flow_params p: pyramid and solver settings, windows are at most 31 wide.
+// point *out: where each point moved to.
+// int *status: 1 for points tracked, 0 for points lost because their
+//              window is too flat or they left the image.
+// returns: number of points tracked.
+int track_points_lk(image im, image prev, const point *pts, int n, flow_params p, point *out, int *status)
+{
+    assert(im.w == prev.w && im.h == prev.h && im.c == prev.c);
+    image_arena_begin();
+    lk_pyramids k = make_lk_pyramids(im, prev, p.levels);
+    int i, tracked = 0;
+    #pragma omp parallel for schedule(dynamic, 16) reduction(+:tracked)
+    for(i = 0; i < n; ++i){
+        float dx = 0, dy = 0;
+        int ok = track_point(k, pts[i], p, &dx, &dy);
+        out[i].x = pts[i].x + dx;
+        out[i].y = pts[i].y + dy;
+        ok = ok && out[i].x >= 0 && out[i].x <= im.w - 1 && out[i].y >= 0 && out[i].y <= im.h - 1;
+        status[i] = ok;
+        tracked += ok;
+    }
+    free_lk_pyramids(k);
+    image_arena_end();
+    return tracked;
+}
+
 // Run optical flow demo on webcam
 // int smooth: amount to smooth structure matrix by
 // int stride: downsampling for velocity matrix
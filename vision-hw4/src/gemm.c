@@ -0,0 +1,435 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define GEMM_X86
+#include <immintrin.h>
+#endif
+#include "image.h"
+#include "matrix.h"
+
+// Blocked matrix multiplication. B is copied a KC x NC block at a time into
+// panels NR columns wide, and A a MC x KC block at a time into panels MR
+// rows tall, so the micro kernel streams both from contiguous memory while
+// an MR x NR tile of C stays in registers. Threads split the rows of C
+// within each B block, every thread packing its own A. Packing reads the
+// operands through their row pointers, so shallow matrices work too.
+
+#define GEMM_MR 6
+#define GEMM_NR 8
+#define GEMM_KC 256
+#define GEMM_MC 96
+#define GEMM_NC 2048
+
+// Below this many multiply-adds packing costs more than it saves.
+#define GEMM_SMALL (32*32*32)
+
+typedef void (*gemm_kernel)(int kc, const double *a, const double *b, double *t);
+
+// Packing buffers are kept per thread and only grow, so repeated products
+// of the same sizes don't allocate. gemm_release frees the calling
+// thread's buffers.
+typedef struct{
+    void *a, *b;
+    size_t asize, bsize;
+} gemm_buffers;
+
+static __thread gemm_buffers buffers;
+
+static void *gemm_buffer(void **buf, size_t *size, size_t bytes)
+{
+    if(*size < bytes){
+        free(*buf);
+        *buf = 0;
+        *size = 0;
+        if(posix_memalign(buf, 64, bytes)) return *buf = 0;
+        *size = bytes;
+    }
+    return *buf;
+}
+
+void gemm_release()
+{
+    free(buffers.a);
+    free(buffers.b);
+    buffers.a = buffers.b = 0;
+    buffers.asize = buffers.bsize = 0;
+}
+
+// Copy rows i0..i0+mc, columns k0..k0+kc of op(A) into MR row panels,
+// each stored column by column and padded with zeros to MR rows.
+// int ta: A is stored transposed, op(A)[i][k] = a[k][i].
+static void pack_a(double **a, int ta, int i0, int k0, int mc, int kc, double *dst)
+{
+    int ir, p, r;
+    for(ir = 0; ir < mc; ir += GEMM_MR){
+        int m = MIN(GEMM_MR, mc - ir);
+        if(ta){
+            for(p = 0; p < kc; ++p){
+                const double *row = a[k0 + p] + i0 + ir;
+                for(r = 0; r < m; ++r) dst[r] = row[r];
+                for(; r < GEMM_MR; ++r) dst[r] = 0;
+                dst += GEMM_MR;
+            }
+            continue;
+        }
+        const double *rows[GEMM_MR];
+        for(r = 0; r < m; ++r) rows[r] = a[i0 + ir + r] + k0;
+        for(p = 0; p < kc; ++p){
+            for(r = 0; r < m; ++r) dst[r] = rows[r][p];
+            for(; r < GEMM_MR; ++r) dst[r] = 0;
+            dst += GEMM_MR;
+        }
+    }
+}
+
+// Copy rows k0..k0+kc, columns j0..j0+n of op(B) into one panel stored row
+// by row and padded with zeros to NR columns.
+// int tb: B is stored transposed, op(B)[k][j] = b[j][k].
+static void pack_b_panel(double **b, int tb, int k0, int j0, int kc, int n, double *dst)
+{
+    int p, q;
+    if(tb){
+        const double *cols[GEMM_NR];
+        for(q = 0; q < n; ++q) cols[q] = b[j0 + q] + k0;
+        for(p = 0; p < kc; ++p){
+            for(q = 0; q < n; ++q) dst[q] = cols[q][p];
+            for(; q < GEMM_NR; ++q) dst[q] = 0;
+            dst += GEMM_NR;
+        }
+        return;
+    }
+    for(p = 0; p < kc; ++p){
+        const double *row = b[k0 + p] + j0;
+        for(q = 0; q < n; ++q) dst[q] = row[q];
+        for(; q < GEMM_NR; ++q) dst[q] = 0;
+        dst += GEMM_NR;
+    }
+}
+
+// t = a*b for one MR x NR tile from packed panels.
+static void kernel_scalar(int kc, const double *a, const double *b, double *t)
+{
+    int p, r, q;
+    for(r = 0; r < GEMM_MR*GEMM_NR; ++r) t[r] = 0;
+    for(p = 0; p < kc; ++p, a += GEMM_MR, b += GEMM_NR){
+        for(r = 0; r < GEMM_MR; ++r){
+            double ar = a[r];
+            for(q = 0; q < GEMM_NR; ++q) t[r*GEMM_NR + q] += ar*b[q];
+        }
+    }
+}
+
+#ifdef GEMM_X86
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(int kc, const double *a, const double *b, double *t)
+{
+    __m256d c00 = _mm256_setzero_pd(), c01 = _mm256_setzero_pd();
+    __m256d c10 = _mm256_setzero_pd(), c11 = _mm256_setzero_pd();
+    __m256d c20 = _mm256_setzero_pd(), c21 = _mm256_setzero_pd();
+    __m256d c30 = _mm256_setzero_pd(), c31 = _mm256_setzero_pd();
+    __m256d c40 = _mm256_setzero_pd(), c41 = _mm256_setzero_pd();
+    __m256d c50 = _mm256_setzero_pd(), c51 = _mm256_setzero_pd();
+    int p;
+    for(p = 0; p < kc; ++p, a += GEMM_MR, b += GEMM_NR){
+        __m256d b0 = _mm256_load_pd(b);
+        __m256d b1 = _mm256_load_pd(b + 4);
+        __m256d ar;
+        ar = _mm256_broadcast_sd(a + 0);
+        c00 = _mm256_fmadd_pd(ar, b0, c00); c01 = _mm256_fmadd_pd(ar, b1, c01);
+        ar = _mm256_broadcast_sd(a + 1);
+        c10 = _mm256_fmadd_pd(ar, b0, c10); c11 = _mm256_fmadd_pd(ar, b1, c11);
+        ar = _mm256_broadcast_sd(a + 2);
+        c20 = _mm256_fmadd_pd(ar, b0, c20); c21 = _mm256_fmadd_pd(ar, b1, c21);
+        ar = _mm256_broadcast_sd(a + 3);
+        c30 = _mm256_fmadd_pd(ar, b0, c30); c31 = _mm256_fmadd_pd(ar, b1, c31);
+        ar = _mm256_broadcast_sd(a + 4);
+        c40 = _mm256_fmadd_pd(ar, b0, c40); c41 = _mm256_fmadd_pd(ar, b1, c41);
+        ar = _mm256_broadcast_sd(a + 5);
+        c50 = _mm256_fmadd_pd(ar, b0, c50); c51 = _mm256_fmadd_pd(ar, b1, c51);
+    }
+    _mm256_store_pd(t + 0, c00);  _mm256_store_pd(t + 4, c01);
+    _mm256_store_pd(t + 8, c10);  _mm256_store_pd(t + 12, c11);
+    _mm256_store_pd(t + 16, c20); _mm256_store_pd(t + 20, c21);
+    _mm256_store_pd(t + 24, c30); _mm256_store_pd(t + 28, c31);
+    _mm256_store_pd(t + 32, c40); _mm256_store_pd(t + 36, c41);
+    _mm256_store_pd(t + 40, c50); _mm256_store_pd(t + 44, c51);
+}
+#endif
+
+// Multiply a packed block of A by a packed block of B and add alpha times
+// the product into C.
+// double **c: rows of C, the block lands at rows i0.., columns j0...
+static void gemm_block(gemm_kernel kernel, int mc, int nc, int kc, double alpha,
+        const double *ap, const double *bp, double **c, int i0, int j0)
+{
+    double t[GEMM_MR*GEMM_NR] __attribute__((aligned(32)));
+    int ir, jr, r, q;
+    for(jr = 0; jr < nc; jr += GEMM_NR){
+        int n = MIN(GEMM_NR, nc - jr);
+        for(ir = 0; ir < mc; ir += GEMM_MR){
+            int m = MIN(GEMM_MR, mc - ir);
+            kernel(kc, ap + ir*kc, bp + jr*kc, t);
+            for(r = 0; r < m; ++r){
+                double *row = c[i0 + ir + r] + j0 + jr;
+                for(q = 0; q < n; ++q) row[q] += alpha*t[r*GEMM_NR + q];
+            }
+        }
+    }
+}
+
+// General matrix product: c = alpha*op(a)*op(b) + beta*c, where op
+// transposes its argument when the flag is set, without copying it.
+// int ta, tb: use the transpose of a, b.
+// matrix c: op(a).rows x op(b).cols, updated in place. With beta = 0 its
+//           old contents are ignored.
+void gemm(int ta, int tb, double alpha, matrix a, matrix b, double beta, matrix c)
+{
+    int M = c.rows, N = c.cols, K = ta ? a.rows : a.cols;
+    assert((ta ? a.cols : a.rows) == M && (tb ? b.rows : b.cols) == N && (tb ? b.cols : b.rows) == K);
+    int i, j, k;
+    if(beta != 1){
+        for(i = 0; i < M; ++i){
+            double *crow = c.data[i];
+            if(beta == 0) memset(crow, 0, N*sizeof(double));
+            else for(j = 0; j < N; ++j) crow[j] *= beta;
+        }
+    }
+    if(!M || !N || !K || alpha == 0) return;
+    if((long)M*N*K <= GEMM_SMALL){
+        for(i = 0; i < M; ++i){
+            double *crow = c.data[i];
+            if(tb){
+                for(j = 0; j < N; ++j){
+                    double sum = 0;
+                    for(k = 0; k < K; ++k) sum += (ta ? a.data[k][i] : a.data[i][k])*b.data[j][k];
+                    crow[j] += alpha*sum;
+                }
+                continue;
+            }
+            for(k = 0; k < K; ++k){
+                double aik = alpha*(ta ? a.data[k][i] : a.data[i][k]);
+                const double *brow = b.data[k];
+                for(j = 0; j < N; ++j) crow[j] += aik*brow[j];
+            }
+        }
+        return;
+    }
+
+    gemm_kernel kernel = kernel_scalar;
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) kernel = kernel_avx2;
+#endif
+    int nb = MIN(N, GEMM_NC);
+    double *bp = gemm_buffer(&buffers.b, &buffers.bsize, sizeof(double)*GEMM_KC*((nb + GEMM_NR - 1)/GEMM_NR)*GEMM_NR);
+
+    #pragma omp parallel
+    {
+        double *ap = gemm_buffer(&buffers.a, &buffers.asize, sizeof(double)*GEMM_MC*GEMM_KC);
+        int jc, pc, i;
+        for(jc = 0; jc < N; jc += GEMM_NC){
+            int nc = MIN(GEMM_NC, N - jc);
+            int panels = (nc + GEMM_NR - 1)/GEMM_NR;
+            for(pc = 0; pc < K; pc += GEMM_KC){
+                int kc = MIN(GEMM_KC, K - pc);
+                #pragma omp for
+                for(i = 0; i < panels; ++i){
+                    pack_b_panel(b.data, tb, pc, jc + i*GEMM_NR, kc, MIN(GEMM_NR, nc - i*GEMM_NR), bp + (size_t)i*GEMM_NR*kc);
+                }
+                #pragma omp for schedule(dynamic)
+                for(i = 0; i < M; i += GEMM_MC){
+                    int mc = MIN(GEMM_MC, M - i);
+                    pack_a(a.data, ta, i, pc, mc, kc, ap);
+                    gemm_block(kernel, mc, nc, kc, alpha, ap, bp, c.data, i, jc);
+                }
+            }
+        }
+    }
+}
+
+// Single precision. Same blocking, with tiles twice as wide since a vector
+// holds twice as many floats.
+
+#define SGEMM_NR 16
+#define SGEMM_NC 4096
+
+typedef void (*sgemm_kernel)(int kc, const float *a, const float *b, float *t);
+
+static void spack_a(float **a, int ta, int i0, int k0, int mc, int kc, float *dst)
+{
+    int ir, p, r;
+    for(ir = 0; ir < mc; ir += GEMM_MR){
+        int m = MIN(GEMM_MR, mc - ir);
+        if(ta){
+            for(p = 0; p < kc; ++p){
+                const float *row = a[k0 + p] + i0 + ir;
+                for(r = 0; r < m; ++r) dst[r] = row[r];
+                for(; r < GEMM_MR; ++r) dst[r] = 0;
+                dst += GEMM_MR;
+            }
+            continue;
+        }
+        const float *rows[GEMM_MR];
+        for(r = 0; r < m; ++r) rows[r] = a[i0 + ir + r] + k0;
+        for(p = 0; p < kc; ++p){
+            for(r = 0; r < m; ++r) dst[r] = rows[r][p];
+            for(; r < GEMM_MR; ++r) dst[r] = 0;
+            dst += GEMM_MR;
+        }
+    }
+}
+
+static void spack_b_panel(float **b, int tb, int k0, int j0, int kc, int n, float *dst)
+{
+    int p, q;
+    if(tb){
+        const float *cols[SGEMM_NR];
+        for(q = 0; q < n; ++q) cols[q] = b[j0 + q] + k0;
+        for(p = 0; p < kc; ++p){
+            for(q = 0; q < n; ++q) dst[q] = cols[q][p];
+            for(; q < SGEMM_NR; ++q) dst[q] = 0;
+            dst += SGEMM_NR;
+        }
+        return;
+    }
+    for(p = 0; p < kc; ++p){
+        const float *row = b[k0 + p] + j0;
+        for(q = 0; q < n; ++q) dst[q] = row[q];
+        for(; q < SGEMM_NR; ++q) dst[q] = 0;
+        dst += SGEMM_NR;
+    }
+}
+
+static void skernel_scalar(int kc, const float *a, const float *b, float *t)
+{
+    int p, r, q;
+    for(r = 0; r < GEMM_MR*SGEMM_NR; ++r) t[r] = 0;
+    for(p = 0; p < kc; ++p, a += GEMM_MR, b += SGEMM_NR){
+        for(r = 0; r < GEMM_MR; ++r){
+            float ar = a[r];
+            for(q = 0; q < SGEMM_NR; ++q) t[r*SGEMM_NR + q] += ar*b[q];
+        }
+    }
+}
+
+#ifdef GEMM_X86
+__attribute__((target("avx2,fma")))
+static void skernel_avx2(int kc, const float *a, const float *b, float *t)
+{
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+    int p;
+    for(p = 0; p < kc; ++p, a += GEMM_MR, b += SGEMM_NR){
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 ar;
+        ar = _mm256_broadcast_ss(a + 0);
+        c00 = _mm256_fmadd_ps(ar, b0, c00); c01 = _mm256_fmadd_ps(ar, b1, c01);
+        ar = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(ar, b0, c10); c11 = _mm256_fmadd_ps(ar, b1, c11);
+        ar = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(ar, b0, c20); c21 = _mm256_fmadd_ps(ar, b1, c21);
+        ar = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(ar, b0, c30); c31 = _mm256_fmadd_ps(ar, b1, c31);
+        ar = _mm256_broadcast_ss(a + 4);
+        c40 = _mm256_fmadd_ps(ar, b0, c40); c41 = _mm256_fmadd_ps(ar, b1, c41);
+        ar = _mm256_broadcast_ss(a + 5);
+        c50 = _mm256_fmadd_ps(ar, b0, c50); c51 = _mm256_fmadd_ps(ar, b1, c51);
+    }
+    _mm256_store_ps(t + 0, c00);  _mm256_store_ps(t + 8, c01);
+    _mm256_store_ps(t + 16, c10); _mm256_store_ps(t + 24, c11);
+    _mm256_store_ps(t + 32, c20); _mm256_store_ps(t + 40, c21);
+    _mm256_store_ps(t + 48, c30); _mm256_store_ps(t + 56, c31);
+    _mm256_store_ps(t + 64, c40); _mm256_store_ps(t + 72, c41);
+    _mm256_store_ps(t + 80, c50); _mm256_store_ps(t + 88, c51);
+}
+#endif
+
+static void sgemm_block(sgemm_kernel kernel, int mc, int nc, int kc, float alpha,
+        const float *ap, const float *bp, float **c, int i0, int j0)
+{
+    float t[GEMM_MR*SGEMM_NR] __attribute__((aligned(32)));
+    int ir, jr, r, q;
+    for(jr = 0; jr < nc; jr += SGEMM_NR){
+        int n = MIN(SGEMM_NR, nc - jr);
+        for(ir = 0; ir < mc; ir += GEMM_MR){
+            int m = MIN(GEMM_MR, mc - ir);
+            kernel(kc, ap + ir*kc, bp + jr*kc, t);
+            for(r = 0; r < m; ++r){
+                float *row = c[i0 + ir + r] + j0 + jr;
+                for(q = 0; q < n; ++q) row[q] += alpha*t[r*SGEMM_NR + q];
+            }
+        }
+    }
+}
+
+// Single precision gemm: c = alpha*op(a)*op(b) + beta*c.
+void sgemm(int ta, int tb, float alpha, fmatrix a, fmatrix b, float beta, fmatrix c)
+{
+    int M = c.rows, N = c.cols, K = ta ? a.rows : a.cols;
+    assert((ta ? a.cols : a.rows) == M && (tb ? b.rows : b.cols) == N && (tb ? b.cols : b.rows) == K);
+    int i, j, k;
+    if(beta != 1){
+        for(i = 0; i < M; ++i){
+            float *crow = c.data[i];
+            if(beta == 0) memset(crow, 0, N*sizeof(float));
+            else for(j = 0; j < N; ++j) crow[j] *= beta;
+        }
+    }
+    if(!M || !N || !K || alpha == 0) return;
+    if((long)M*N*K <= GEMM_SMALL){
+        for(i = 0; i < M; ++i){
+            float *crow = c.data[i];
+            if(tb){
+                for(j = 0; j < N; ++j){
+                    float sum = 0;
+                    for(k = 0; k < K; ++k) sum += (ta ? a.data[k][i] : a.data[i][k])*b.data[j][k];
+                    crow[j] += alpha*sum;
+                }
+                continue;
+            }
+            for(k = 0; k < K; ++k){
+                float aik = alpha*(ta ? a.data[k][i] : a.data[i][k]);
+                const float *brow = b.data[k];
+                for(j = 0; j < N; ++j) crow[j] += aik*brow[j];
+            }
+        }
+        return;
+    }
+
+    sgemm_kernel kernel = skernel_scalar;
+#ifdef GEMM_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) kernel = skernel_avx2;
+#endif
+    int nb = MIN(N, SGEMM_NC);
+    float *bp = gemm_buffer(&buffers.b, &buffers.bsize, sizeof(float)*GEMM_KC*((nb + SGEMM_NR - 1)/SGEMM_NR)*SGEMM_NR);
+
+    #pragma omp parallel
+    {
+        float *ap = gemm_buffer(&buffers.a, &buffers.asize, sizeof(float)*GEMM_MC*GEMM_KC);
+        int jc, pc, i;
+        for(jc = 0; jc < N; jc += SGEMM_NC){
+            int nc = MIN(SGEMM_NC, N - jc);
+            int panels = (nc + SGEMM_NR - 1)/SGEMM_NR;
+            for(pc = 0; pc < K; pc += GEMM_KC){
+                int kc = MIN(GEMM_KC, K - pc);
+                #pragma omp for
+                for(i = 0; i < panels; ++i){
+                    spack_b_panel(b.data, tb, pc, jc + i*SGEMM_NR, kc, MIN(SGEMM_NR, nc - i*SGEMM_NR), bp + (size_t)i*SGEMM_NR*kc);
+                }
+                #pragma omp for schedule(dynamic)
+                for(i = 0; i < M; i += GEMM_MC){
+                    int mc = MIN(GEMM_MC, M - i);
+                    spack_a(a.data, ta, i, pc, mc, kc, ap);
+                    sgemm_block(kernel, mc, nc, kc, alpha, ap, bp, c.data, i, jc);
+                }
+            }
+        }
+    }
+}
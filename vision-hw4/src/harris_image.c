@@ -6,6 +6,41 @@
 #include "image.h"
 #include "matrix.h"
 #include <time.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Row stride, in floats, that keeps every descriptor 64-byte aligned.
+static int descriptor_stride(int d)
+{
+    return (d + 15)/16*16;
+}
+
+// Start of the descriptor data in a single-block descriptor array.
+static float *descriptor_block_data(descriptor *d, int n)
+{
+    size_t offset = (n*sizeof(descriptor) + 63)/64*64;
+    return (float *)((char *)d + offset);
+}
+
+// Allocate a descriptor array whose data lives in the same allocation,
+// right after the array, so it can be freed in one call.
+static descriptor *make_descriptor_block(int n, int len)
+{
+    int stride = descriptor_stride(len);
+    size_t bytes = (n*sizeof(descriptor) + 63)/64*64 + (size_t)n*stride*sizeof(float);
+    void *block = 0;
+    if(posix_memalign(&block, 64, bytes ? bytes : 64)) return 0;
+    descriptor *d = block;
+    float *data = descriptor_block_data(d, n);
+    memset(data, 0, (size_t)n*stride*sizeof(float));
+    int i;
+    for(i = 0; i < n; ++i){
+        d[i].n = len;
+        d[i].data = data + (size_t)i*stride;
+    }
+    return d;
+}
 
 // Frees an array of descriptors.
 // descriptor *d: the array.
@@ -19,18 +54,76 @@ void free_descriptors(descriptor *d, int n)
     free(d);
 }
 
-// Create a feature descriptor for an index in an image.
+// Frees a descriptor array made by descriptor_array_from_set or
+// harris_corner_detector, whose data lives in the array's allocation.
+void free_descriptor_block(descriptor *d)
+{
+    free(d);
+}
+
+// Make an empty set of descriptors.
+// int n: number of descriptors.
+// int d: values per descriptor.
+// returns: zeroed set, free with free_descriptor_set.
+descriptor_set make_descriptor_set(int n, int d)
+{
+    descriptor_set s;
+    void *data = 0;
+    s.n = n;
+    s.d = d;
+    s.stride = descriptor_stride(d);
+    size_t bytes = (size_t)n*s.stride*sizeof(float);
+    if(posix_memalign(&data, 64, bytes ? bytes : 64)) data = 0;
+    if(data) memset(data, 0, bytes);
+    s.data = data;
+    s.p = calloc(MAX(n, 1), sizeof(point));
+    return s;
+}
+
+void free_descriptor_set(descriptor_set s)
+{
+    free(s.data);
+    free(s.p);
+}
+
+// Pointer to the values of one descriptor in a set.
+float *descriptor_row(descriptor_set s, int i)
+{
+    return s.data + (size_t)i*s.stride;
+}
+
+// Copy an array of descriptors into a set.
+descriptor_set descriptor_set_from_array(descriptor *d, int n)
+{
+    descriptor_set s = make_descriptor_set(n, n ? d[0].n : 0);
+    int i;
+    for(i = 0; i < n; ++i){
+        memcpy(descriptor_row(s, i), d[i].data, s.d*sizeof(float));
+        s.p[i] = d[i].p;
+    }
+    return s;
+}
+
+// Copy a set into a descriptor array for older callers. The array and its
+// data are a single allocation, free it with free_descriptor_block.
+descriptor *descriptor_array_from_set(descriptor_set s)
+{
+    descriptor *d = make_descriptor_block(s.n, s.d);
+    int i;
+    for(i = 0; i < s.n; ++i){
+        memcpy(d[i].data, descriptor_row(s, i), s.d*sizeof(float));
+        d[i].p = s.p[i];
+    }
+    return d;
+}
+
+// Write the descriptor for an index in an image.
 // image im: source image.
 // int i: index in image for the pixel we want to describe.
-// returns: descriptor for that index.
-descriptor describe_index(image im, int i)
+// float *out: 25*im.c values to fill.
+static void describe_index_into(image im, int i, float *out)
 {
     int w = 5;
-    descriptor d;
-    d.p.x = i%im.w;
-    d.p.y = i/im.w;
-    d.data = calloc(w*w*im.c, sizeof(float));
-    d.n = w*w*im.c;
     int c, dx, dy;
     int count = 0;
     // If you want you can experiment with other descriptors
@@ -41,10 +134,25 @@ descriptor describe_index(image im, int i)
         for(dx = -w/2; dx < (w+1)/2; ++dx){
             for(dy = -w/2; dy < (w+1)/2; ++dy){
                 float val = get_pixel(im, i%im.w+dx, i/im.w+dy, c);
-                d.data[count++] = cval - val;
+                out[count++] = cval - val;
             }
         }
     }
+}
+
+// Create a feature descriptor for an index in an image.
+// image im: source image.
+// int i: index in image for the pixel we want to describe.
+// returns: descriptor for that index.
+descriptor describe_index(image im, int i)
+{
+    int w = 5;
+    descriptor d;
+    d.p.x = i%im.w;
+    d.p.y = i/im.w;
+    d.data = calloc(w*w*im.c, sizeof(float));
+    d.n = w*w*im.c;
+    describe_index_into(im, i, d.data);
     return d;
 }
 
@@ -115,73 +223,107 @@ image make_kernel_transpose(image im)
 	return result;
 }
 
+// Smooths a view into another using a separable Gaussian filter.
+// image_view im: view to smooth.
+// float sigma: std dev. for Gaussian.
+// image_view dst: view of the same size to write the result to.
+void smooth_view(image_view im, float sigma, image_view dst)
+{
+	image_arena_begin();
+
+	// The outer product of the 1d Gaussian with itself is rank 1, so the
+	// convolution engine runs it as two passes in a single sweep.
+	image g1 = make_1d_gaussian(sigma);
+	image g = make_image_uninit(g1.w, g1.w, 1);
+	for (int j = 0; j < g.h; ++j) {
+		for (int i = 0; i < g.w; ++i) {
+			g.data[i + j*g.w] = g1.data[i] * g1.data[j];
+		}
+	}
+	convolve_view(im, g, 1, dst);
+
+	image_arena_end();
+}
+
 // Smooths an image using separable Gaussian filter.
 // image im: image to smooth.
 // float sigma: std dev. for Gaussian.
 // returns: smoothed image.
 image smooth_image(image im, float sigma)
 {
-    if(0){
-        image g = make_gaussian_filter(sigma);
-        image s = convolve_image(im, g, 1);
-        free_image(g);
-        return s;
-    } else {
-        // optional, use two convolutions with 1d gaussian filter.
-        // If you implement, disable the above if check.
-
-	    image g1 = make_1d_gaussian(sigma);
-	    image g2 = make_kernel_transpose(g1);
-
-	    image s = convolve_image(im, g1, 1);
-	    image s1 = convolve_image(s, g2, 1);
-	    free_image(g1);
-	    free_image(g2);
-	    free_image(s);
-
-	    return s1;
-    }
+	image s = make_image_uninit(im.w, im.h, im.c);
+	smooth_view(view_image(im), sigma, view_image(s));
+	return s;
 }
 
 void insert_channel(image im, image insertion, int channel) {
 	assert(channel < im.c);
 	assert(insertion.c == 1);
 
-	memcpy(im.data + im.w * im.h * channel, insertion.data, im.w * im.h * sizeof(float));
+	copy_view(view_image(insertion), view_channel(view_image(im), channel));
 }
 
-// Calculate the structure matrix of an image.
-// image im: the input image.
+// Calculate the structure matrix of a view, e.g. a crop or one channel,
+// without copying it first.
+// image_view im: the input view.
 // float sigma: std dev. to use for weighted sum.
-// returns: structure matrix. 1st channel is Ix^2, 2nd channel is Iy^2,
-//          third channel is IxIy.
-image structure_matrix(image im, float sigma)
+// image_view S: im.w x im.h x 3 view to write Ix^2, Iy^2 and IxIy to.
+void structure_matrix_view(image_view im, float sigma, image_view S)
 {
-	image S = make_image(im.w, im.h, 3);
+	assert(S.w == im.w && S.h == im.h && S.c == 3);
+	image_arena_begin();
 
 	image gxFilter = make_gx_filter();
-	image Ix = convolve_image(im, gxFilter, 0);
-	image Ix_2 = mult_image(Ix, Ix);
-	insert_channel(S, Ix_2, 0);
-	free_image(gxFilter);
-	free_image(Ix_2);
-
 	image gyFilter = make_gy_filter();
-	image Iy = convolve_image(im, gyFilter, 0);
-	image Iy_2 = mult_image(Iy, Iy);
-	insert_channel(S, Iy_2, 1);
-	free_image(gyFilter);
-	free_image(Iy_2);
+	image Ix = make_image_uninit(im.w, im.h, 1);
+	image Iy = make_image_uninit(im.w, im.h, 1);
+	convolve_view(im, gxFilter, 0, view_image(Ix));
+	convolve_view(im, gyFilter, 0, view_image(Iy));
 
-	image IxIy = mult_image(Ix, Iy);
-	insert_channel(S, IxIy, 2);
-	free_image(Ix);
-	free_image(Iy);
-	free_image(IxIy);
+	image products = make_image_uninit(im.w, im.h, 3);
+	image_view p = view_image(products);
+	mult_view(view_image(Ix), view_image(Ix), view_channel(p, 0));
+	mult_view(view_image(Iy), view_image(Iy), view_channel(p, 1));
+	mult_view(view_image(Ix), view_image(Iy), view_channel(p, 2));
 
-	image result = smooth_image(S, sigma);
+	smooth_view(p, sigma, S);
 
-	return result;
+	image_arena_end();
+}
+
+// Calculate the structure matrix of an image.
+// image im: the input image.
+// float sigma: std dev. to use for weighted sum.
+// returns: structure matrix. 1st channel is Ix^2, 2nd channel is Iy^2,
+//          third channel is IxIy.
+image structure_matrix(image im, float sigma)
+{
+	image S = make_image_uninit(im.w, im.h, 3);
+	structure_matrix_view(view_image(im), sigma, view_image(S));
+	return S;
+}
+
+// Estimate the cornerness of each pixel of a structure matrix view.
+// image_view S: structure matrix.
+// image_view R: S.w x S.h x 1 view to write the response to.
+void cornerness_response_view(image_view S, image_view R)
+{
+	assert(R.w == S.w && R.h == S.h && R.c == 1);
+	// We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.
+	float alpha = 0.06f;
+
+#pragma omp parallel for
+	for (int j = 0; j < S.h; ++j) {
+		float *a11 = view_row(S, j, 0);
+		float *a22 = view_row(S, j, 1);
+		float *a12 = view_row(S, j, 2);
+		float *out = view_row(R, j, 0);
+		for (int i = 0; i < S.w; ++i) {
+			float det = a11[i] * a22[i] - a12[i] * a12[i];
+			float trace = a11[i] + a22[i];
+			out[i] = det - alpha * trace * trace;
+		}
+	}
 }
 
 // Estimate the cornerness of each pixel given a structure matrix S.
@@ -189,49 +331,176 @@ image structure_matrix(image im, float sigma)
 // returns: a response map of cornerness calculations.
 image cornerness_response(image S)
 {
-    image R = make_image(S.w, S.h, 1);
-    // fill in R, "cornerness" for each pixel using the structure matrix.
-    // We'll use formulation det(S) - alpha * trace(S)^2, alpha = .06.
-
-    float alpha = 0.06f;
+    image R = make_image_uninit(S.w, S.h, 1);
+    cornerness_response_view(view_image(S), view_image(R));
+    return R;
+}
 
-	for (int i = 0; i < R.w; ++i) {
-		for (int j = 0; j < R.h; ++j) {
-			float a11 = get_pixel(S, i, j, 0);
-			float a12 = get_pixel(S, i, j, 2);
-			float a21 = get_pixel(S, i, j, 2);
-			float a22 = get_pixel(S, i, j, 1);
+// Sum the channels of a view row, clamping y to the view. Summed rows are
+// cached in three slots, which is all a sliding 3x3 stencil needs.
+// float *buf: 3*im.w floats of cache.
+// int *tags: row held by each cache slot, -1 when empty.
+// returns: pointer to the summed row.
+static float *gray_row(image_view im, int y, float *buf, int *tags)
+{
+	y = y < 0 ? 0 : (y >= im.h ? im.h - 1 : y);
+	if (im.c == 1) return view_row(im, y, 0);
+	int slot = y % 3;
+	float *row = buf + slot*im.w;
+	if (tags[slot] == y) return row;
+	memcpy(row, view_row(im, y, 0), im.w * sizeof(float));
+	for (int k = 1; k < im.c; ++k) {
+		float *src = view_row(im, y, k);
+		for (int i = 0; i < im.w; ++i) row[i] += src[i];
+	}
+	tags[slot] = y;
+	return row;
+}
 
-			float det = a11 * a22 - a12 * a21;
-			float trace = a11 + a22;
-			float cornerness = det - alpha * trace * trace;
+// Sobel gradient products Ix^2, Iy^2 and IxIy for row y of a view,
+// clamped to the view like the smoothing pass clamps the products, and
+// written with r clamped copies on both sides of each row.
+// float *gray, int *tags: summed row cache for gray_row.
+// float *p[3]: output rows of im.w + 2r floats.
+static void gradient_products_row(image_view im, int y, int r, float *gray, int *tags, float *p[3])
+{
+	int w = im.w;
+	y = y < 0 ? 0 : (y >= im.h ? im.h - 1 : y);
+	float *up = gray_row(im, y - 1, gray, tags);
+	float *mid = gray_row(im, y, gray, tags);
+	float *down = gray_row(im, y + 1, gray, tags);
+	float *xx = p[0] + r, *yy = p[1] + r, *xy = p[2] + r;
+
+	// Edge columns clamp, the interior runs without branches.
+	for (int e = 0; e < 2 && e < w; ++e) {
+		int i = e ? w - 1 : 0;
+		int l = i > 0 ? i - 1 : 0;
+		int h = i < w - 1 ? i + 1 : w - 1;
+		float ix = (up[h] - up[l]) + 2*(mid[h] - mid[l]) + (down[h] - down[l]);
+		float iy = (down[l] + 2*down[i] + down[h]) - (up[l] + 2*up[i] + up[h]);
+		xx[i] = ix * ix;
+		yy[i] = iy * iy;
+		xy[i] = ix * iy;
+	}
+	for (int i = 1; i < w - 1; ++i) {
+		float ix = (up[i+1] - up[i-1]) + 2*(mid[i+1] - mid[i-1]) + (down[i+1] - down[i-1]);
+		float iy = (down[i-1] + 2*down[i] + down[i+1]) - (up[i-1] + 2*up[i] + up[i+1]);
+		xx[i] = ix * ix;
+		yy[i] = iy * iy;
+		xy[i] = ix * iy;
+	}
+	for (int k = 0; k < 3; ++k) {
+		for (int i = 0; i < r; ++i) {
+			p[k][i] = p[k][r];
+			p[k][r + w + i] = p[k][r + w - 1];
+		}
+	}
+}
 
-			set_pixel(R, i, j, 0, cornerness);
+// Harris response of a view in one streaming pass. Each row band computes
+// Sobel gradients, their products, a horizontal Gaussian into a ring of
+// rows, the vertical Gaussian and the cornerness, without materializing
+// any full-size intermediate. Matches cornerness_response(structure_matrix())
+// up to float rounding.
+// image_view im: the input view.
+// float sigma: std dev. of the structure matrix weighting.
+// image_view R: im.w x im.h x 1 view to write the response to.
+void harris_response_view(image_view im, float sigma, image_view R)
+{
+	assert(R.w == im.w && R.h == im.h && R.c == 1);
+	float alpha = 0.06f;
+	int w = im.w;
+	image_arena_begin();
+
+	image g = make_1d_gaussian(sigma);
+	int K = g.w;
+	int r = K/2;
+	int band = MAX(64, 4*K);
+	int bands = (im.h + band - 1)/band;
+
+	int threads = 1;
+#ifdef _OPENMP
+	threads = omp_get_max_threads();
+#endif
+	size_t scratch_size = 3*(w + 2*r) + 3*w + 3*K*w + 3*w;
+	float *scratch_all = image_arena_alloc(threads * scratch_size * sizeof(float));
+
+#pragma omp parallel num_threads(threads)
+	{
+		float *scratch = scratch_all;
+#ifdef _OPENMP
+		scratch += omp_get_thread_num() * scratch_size;
+#endif
+		float *p[3] = {scratch, scratch + (w + 2*r), scratch + 2*(w + 2*r)};
+		float *gray = scratch + 3*(w + 2*r);
+		float *ring = gray + 3*w;
+		float *S = ring + 3*K*w;
+
+#pragma omp for schedule(dynamic)
+		for (int b = 0; b < bands; ++b) {
+			int y0 = b * band;
+			int y1 = MIN(im.h, y0 + band);
+			int tags[3] = {-1, -1, -1};
+			for (int t = 0; t < y1 - y0 + K - 1; ++t) {
+				// Horizontally blurred products of row y0 - r + t go in slot t % K.
+				gradient_products_row(im, y0 - r + t, r, gray, tags, p);
+				float *slot = ring + (t % K) * 3*w;
+				memset(slot, 0, 3*w * sizeof(float));
+				for (int k = 0; k < 3; ++k) {
+					float *restrict h = slot + k*w;
+					for (int l = 0; l < K; ++l) {
+						float gl = g.data[l];
+						const float *restrict src = p[k] + l;
+						for (int i = 0; i < w; ++i) h[i] += gl * src[i];
+					}
+				}
+				if (t < K - 1) continue;
+
+				int first = t - (K - 1);
+				memset(S, 0, 3*w * sizeof(float));
+				for (int m = 0; m < K; ++m) {
+					float gm = g.data[m];
+					const float *restrict src = ring + ((first + m) % K) * 3*w;
+					for (int i = 0; i < 3*w; ++i) S[i] += gm * src[i];
+				}
+				float *out = view_row(R, y0 + first, 0);
+				for (int i = 0; i < w; ++i) {
+					float a11 = S[i], a22 = S[w + i], a12 = S[2*w + i];
+					float trace = a11 + a22;
+					out[i] = a11 * a22 - a12 * a12 - alpha * trace * trace;
+				}
+			}
 		}
 	}
+	image_arena_end();
+}
 
-    return R;
+// Harris response of an image in one streaming pass.
+// image im: the input image.
+// float sigma: std dev. of the structure matrix weighting.
+// returns: a response map of cornerness calculations.
+image harris_response(image im, float sigma)
+{
+	image R = make_image_uninit(im.w, im.h, 1);
+	harris_response_view(view_image(im), sigma, view_image(R));
+	return R;
 }
 
-// Perform non-max supression on an image of feature responses.
+// Perform non-max supression by comparing every pixel with its whole
+// window. Kept as the reference for nms_image.
 // image im: 1-channel image of feature responses.
 // int w: distance to look for larger responses.
 // returns: image with only local-maxima responses within w pixels.
-image nms_image(image im, int w)
+image nms_image_reference(image im, int w)
 {
     image r = copy_image(im);
-    // perform NMS on the response map.
-    // for every pixel in the image:
-    //     for neighbors within w:
-    //         if neighbor response greater than pixel response:
-    //             set response to be very low (I use -999999 [why not 0??])
 
 	for (int i = 0; i < im.w; ++i) {
 		for (int j = 0; j < im.h; ++j) {
 			float currentResponse = get_pixel(im, i, j, 0);
 
-			for (int k = i - w ; k < i + w; ++k) {
-				for (int l = j - w; l < j + w; ++l) {
+			for (int k = i - w ; k <= i + w; ++k) {
+				for (int l = j - w; l <= j + w; ++l) {
 					if(get_pixel(im, k, l, 0) > currentResponse) {
 						set_pixel(r, i, j, 0, -INFINITY);
 						goto nextPixel;
@@ -246,53 +515,225 @@ image nms_image(image im, int w)
     return r;
 }
 
+// Running max over windows of 2w+1 values (van Herk/Gil-Werman), three
+// comparisons per value whatever the window size. Values outside the row
+// count as -INFINITY, which for a max is the same as clamping.
+// float *src: n values.
+// float *dst: n outputs, dst[i] = max(src[i-w..i+w]).
+// float *g, *h: n + 2w floats of scratch.
+static void running_max_row(const float *src, float *dst, int n, int w, float *g, float *h)
+{
+	int k = 2*w + 1;
+	int L = n + 2*w;
+	for (int t = 0; t < L; ++t) {
+		int x = t - w;
+		float v = (x >= 0 && x < n) ? src[x] : -INFINITY;
+		g[t] = (t % k == 0 || v > g[t-1]) ? v : g[t-1];
+	}
+	for (int t = L - 1; t >= 0; --t) {
+		int x = t - w;
+		float v = (x >= 0 && x < n) ? src[x] : -INFINITY;
+		h[t] = (t == L - 1 || (t + 1) % k == 0 || v > h[t+1]) ? v : h[t+1];
+	}
+	for (int i = 0; i < n; ++i) {
+		dst[i] = h[i] > g[i + 2*w] ? h[i] : g[i + 2*w];
+	}
+}
+
+// Elementwise running max step over whole rows, dst = max(a, b).
+static void max_rows(float *restrict dst, const float *a, const float *b, int n)
+{
+	for (int i = 0; i < n; ++i) dst[i] = a[i] > b[i] ? a[i] : b[i];
+}
+
+// Maximum of every (2w+1)x(2w+1) window of a response map, computed as a
+// horizontal then a vertical running max, parallel over row bands.
+// image im: 1-channel image.
+// int w: window radius.
+// image mx: same size image to write the window maxima to.
+static void window_max(image im, int w, image mx)
+{
+	int k = 2*w + 1;
+	int band = MAX(64, 4*k);
+	int bands = (im.h + band - 1)/band;
+	image rows = make_image_uninit(im.w, im.h, 1);
+
+	int threads = 1;
+#ifdef _OPENMP
+	threads = omp_get_max_threads();
+#endif
+	size_t scratch_size = 2*(size_t)(band + 2*w)*im.w + 2*(im.w + 2*w) + im.w;
+	float *scratch_all = image_arena_alloc(threads * scratch_size * sizeof(float));
+
+#pragma omp parallel num_threads(threads)
+	{
+		float *scratch = scratch_all;
+#ifdef _OPENMP
+		scratch += omp_get_thread_num() * scratch_size;
+#endif
+		float *g = scratch;
+		float *h = g + (size_t)(band + 2*w)*im.w;
+		float *g1 = h + (size_t)(band + 2*w)*im.w;
+		float *h1 = g1 + im.w + 2*w;
+		float *empty = h1 + im.w + 2*w;
+		for (int i = 0; i < im.w; ++i) empty[i] = -INFINITY;
+
+#pragma omp for schedule(dynamic)
+		for (int b = 0; b < bands; ++b) {
+			int y0 = b * band;
+			int y1 = MIN(im.h, y0 + band);
+			for (int y = y0; y < y1; ++y) {
+				running_max_row(im.data + y*im.w, rows.data + y*im.w, im.w, w, g1, h1);
+			}
+		}
+
+#pragma omp for schedule(dynamic)
+		for (int b = 0; b < bands; ++b) {
+			int y0 = b * band;
+			int y1 = MIN(im.h, y0 + band);
+			int L = y1 - y0 + 2*w;
+			// Same running max down the columns, a whole row at a time.
+			for (int t = 0; t < L; ++t) {
+				int y = y0 - w + t;
+				float *v = (y >= 0 && y < im.h) ? rows.data + y*im.w : empty;
+				float *gt = g + (size_t)t*im.w;
+				if (t % k == 0) memcpy(gt, v, im.w * sizeof(float));
+				else max_rows(gt, gt - im.w, v, im.w);
+			}
+			for (int t = L - 1; t >= 0; --t) {
+				int y = y0 - w + t;
+				float *v = (y >= 0 && y < im.h) ? rows.data + y*im.w : empty;
+				float *ht = h + (size_t)t*im.w;
+				if (t == L - 1 || (t + 1) % k == 0) memcpy(ht, v, im.w * sizeof(float));
+				else max_rows(ht, ht + im.w, v, im.w);
+			}
+			for (int y = y0; y < y1; ++y) {
+				int t = y - y0;
+				max_rows(mx.data + y*im.w, h + (size_t)t*im.w, g + (size_t)(t + 2*w)*im.w, im.w);
+			}
+		}
+	}
+	image_arena_free(scratch_all);
+	free_image(rows);
+}
+
+// Perform non-max supression on an image of feature responses.
+// A pixel survives if nothing in its (2w+1)x(2w+1) window is larger, the
+// same rule as nms_image_reference, but in time independent of w.
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// returns: image with only local-maxima responses within w pixels.
+image nms_image(image im, int w)
+{
+    image r = make_image_uninit(im.w, im.h, 1);
+    image_arena_begin();
+    image mx = make_image_uninit(im.w, im.h, 1);
+    window_max(im, w, mx);
+#pragma omp parallel for
+    for (int i = 0; i < im.w*im.h; ++i) {
+        r.data[i] = mx.data[i] > im.data[i] ? -INFINITY : im.data[i];
+    }
+    image_arena_end();
+    return r;
+}
+
+// Find the local maxima of a response map above a threshold directly,
+// without building the suppressed map and scanning it.
+// image im: 1-channel image of feature responses.
+// int w: distance to look for larger responses.
+// float thresh: responses must be larger than this.
+// int *n: set to the number of keypoints found.
+// returns: pixel indexes of the keypoints in column-major order, the order
+//          the detector has always scanned in, free with free().
+int *nms_keypoints(image im, int w, float thresh, int *n)
+{
+    image_arena_begin();
+    image mx = make_image_uninit(im.w, im.h, 1);
+    window_max(im, w, mx);
+
+    // Count per row, then fill in parallel at each row's offset.
+    int *offsets = image_arena_alloc((im.h + 1) * sizeof(int));
+#pragma omp parallel for
+    for (int y = 0; y < im.h; ++y) {
+        int count = 0;
+        for (int x = 0; x < im.w; ++x) {
+            int i = x + y*im.w;
+            count += im.data[i] > thresh && !(mx.data[i] > im.data[i]);
+        }
+        offsets[y + 1] = count;
+    }
+    offsets[0] = 0;
+    for (int y = 0; y < im.h; ++y) offsets[y + 1] += offsets[y];
+
+    *n = offsets[im.h];
+    int *rowkeys = image_arena_alloc((*n ? *n : 1) * sizeof(int));
+#pragma omp parallel for
+    for (int y = 0; y < im.h; ++y) {
+        int next = offsets[y];
+        for (int x = 0; x < im.w; ++x) {
+            int i = x + y*im.w;
+            if (im.data[i] > thresh && !(mx.data[i] > im.data[i])) rowkeys[next++] = i;
+        }
+    }
+
+    // The rows are scanned in parallel, then a stable counting sort on x
+    // puts the keypoints back in column-major order, top to bottom within
+    // a column, so descriptors and matches come out in the same order.
+    int *column = image_arena_calloc((im.w + 1) * sizeof(int));
+    for (int k = 0; k < *n; ++k) ++column[rowkeys[k] % im.w + 1];
+    for (int x = 0; x < im.w; ++x) column[x + 1] += column[x];
+    int *keys = calloc(*n ? *n : 1, sizeof(int));
+    for (int k = 0; k < *n; ++k) keys[column[rowkeys[k] % im.w]++] = rowkeys[k];
+    image_arena_end();
+    return keys;
+}
+
 // Perform harris corner detection and extract features from the corners.
 // image im: input image.
 // float sigma: std. dev for harris.
 // float thresh: threshold for cornerness.
 // int nms: distance to look for local-maxes in response map.
 // int *n: pointer to number of corners detected, should fill in.
-// returns: array of descriptors of the corners in the image.
+// returns: array of descriptors of the corners in the image, free with
+//          free_descriptor_block.
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n)
 {
-    // Calculate structure matrix
-    image S = structure_matrix(im, sigma);
-
-    // Estimate cornerness
-    image R = cornerness_response(S);
-
-    // Run NMS on the responses
-    image Rnms = nms_image(R, nms);
-
-
-    //count number of responses over threshold
-    int count = 0; // change this
+    descriptor_set s = harris_corner_descriptors(im, sigma, thresh, nms);
+    descriptor *d = descriptor_array_from_set(s);
+    *n = s.n;
+    free_descriptor_set(s);
+    return d;
+}
 
-	for (int i = 0; i < Rnms.w; ++i) {
-		for (int j = 0; j < Rnms.h; ++j) {
-			if(get_pixel(Rnms, i, j, 0) > thresh) {
-				count++;
-			}
-		}
-	}
+// Detect corners in an image and describe them into one block.
+// image im: input image.
+// float sigma: std. dev for harris.
+// float thresh: threshold for cornerness.
+// int nms: distance to look for local-maxes in response map.
+// returns: descriptors of the corners, free with free_descriptor_set.
+descriptor_set harris_corner_descriptors(image im, float sigma, float thresh, int nms)
+{
+    // The response maps are temporaries, keep them in the arena.
+    image_arena_begin();
 
-    *n = count; // <- set *n equal to number of corners in image.
-    descriptor *d = calloc(count, sizeof(descriptor));
+    // Calculate structure matrix and cornerness in one pass
+    image R = harris_response(im, sigma);
 
-    //fill in array *d with descriptors of corners, use describe_index().
-	int descriptorIndex = 0;
-	for (int i = 0; i < Rnms.w; ++i) {
-		for (int j = 0; j < Rnms.h; ++j) {
-			if(get_pixel(Rnms, i, j, 0) > thresh) {
-				d[descriptorIndex++] = describe_index(im, i + j * im.w);
-			}
-		}
-	}
+    // Run NMS on the responses and keep the maxima above threshold
+    int count = 0;
+    int *keys = nms_keypoints(R, nms, thresh, &count);
+    image_arena_end();
 
-    free_image(S);
-    free_image(R);
-    free_image(Rnms);
-    return d;
+    descriptor_set s = make_descriptor_set(count, 25*im.c);
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < count; ++i){
+        s.p[i].x = keys[i]%im.w;
+        s.p[i].y = keys[i]/im.w;
+        describe_index_into(im, keys[i], descriptor_row(s, i));
+    }
+    free(keys);
+    return s;
 }
 
 // Find and draw corners on an image.
@@ -305,4 +746,5 @@ void detect_and_draw_corners(image im, float sigma, float thresh, int nms)
     int n = 0;
     descriptor *d = harris_corner_detector(im, sigma, thresh, nms, &n);
     mark_corners(im, d, n);
+    free_descriptor_block(d);
 }
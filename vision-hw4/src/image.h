@@ -3,6 +3,7 @@
 #include <stdio.h>
 
 #include "matrix.h"
+#include "distance.h"
 #define TWOPI 6.2831853
 
 #define MIN(a,b) (((a)<(b))?(a):(b))
@@ -15,6 +16,51 @@ typedef struct{
     float *data;
 } image;
 
+// A strided window into image memory: a crop, a channel, or a whole image.
+// Pixel (x,y,c) lives at data[offset + x + y*stride + c*cstride]. Views
+// never own their data.
+typedef struct{
+    int w,h,c;
+    int stride, cstride, offset;
+    float *data;
+} image_view;
+
+// A precomputed warp from a sw x sh source to a w x h output.
+// int *index: source offset of the top left of the 2x2 neighbourhood each
+//             output pixel samples, -1 if it samples nothing.
+// unsigned short *fx, *fy: bilinear fractions in 1/32768ths.
+typedef struct{
+    int w, h;
+    int sw, sh;
+    int *index;
+    unsigned short *fx, *fy;
+} remap_map;
+
+// Gaussian or Laplacian pyramid of an image.
+// int levels: number of levels.
+// image *level: level 0 is full size, each next one is half the size of
+//               the one before, rounded up.
+typedef struct{
+    int levels;
+    image *level;
+} pyramid;
+
+// Summed area table with double sums, laid out like image.
+// Entry (x,y,c) is the sum of channel c of the source over [0,x] x [0,y].
+typedef struct{
+    int w,h,c;
+    double *data;
+} integral_image;
+
+// Summed area table built a strip of rows at a time.
+// int rows: rows summed so far.
+// double *last: bottom row of the table so far, w*c sums.
+typedef struct{
+    int w, c;
+    int rows;
+    double *last;
+} integral_stream;
+
 // A 2d point.
 // float x, y: the coordinates of the point.
 typedef struct{
@@ -31,6 +77,17 @@ typedef struct{
     float *data;
 } descriptor;
 
+// Descriptors of one image stored as a single row-major block.
+// int n, d: number of descriptors and values in each.
+// int stride: floats from one descriptor to the next, rows are 64-byte aligned.
+// float *data: n*stride values.
+// point *p: location of each descriptor.
+typedef struct{
+    int n, d, stride;
+    float *data;
+    point *p;
+} descriptor_set;
+
 // A match between two points in an image.
 // point p, q: x,y coordinates of the two matching pixels.
 // int ai, bi: indexes in the descriptor array. For eliminating duplicates.
@@ -41,6 +98,109 @@ typedef struct{
     float distance;
 } match;
 
+// Search backend for descriptor matching.
+typedef enum{MATCH_BRUTE, MATCH_KDTREE, MATCH_KMEANS} MATCHER;
+
+// Settings for match_descriptors_params.
+// MATCHER backend: exact brute force or an approximate index.
+// DISTANCE metric: L1 or squared L2 between descriptors.
+// float ratio: Lowe ratio test, keep a match only if its distance is below
+//              ratio times the second best, 0 to disable. Squared for L2.
+// int mutual: keep a match only if it is also the best match from b to a.
+// int trees: number of randomized k-d trees.
+// int checks: distance computations per query for approximate backends.
+// int branching: children per node of the k-means tree.
+typedef struct{
+    MATCHER backend;
+    DISTANCE metric;
+    float ratio;
+    int mutual;
+    int trees, checks, branching;
+} match_params;
+
+typedef struct match_index match_index;
+
+// Settings for ransac_homography.
+// float thresh: inlier/outlier distance threshold in pixels.
+// int max_iters: upper bound on the number of hypotheses.
+// int cutoff: stop as soon as a model has more inliers than this.
+// float confidence: probability of having drawn an all-inlier sample
+//                   before the adaptive iteration count stops the search.
+// int prosac: draw samples from the lowest distance matches first.
+// int pretest: d of the T(d,d) pre-test, 0 to score every hypothesis fully.
+// int preemptive: score this many hypotheses breadth-first and keep
+//                 halving them instead of iterating, 0 to disable.
+// int threads: worker threads, 0 for the OpenMP default.
+// int reproducible: give the same result for any number of threads.
+// unsigned long long seed: random seed.
+typedef struct{
+    float thresh;
+    int max_iters, cutoff;
+    float confidence;
+    int prosac, pretest, preemptive;
+    int threads, reproducible;
+    unsigned long long seed;
+} ransac_params;
+
+// How overlapping images are mixed.
+// BLEND_NONE: later images are pasted over earlier ones.
+// BLEND_FEATHER: average weighted by distance to each image's border.
+// BLEND_MULTIBAND: Laplacian pyramid blend, coarse bands mix over a wide
+//                  seam and fine bands over a narrow one.
+typedef enum{BLEND_NONE, BLEND_FEATHER, BLEND_MULTIBAND} BLEND;
+
+// Settings for panorama_build.
+// float sigma, thresh: harris smoothing and cornerness threshold.
+// int nms: harris non-max suppression window.
+// int window: match each image with this many of the images after it.
+// int reference: image whose frame the panorama is drawn in, -1 for the middle.
+// int min_inliers: pairs with fewer RANSAC inliers are not linked.
+// int max_size: give up if the panorama would be larger than this.
+// BLEND blend: how overlaps are mixed.
+// int bands: pyramid levels for BLEND_MULTIBAND.
+// match_params match: descriptor matching settings.
+// ransac_params ransac: homography estimation settings.
+typedef struct{
+    float sigma, thresh;
+    int nms;
+    int window, reference;
+    int min_inliers, max_size;
+    BLEND blend;
+    int bands;
+    match_params match;
+    ransac_params ransac;
+} panorama_params;
+
+// Where every image of a panorama goes.
+// int n, ref: number of images and the one whose frame the canvas uses.
+// int w, h, c: canvas size.
+// int ox, oy: reference frame coordinates of canvas pixel (0, 0).
+// matrix *G: map from reference to image i coordinates, rows = 0 if the
+//            image was left out.
+// point *lo, *hi: footprint of image i in the reference frame.
+// BLEND blend, int bands: how overlaps are mixed.
+typedef struct{
+    int n, ref;
+    int w, h, c;
+    int ox, oy;
+    matrix *G;
+    point *lo, *hi;
+    BLEND blend;
+    int bands;
+} panorama_layout;
+
+// Settings for pyramidal Lucas-Kanade flow.
+// int levels: pyramid levels, each one doubles the motion that can be found.
+// int window: side of the window each flow vector is fit over.
+// int iterations: refinements on each level.
+// int stride: spacing of the dense flow grid.
+// float min_eigen: smallest eigenvalue of the window's structure matrix,
+//                  per pixel of window, for the flow to be solved.
+typedef struct{
+    int levels, window, iterations, stride;
+    float min_eigen;
+} flow_params;
+
 // Basic operations
 float get_pixel(image im, int x, int y, int c);
 void set_pixel(image im, int x, int y, int c, float v);
@@ -57,8 +217,42 @@ int same_image(image a, image b);
 image sub_image(image a, image b);
 image add_image(image a, image b);
 
+// Temporaries
+void image_arena_begin();
+void image_arena_end();
+void image_arena_release();
+int image_arena_owns(void *p);
+void *image_arena_alloc(size_t bytes);
+void *image_arena_calloc(size_t bytes);
+void image_arena_free(void *p);
+long image_heap_allocations();
+
+// Views
+image_view view_image(image im);
+image_view view_roi(image_view v, int x, int y, int w, int h);
+image_view view_channel(image_view v, int c);
+float *view_row(image_view v, int y, int c);
+int view_is_contiguous(image_view v);
+image view_as_image(image_view v);
+image view_to_image(image_view v);
+void copy_view(image_view src, image_view dst);
+void fill_view(image_view v, float value);
+void add_view(image_view a, image_view b, image_view dst);
+void sub_view(image_view a, image_view b, image_view dst);
+void mult_view(image_view a, image_view b, image_view dst);
+void bilinear_resize_view(image_view im, image_view dst);
+void convolve_view(image_view im, image filter, int preserve, image_view dst);
+void structure_matrix_view(image_view im, float sigma, image_view S);
+void cornerness_response_view(image_view S, image_view R);
+void harris_response_view(image_view im, float sigma, image_view R);
+void smooth_view(image_view im, float sigma, image_view dst);
+void box_filter_view(image_view im, int s, image_view dst);
+void warp_homography_view(image_view src, matrix H, image_view dst, int ox, int oy);
+
 // Loading and saving
 image make_image(int w, int h, int c);
+image make_image_uninit(int w, int h, int c);
+image make_random_image(int w, int h, int c);
 image load_image(char *filename);
 void save_image(image im, const char *name);
 void save_png(image im, const char *name);
@@ -70,8 +264,35 @@ image nn_resize(image im, int w, int h);
 float bilinear_interpolate(image im, float x, float y, int c);
 image bilinear_resize(image im, int w, int h);
 
+// Remapping
+remap_map make_remap_map(int w, int h, int sw, int sh);
+void free_remap_map(remap_map m);
+void remap_map_set(remap_map m, int x, int y, float sx, float sy);
+remap_map make_cylindrical_map(int w, int h, float f);
+image remap_image(image im, remap_map m);
+
+// Pyramids
+void pyramid_down_view(image_view src, image_view dst);
+void pyramid_up_view(image_view src, image_view dst, int add);
+pyramid make_empty_pyramid(int w, int h, int c, int levels);
+pyramid make_pyramid(image im, int levels);
+void update_pyramid(pyramid p, image im);
+void free_pyramid(pyramid p);
+pyramid make_laplacian_pyramid(pyramid g);
+image collapse_pyramid(pyramid lap);
+
+// Integral images
+integral_image make_integral_table(int w, int h, int c);
+void free_integral_table(integral_image t);
+integral_image integral_table(image_view im);
+integral_stream make_integral_stream(int w, int c);
+void integral_stream_rows(integral_stream *s, image_view rows, integral_image out);
+void free_integral_stream(integral_stream s);
+image make_integral_image(image im);
+
 // Filtering
 image convolve_image(image im, image filter, int preserve);
+image convolve_image_reference(image im, image filter, int preserve);
 image make_box_filter(int w);
 image make_highpass_filter();
 image make_sharpen_filter();
@@ -93,19 +314,72 @@ void insert_channel(image im, image insertion, int channel);
 // Harris and Stitching
 image structure_matrix(image im, float sigma);
 image cornerness_response(image S);
+image harris_response(image im, float sigma);
+image nms_image(image im, int w);
+image nms_image_reference(image im, int w);
+int *nms_keypoints(image im, int w, float thresh, int *n);
 void free_descriptors(descriptor *d, int n);
+descriptor describe_index(image im, int i);
+descriptor_set make_descriptor_set(int n, int d);
+void free_descriptor_set(descriptor_set s);
+float *descriptor_row(descriptor_set s, int i);
+descriptor_set descriptor_set_from_array(descriptor *d, int n);
+descriptor *descriptor_array_from_set(descriptor_set s);
+void free_descriptor_block(descriptor *d);
+descriptor_set harris_corner_descriptors(image im, float sigma, float thresh, int nms);
 image cylindrical_project(image im, float f);
+image cylindrical_project_reference(image im, float f);
 void mark_corners(image im, descriptor *d, int n);
 image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms);
 void detect_and_draw_corners(image im, float sigma, float thresh, int nms);
 int model_inliers(matrix H, match *m, int n, float thresh);
+point make_point(float x, float y);
+point project_point(matrix H, point p);
+matrix compute_homography(match *matches, int n);
+int fit_homography(const match *m, const int *idx, int n, double *H);
+ransac_params default_ransac_params();
+matrix ransac_homography(match *m, int n, ransac_params p, int *inliers);
+matrix RANSAC(match *m, int n, float thresh, int k, int cutoff);
+matrix RANSAC_reference(match *m, int n, float thresh, int k, int cutoff);
+match *make_synthetic_matches(const double *H, int n, float ratio, float noise);
 image combine_images(image a, image b, matrix H);
+image combine_images_reference(image a, image b, matrix H);
+image combine_images_blend(image a, image b, matrix H, BLEND mode, int bands);
+void blend_images_view(image *ims, matrix *G, int n, BLEND mode, int bands, image_view dst, int ox, int oy);
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn);
+match_params default_match_params();
+match *match_descriptors_params(descriptor *a, int an, descriptor *b, int bn, match_params p, int *mn);
+match *match_descriptor_sets(descriptor_set a, descriptor_set b, match_params p, int *mn);
+match *match_descriptors_reference(descriptor *a, int an, descriptor *b, int bn, int *mn);
+match_index *make_match_index(descriptor *d, int n, match_params p);
+match_index *make_match_index_set(descriptor_set s, match_params p);
+void query_match_index(match_index *ix, descriptor *q, int qn, int *best, float *dist);
+void query_match_index_set(match_index *ix, descriptor_set q, int *best, float *dist);
+void free_match_index(match_index *ix);
+int match_compare(const void *a, const void *b);
+float l1_distance(float *a, float *b, int n);
+descriptor *make_random_descriptors(int n, int len);
 descriptor *harris_corner_detector(image im, float sigma, float thresh, int nms, int *n);
 image panorama_image(image a, image b, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
+panorama_params default_panorama_params();
+panorama_layout panorama_plan(image *ims, int n, panorama_params p);
+void free_panorama_layout(panorama_layout l);
+image panorama_render(image *ims, panorama_layout l, int max_size);
+int save_panorama_ppm(image *ims, panorama_layout l, const char *name, int strip);
+image panorama_build(image *ims, int n, panorama_params p);
+image panorama_images(image *ims, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff);
 
 // Optical Flow
+image box_filter_image(image im, int s);
+image box_filter_image_reference(image im, int s);
+image time_structure_matrix(image im, image prev, int s);
+void velocity_view(image_view S, int stride, float min_eigen, image_view v);
+image velocity_image(image S, int stride);
+image velocity_image_reference(image S, int stride);
 image optical_flow_images(image im, image prev, int smooth, int stride);
+flow_params default_flow_params();
+image optical_flow_lk(image im, image prev, flow_params p);
+int track_points_lk(image im, image prev, const point *pts, int n, flow_params p, point *out, int *status);
 void optical_flow_webcam(int smooth, int stride, int div);
 void draw_flow(image im, image v, float scale);
 
@@ -127,18 +401,19 @@ void draw_flow(image im, image v, float scale);
 
 typedef enum{LINEAR, LOGISTIC, RELU, LRELU, SOFTMAX} ACTIVATION;
 
+// The classifier works in single precision throughout.
 typedef struct {
-    matrix in;              // Saved input to a layer
-    matrix w;               // Current weights for a layer
-    matrix dw;              // Current weight updates
-    matrix v;               // Past weight updates (for use with momentum)
-    matrix out;             // Saved output from the layer
+    fmatrix in;             // Saved input to a layer
+    fmatrix w;              // Current weights for a layer
+    fmatrix dw;             // Current weight updates
+    fmatrix v;              // Past weight updates (for use with momentum)
+    fmatrix out;            // Saved output from the layer
     ACTIVATION activation;  // Activation the layer uses
 } layer;
 
 typedef struct{
-    matrix X;
-    matrix y;
+    fmatrix X;
+    fmatrix y;
 } data;
 
 typedef struct {
@@ -146,6 +421,18 @@ typedef struct {
     int n;
 } model;
 
+// Buffers for training a model at a fixed batch size, so steps allocate
+// nothing. Weights, their gradients and momentum stay in the layers.
+// fmatrix X, y: current batch, shallow rows of the data set.
+// fmatrix *out: output of each layer for the batch.
+// fmatrix *delta: gradient of the loss w.r.t. each layer's output.
+typedef struct {
+    int n, batch;
+    fmatrix X, y;
+    fmatrix *out;
+    fmatrix *delta;
+} train_workspace;
+
 data load_classification_data(char *images, char *label_file, int bias);
 void free_data(data d);
 data random_batch(data d, int n);
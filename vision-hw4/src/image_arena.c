@@ -0,0 +1,185 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+
+// Scoped bump allocator for image temporaries. Memory handed out between
+// image_arena_begin and image_arena_end comes from a few large blocks that
+// are kept when the scope ends, so a pipeline that runs once per frame
+// stops touching the heap after its first frame.
+// Every allocation, arena or heap, sits right after a small header saying
+// where it came from, so image_arena_free works from any thread and
+// never hands arena memory to free().
+
+#define ARENA_MAX_BLOCKS 64
+#define ARENA_MAX_DEPTH 32
+#define ARENA_ALIGN 64
+#define ARENA_MIN_BLOCK (1 << 20)
+#define ARENA_MAGIC 0x41524e41u
+
+typedef struct{
+    char *data[ARENA_MAX_BLOCKS];
+    size_t size[ARENA_MAX_BLOCKS];
+    int blocks;
+    int block;          // block currently being bumped
+    size_t used;        // bytes used in that block
+    int depth;
+    int mark_block[ARENA_MAX_DEPTH];
+    size_t mark_used[ARENA_MAX_DEPTH];
+} image_arena;
+
+// Sits just before every allocation.
+// void *base: heap block to free, 0 for arena memory.
+typedef struct{
+    void *base;
+    unsigned magic;
+} arena_header;
+
+static __thread image_arena arena;
+static long heap_allocations = 0;
+
+// Number of heap allocations made for image memory so far, including
+// arena blocks. Steady-state arena scopes leave it unchanged.
+long image_heap_allocations()
+{
+    return __sync_add_and_fetch(&heap_allocations, 0);
+}
+
+static void *counted_alloc(size_t bytes, size_t align)
+{
+    void *p = 0;
+    __sync_add_and_fetch(&heap_allocations, 1);
+    if(posix_memalign(&p, align, bytes ? bytes : align)) return 0;
+    return p;
+}
+
+// Put a header in front of the memory after base and return that memory.
+// base must have ARENA_ALIGN bytes to spare and be at least 16-byte
+// aligned, the result is ARENA_ALIGN aligned.
+static void *tag(char *base, void *heap)
+{
+    if(!base) return 0;
+    char *p = (char *)(((uintptr_t)base + ARENA_ALIGN) & ~(uintptr_t)(ARENA_ALIGN - 1));
+    arena_header *h = (arena_header *)p - 1;
+    h->base = heap;
+    h->magic = ARENA_MAGIC;
+    return p;
+}
+
+static void *tagged_heap_alloc(size_t bytes)
+{
+    char *base = counted_alloc(bytes + ARENA_ALIGN, ARENA_ALIGN);
+    return tag(base, base);
+}
+
+// Open an arena scope. Scopes nest, and everything allocated in a scope
+// is released together when it ends.
+void image_arena_begin()
+{
+    assert(arena.depth < ARENA_MAX_DEPTH);
+    arena.mark_block[arena.depth] = arena.block;
+    arena.mark_used[arena.depth] = arena.used;
+    ++arena.depth;
+}
+
+// Close the innermost arena scope. Images made inside it must not be used
+// afterwards and freeing them is optional, but only before the scope ends:
+// the outermost scope may give the memory back, headers included.
+void image_arena_end()
+{
+    assert(arena.depth > 0);
+    --arena.depth;
+    arena.block = arena.mark_block[arena.depth];
+    arena.used = arena.mark_used[arena.depth];
+
+    // Merge the blocks once the outermost scope is done, so the next
+    // frame fits in a single block.
+    if(arena.depth == 0 && arena.blocks > 1){
+        size_t total = 0;
+        int i;
+        for(i = 0; i < arena.blocks; ++i){
+            total += arena.size[i];
+            free(arena.data[i]);
+        }
+        arena.data[0] = counted_alloc(total, ARENA_ALIGN);
+        arena.size[0] = arena.data[0] ? total : 0;
+        arena.blocks = 1;
+    }
+}
+
+// Free the blocks the calling thread's arena keeps between scopes.
+void image_arena_release()
+{
+    assert(arena.depth == 0);
+    int i;
+    for(i = 0; i < arena.blocks; ++i) free(arena.data[i]);
+    memset(&arena, 0, sizeof(arena));
+}
+
+// Whether a pointer was handed out by the calling thread's arena.
+int image_arena_owns(void *p)
+{
+    int i;
+    for(i = 0; i < arena.blocks; ++i){
+        if((char *)p >= arena.data[i] && (char *)p < arena.data[i] + arena.size[i]) return 1;
+    }
+    return 0;
+}
+
+// Allocate uninitialized memory, from the arena inside a scope and from
+// the heap otherwise.
+// size_t bytes: size of the allocation.
+// returns: 64-byte aligned memory, release with image_arena_free.
+void *image_arena_alloc(size_t bytes)
+{
+    if(arena.depth == 0) return tagged_heap_alloc(bytes);
+
+    // One alignment unit in front of every allocation holds its header.
+    bytes = (bytes + 2*ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN;
+    while(arena.block < arena.blocks){
+        if(arena.used + bytes <= arena.size[arena.block]){
+            char *p = arena.data[arena.block] + arena.used;
+            arena.used += bytes;
+            return tag(p, 0);
+        }
+        ++arena.block;
+        arena.used = 0;
+    }
+    if(arena.blocks == ARENA_MAX_BLOCKS) return tagged_heap_alloc(bytes);
+
+    size_t size = MAX(bytes, ARENA_MIN_BLOCK);
+    if(arena.blocks) size = MAX(size, 2*arena.size[arena.blocks-1]);
+    char *block = counted_alloc(size, ARENA_ALIGN);
+    if(!block) return 0;
+    arena.data[arena.blocks] = block;
+    arena.size[arena.blocks] = size;
+    arena.block = arena.blocks++;
+    arena.used = bytes;
+    return tag(block, 0);
+}
+
+// Allocate zeroed memory, from the arena inside a scope and from the heap
+// otherwise, where calloc can hand out pages that are already clear.
+void *image_arena_calloc(size_t bytes)
+{
+    if(arena.depth == 0){
+        __sync_add_and_fetch(&heap_allocations, 1);
+        char *base = calloc(bytes + ARENA_ALIGN, 1);
+        return tag(base, base);
+    }
+    void *p = image_arena_alloc(bytes);
+    if(p) memset(p, 0, bytes);
+    return p;
+}
+
+// Release memory from image_arena_alloc or image_arena_calloc, from any
+// thread. Arena memory is reclaimed when its scope ends, so this only
+// frees heap allocations.
+void image_arena_free(void *p)
+{
+    if(!p) return;
+    arena_header *h = (arena_header *)p - 1;
+    assert(h->magic == ARENA_MAGIC);
+    if(h->base) free(h->base);
+}
@@ -0,0 +1,196 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+// View a whole image, the contiguous special case.
+// image im: image to view, keeps owning its data.
+// returns: view of every pixel of im.
+image_view view_image(image im)
+{
+    image_view v;
+    v.w = im.w;
+    v.h = im.h;
+    v.c = im.c;
+    v.stride = im.w;
+    v.cstride = im.w*im.h;
+    v.offset = 0;
+    v.data = im.data;
+    return v;
+}
+
+// View a rectangle of another view, no pixels are copied.
+// image_view v: view to crop.
+// int x, y: top left corner of the rectangle in v.
+// int w, h: size of the rectangle.
+// returns: view of the rectangle.
+image_view view_roi(image_view v, int x, int y, int w, int h)
+{
+    assert(x >= 0 && y >= 0 && x + w <= v.w && y + h <= v.h);
+    v.offset += x + y*v.stride;
+    v.w = w;
+    v.h = h;
+    return v;
+}
+
+// View a single channel of another view, no pixels are copied.
+// image_view v: view to take the channel from.
+// int c: channel.
+// returns: 1 channel view.
+image_view view_channel(image_view v, int c)
+{
+    assert(0 <= c && c < v.c);
+    v.offset += c*v.cstride;
+    v.c = 1;
+    return v;
+}
+
+// Pointer to the first pixel of a row in a view.
+// image_view v: view.
+// int y, c: row and channel.
+// returns: pointer to v.w consecutive floats.
+float *view_row(image_view v, int y, int c)
+{
+    return v.data + v.offset + y*v.stride + c*v.cstride;
+}
+
+// Whether a view covers its memory the same way an image would.
+int view_is_contiguous(image_view v)
+{
+    return v.stride == v.w && (v.c == 1 || v.cstride == v.w*v.h);
+}
+
+// Treat a contiguous view as an image without copying. The result
+// shares memory with the view and must not be freed.
+image view_as_image(image_view v)
+{
+    assert(view_is_contiguous(v));
+    image im;
+    im.w = v.w;
+    im.h = v.h;
+    im.c = v.c;
+    im.data = view_row(v, 0, 0);
+    return im;
+}
+
+// Copy the pixels of a view into a new contiguous image.
+image view_to_image(image_view v)
+{
+    image im = make_image(v.w, v.h, v.c);
+    copy_view(v, view_image(im));
+    return im;
+}
+
+// Copy pixels between two views of the same size.
+void copy_view(image_view src, image_view dst)
+{
+    assert(src.w == dst.w && src.h == dst.h && src.c == dst.c);
+    int y, c;
+    for(c = 0; c < src.c; ++c){
+        for(y = 0; y < src.h; ++y){
+            memmove(view_row(dst, y, c), view_row(src, y, c), src.w*sizeof(float));
+        }
+    }
+}
+
+// Set every pixel of a view to a value.
+void fill_view(image_view v, float value)
+{
+    int x, y, c;
+    for(c = 0; c < v.c; ++c){
+        for(y = 0; y < v.h; ++y){
+            float *row = view_row(v, y, c);
+            for(x = 0; x < v.w; ++x) row[x] = value;
+        }
+    }
+}
+
+typedef enum{VIEW_ADD, VIEW_SUB, VIEW_MULT} view_op;
+
+// Apply an elementwise operation dst = a op b, any view may alias another.
+static void binary_view(image_view a, image_view b, image_view dst, view_op op)
+{
+    assert(a.w == b.w && a.h == b.h && a.c == b.c);
+    assert(a.w == dst.w && a.h == dst.h && a.c == dst.c);
+    int x, y, c;
+    #pragma omp parallel for private(x, c)
+    for(y = 0; y < a.h; ++y){
+        for(c = 0; c < a.c; ++c){
+            float *ra = view_row(a, y, c);
+            float *rb = view_row(b, y, c);
+            float *rd = view_row(dst, y, c);
+            switch(op){
+                case VIEW_ADD:  for(x = 0; x < a.w; ++x) rd[x] = ra[x] + rb[x]; break;
+                case VIEW_SUB:  for(x = 0; x < a.w; ++x) rd[x] = ra[x] - rb[x]; break;
+                case VIEW_MULT: for(x = 0; x < a.w; ++x) rd[x] = ra[x] * rb[x]; break;
+            }
+        }
+    }
+}
+
+void add_view(image_view a, image_view b, image_view dst)
+{
+    binary_view(a, b, dst, VIEW_ADD);
+}
+
+void sub_view(image_view a, image_view b, image_view dst)
+{
+    binary_view(a, b, dst, VIEW_SUB);
+}
+
+void mult_view(image_view a, image_view b, image_view dst)
+{
+    binary_view(a, b, dst, VIEW_MULT);
+}
+
+// Resize a view into another with bilinear interpolation. Matches
+// bilinear_resize pixel for pixel, including its clamped borders.
+// image_view im: source view.
+// image_view dst: destination, any size, same number of channels.
+void bilinear_resize_view(image_view im, image_view dst)
+{
+    assert(im.c == dst.c);
+    float rx = (float)(im.w)/(float)(dst.w);
+    float ry = (float)(im.h)/(float)(dst.h);
+
+    int *xl = calloc(2*dst.w, sizeof(int));
+    int *xr = xl + dst.w;
+    float *tx = calloc(dst.w, sizeof(float));
+    int i, j, k;
+    for(i = 0; i < dst.w; ++i){
+        float x = (i + 0.5f)*rx - 0.5f;
+        int left = (int) floorf(x);
+        tx[i] = x - left;
+        xl[i] = MIN(MAX(left, 0), im.w - 1);
+        xr[i] = MIN(MAX(left + 1, 0), im.w - 1);
+    }
+
+    #pragma omp parallel for private(i, k)
+    for(j = 0; j < dst.h; ++j){
+        float y = (j + 0.5f)*ry - 0.5f;
+        int top = (int) floorf(y);
+        float ty = y - top;
+        int yt = MIN(MAX(top, 0), im.h - 1);
+        int yb = MIN(MAX(top + 1, 0), im.h - 1);
+        for(k = 0; k < dst.c; ++k){
+            float *t = view_row(im, yt, k);
+            float *b = view_row(im, yb, k);
+            float *out = view_row(dst, j, k);
+            for(i = 0; i < dst.w; ++i){
+                float top_row = t[xl[i]] + (t[xr[i]] - t[xl[i]])*tx[i];
+                float bottom_row = b[xl[i]] + (b[xr[i]] - b[xl[i]])*tx[i];
+                out[i] = top_row + (bottom_row - top_row)*ty;
+            }
+        }
+    }
+    free(xl);
+    free(tx);
+}
+
+// Extract a channel of an image.
+// returns: new single channel image.
+image get_channel(image im, int c)
+{
+    return view_to_image(view_channel(view_image(im), c));
+}
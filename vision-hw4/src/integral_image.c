@@ -0,0 +1,118 @@
+#include <stdlib.h>
+#include <assert.h>
+#include "image.h"
+
+// Summed area tables. Rows are prefix summed independently, then the rows
+// are added down each column, so building a table is O(w*h) and both
+// phases split into independent work. Sums are kept in doubles, a float
+// table of a large image can't tell neighbouring entries apart anymore.
+// A stream keeps the bottom row of what it has summed so far, so a table
+// can also be built a strip of rows at a time.
+
+// Columns summed per task in the vertical phase.
+#define INTEGRAL_COLUMNS 256
+
+integral_image make_integral_table(int w, int h, int c)
+{
+    integral_image t;
+    t.w = w;
+    t.h = h;
+    t.c = c;
+    t.data = calloc((size_t)w*h*c, sizeof(double));
+    return t;
+}
+
+void free_integral_table(integral_image t)
+{
+    free(t.data);
+}
+
+integral_stream make_integral_stream(int w, int c)
+{
+    integral_stream s;
+    s.w = w;
+    s.c = c;
+    s.rows = 0;
+    s.last = calloc((size_t)w*c, sizeof(double));
+    return s;
+}
+
+void free_integral_stream(integral_stream s)
+{
+    free(s.last);
+}
+
+// Sum the next strip of rows of a streamed image.
+// integral_stream *s: stream, remembers the rows summed so far.
+// image_view rows: next rows of the image, s->w wide with s->c channels.
+// integral_image out: rows.h rows of the table of the whole image so far,
+//                     row y of out is row s->rows + y of the table.
+void integral_stream_rows(integral_stream *s, image_view rows, integral_image out)
+{
+    assert(rows.w == s->w && rows.c == s->c);
+    assert(out.w == rows.w && out.h == rows.h && out.c == rows.c);
+    int w = out.w, h = out.h;
+    int i;
+
+    // Phase 1: prefix sum every row.
+    #pragma omp parallel for
+    for(i = 0; i < h*out.c; ++i){
+        int y = i % h, k = i / h;
+        const float *src = view_row(rows, y, k);
+        double *dst = out.data + (size_t)k*w*h + (size_t)y*w;
+        double sum = 0;
+        int x;
+        for(x = 0; x < w; ++x){
+            sum += src[x];
+            dst[x] = sum;
+        }
+    }
+
+    // Phase 2: add rows down the columns, starting from the last row of
+    // the previous strip, a block of columns per task.
+    int blocks = (w + INTEGRAL_COLUMNS - 1)/INTEGRAL_COLUMNS;
+    #pragma omp parallel for
+    for(i = 0; i < blocks*out.c; ++i){
+        int k = i / blocks;
+        int x0 = (i % blocks)*INTEGRAL_COLUMNS, x1 = MIN(w, x0 + INTEGRAL_COLUMNS);
+        double *plane = out.data + (size_t)k*w*h;
+        double *last = s->last + (size_t)k*w;
+        const double *above = last;
+        int x, y;
+        for(y = 0; y < h; ++y){
+            double *row = plane + (size_t)y*w;
+            for(x = x0; x < x1; ++x) row[x] += above[x];
+            above = row;
+        }
+        if(h) for(x = x0; x < x1; ++x) last[x] = above[x];
+    }
+    s->rows += h;
+}
+
+// Make the summed area table of a view.
+// image_view im: view to sum.
+// returns: table T with T[x,y] = sum{i<=x, j<=y}(im[i,j]), free with
+//          free_integral_table.
+integral_image integral_table(image_view im)
+{
+    integral_image t = make_integral_table(im.w, im.h, im.c);
+    integral_stream s = make_integral_stream(im.w, im.c);
+    integral_stream_rows(&s, im, t);
+    free_integral_stream(s);
+    return t;
+}
+
+// Make an integral image or summed area table from an image
+// image im: image to process
+// returns: image I such that I[x,y] = sum{i<=x, j<=y}(im[i,j]), every entry
+//          rounded once from the double table.
+image make_integral_image(image im)
+{
+    integral_image t = integral_table(view_image(im));
+    image integ = make_image_uninit(im.w, im.h, im.c);
+    size_t i, n = (size_t)im.w*im.h*im.c;
+    #pragma omp parallel for
+    for(i = 0; i < n; ++i) integ.data[i] = t.data[i];
+    free_integral_table(t);
+    return integ;
+}
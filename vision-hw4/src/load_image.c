@@ -17,7 +17,26 @@ image make_empty_image(int w, int h, int c)
 image make_image(int w, int h, int c)
 {
     image out = make_empty_image(w,h,c);
-    out.data = calloc(h*w*c, sizeof(float));
+    out.data = image_arena_calloc((size_t)h*w*c*sizeof(float));
+    return out;
+}
+
+// Make an image whose pixels will all be overwritten, skipping the zeroing.
+image make_image_uninit(int w, int h, int c)
+{
+    image out = make_empty_image(w,h,c);
+    out.data = image_arena_alloc((size_t)h*w*c*sizeof(float));
+    return out;
+}
+
+// Make an image filled with uniform noise in [0, 1), for tests and benchmarks.
+image make_random_image(int w, int h, int c)
+{
+    image out = make_image(w,h,c);
+    int i;
+    for(i = 0; i < w*h*c; ++i){
+        out.data[i] = rand()/(RAND_MAX + 1.0f);
+    }
     return out;
 }
 
@@ -98,7 +117,7 @@ image load_image(char *filename)
 
 void free_image(image im)
 {
-    free(im.data);
+    image_arena_free(im.data);
 }
 
 #ifdef __cplusplus
@@ -0,0 +1,591 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+
+// Nearest neighbour search over descriptors under L1 or L2 distance, with a
+// brute force backend and two approximate ones: a forest of randomized k-d
+// trees and a hierarchical k-means tree. The approximate backends visit
+// nodes best-bin-first and stop after a fixed number of distance checks.
+
+#define KD_LEAF_SIZE 8
+#define KD_SAMPLE 128
+#define KD_TOP_DIMS 5
+#define KMEANS_ITERS 5
+
+typedef struct{
+    int dim;            // split dimension, -1 for leaves
+    float split;
+    int child[2];       // internal nodes: node indexes
+    int start, count;   // leaves: range in order
+} kd_node;
+
+typedef struct{
+    int center;         // offset of the cluster center in centers
+    int first, n;       // internal nodes: children are first..first+n-1
+    int start, count;   // leaves: range in order, count = 0 when internal
+} km_node;
+
+struct match_index{
+    MATCHER backend;
+    DISTANCE metric;
+    int n, dim;
+    float **rows;
+    int checks;
+    int *order;         // point ids, arranged per tree/cluster
+    int trees;
+    int *roots;
+    kd_node *kd;
+    int kd_n, kd_cap;
+    km_node *km;
+    int km_n, km_cap;
+    float *centers;
+    int centers_n, centers_cap;
+    int branching;
+    unsigned long long rng;
+};
+
+typedef struct{
+    float key;
+    int node;
+} heap_entry;
+
+// Default matching: exact brute force on L1 distance, Lowe ratio test off, no mutual check.
+match_params default_match_params()
+{
+    match_params p;
+    p.backend = MATCH_BRUTE;
+    p.metric = DISTANCE_L1;
+    p.ratio = 0;
+    p.mutual = 0;
+    p.trees = 4;
+    p.checks = 64;
+    p.branching = 16;
+    return p;
+}
+
+static unsigned index_rand(match_index *ix)
+{
+    ix->rng ^= ix->rng << 13;
+    ix->rng ^= ix->rng >> 7;
+    ix->rng ^= ix->rng << 17;
+    return (unsigned)(ix->rng >> 32);
+}
+
+static void heap_push(heap_entry *h, int *n, float key, int node)
+{
+    int i = (*n)++;
+    while(i > 0 && h[(i-1)/2].key > key){
+        h[i] = h[(i-1)/2];
+        i = (i-1)/2;
+    }
+    h[i].key = key;
+    h[i].node = node;
+}
+
+static heap_entry heap_pop(heap_entry *h, int *n)
+{
+    heap_entry top = h[0];
+    heap_entry last = h[--(*n)];
+    int i = 0;
+    for(;;){
+        int c = 2*i + 1;
+        if(c >= *n) break;
+        if(c + 1 < *n && h[c+1].key < h[c].key) ++c;
+        if(h[c].key >= last.key) break;
+        h[i] = h[c];
+        i = c;
+    }
+    if(*n) h[i] = last;
+    return top;
+}
+
+static int new_kd_node(match_index *ix)
+{
+    if(ix->kd_n == ix->kd_cap){
+        ix->kd_cap = ix->kd_cap ? 2*ix->kd_cap : 64;
+        ix->kd = realloc(ix->kd, ix->kd_cap*sizeof(kd_node));
+    }
+    return ix->kd_n++;
+}
+
+// Build a randomized k-d tree over order[start, start+count). The split
+// dimension is picked at random among the highest variance ones.
+static int kd_build(match_index *ix, int start, int count, double *mean, double *var)
+{
+    int node = new_kd_node(ix);
+    int *idx = ix->order + start;
+    int i, d;
+    if(count <= KD_LEAF_SIZE){
+        ix->kd[node].dim = -1;
+        ix->kd[node].start = start;
+        ix->kd[node].count = count;
+        return node;
+    }
+
+    int samples = MIN(count, KD_SAMPLE);
+    memset(mean, 0, ix->dim*sizeof(double));
+    memset(var, 0, ix->dim*sizeof(double));
+    for(i = 0; i < samples; ++i){
+        float *p = ix->rows[idx[i*count/samples]];
+        for(d = 0; d < ix->dim; ++d) mean[d] += p[d];
+    }
+    for(d = 0; d < ix->dim; ++d) mean[d] /= samples;
+    for(i = 0; i < samples; ++i){
+        float *p = ix->rows[idx[i*count/samples]];
+        for(d = 0; d < ix->dim; ++d) var[d] += (p[d] - mean[d])*(p[d] - mean[d]);
+    }
+
+    int top[KD_TOP_DIMS];
+    int ntop = 0;
+    for(d = 0; d < ix->dim; ++d){
+        int j = ntop < KD_TOP_DIMS ? ntop++ : KD_TOP_DIMS;
+        while(j > 0 && var[top[j-1]] < var[d]){
+            if(j < KD_TOP_DIMS) top[j] = top[j-1];
+            --j;
+        }
+        if(j < KD_TOP_DIMS) top[j] = d;
+    }
+    int dim = top[index_rand(ix) % ntop];
+    float split = mean[dim];
+
+    int left = 0;
+    for(i = 0; i < count; ++i){
+        if(ix->rows[idx[i]][dim] < split){
+            int swap = idx[i];
+            idx[i] = idx[left];
+            idx[left++] = swap;
+        }
+    }
+    // Every sampled value equal: split the range arbitrarily.
+    if(left == 0 || left == count) left = count/2;
+
+    ix->kd[node].dim = dim;
+    ix->kd[node].split = split;
+    int l = kd_build(ix, start, left, mean, var);
+    int r = kd_build(ix, start + left, count - left, mean, var);
+    ix->kd[node].child[0] = l;
+    ix->kd[node].child[1] = r;
+    return node;
+}
+
+static int new_km_node(match_index *ix)
+{
+    if(ix->km_n == ix->km_cap){
+        ix->km_cap = ix->km_cap ? 2*ix->km_cap : 64;
+        ix->km = realloc(ix->km, ix->km_cap*sizeof(km_node));
+    }
+    return ix->km_n++;
+}
+
+static int new_center(match_index *ix)
+{
+    if(ix->centers_n == ix->centers_cap){
+        ix->centers_cap = ix->centers_cap ? 2*ix->centers_cap : 64;
+        ix->centers = realloc(ix->centers, (size_t)ix->centers_cap*ix->dim*sizeof(float));
+    }
+    return ix->centers_n++ * ix->dim;
+}
+
+// Split order[start, start+count) into the children of a k-means node.
+// The node's own center must already be set.
+static void km_build(match_index *ix, int node, int start, int count)
+{
+    int *idx = ix->order + start;
+    int k = ix->branching;
+    int i, j, d, it;
+    ix->km[node].start = start;
+    ix->km[node].count = count;
+    ix->km[node].first = ix->km[node].n = 0;
+    if(count <= k) return;
+
+    float *centers = calloc((size_t)k*ix->dim, sizeof(float));
+    int *label = calloc(count, sizeof(int));
+    int *sizes = calloc(k, sizeof(int));
+    for(j = 0; j < k; ++j){
+        memcpy(centers + j*ix->dim, ix->rows[idx[(long)j*count/k]], ix->dim*sizeof(float));
+    }
+    for(it = 0; it < KMEANS_ITERS; ++it){
+        for(i = 0; i < count; ++i){
+            float best = INFINITY;
+            for(j = 0; j < k; ++j){
+                float dist = descriptor_distance(ix->metric, ix->rows[idx[i]], centers + j*ix->dim, ix->dim, best);
+                if(dist < best){
+                    best = dist;
+                    label[i] = j;
+                }
+            }
+        }
+        memset(centers, 0, (size_t)k*ix->dim*sizeof(float));
+        memset(sizes, 0, k*sizeof(int));
+        for(i = 0; i < count; ++i){
+            float *p = ix->rows[idx[i]];
+            float *c = centers + label[i]*ix->dim;
+            for(d = 0; d < ix->dim; ++d) c[d] += p[d];
+            ++sizes[label[i]];
+        }
+        for(j = 0; j < k; ++j){
+            float *c = centers + j*ix->dim;
+            // Reseed an empty cluster with a point from the range.
+            if(!sizes[j]) memcpy(c, ix->rows[idx[index_rand(ix) % count]], ix->dim*sizeof(float));
+            else for(d = 0; d < ix->dim; ++d) c[d] /= sizes[j];
+        }
+    }
+
+    // Group the points by cluster, in place.
+    int *sorted = calloc(count, sizeof(int));
+    int *next = calloc(k + 1, sizeof(int));
+    for(j = 0; j < k; ++j) next[j+1] = next[j] + sizes[j];
+    for(i = 0; i < count; ++i) sorted[next[label[i]]++] = idx[i];
+    memcpy(idx, sorted, count*sizeof(int));
+
+    int used = 0;
+    for(j = 0; j < k; ++j) used += sizes[j] > 0;
+    if(used > 1){
+        int first = ix->km_n;
+        for(j = 0; j < k; ++j) if(sizes[j]) new_km_node(ix);
+        ix->km[node].first = first;
+        ix->km[node].n = used;
+        int child = first, offset = start;
+        for(j = 0; j < k; ++j){
+            if(!sizes[j]) continue;
+            int c = new_center(ix);
+            memcpy(ix->centers + c, centers + j*ix->dim, ix->dim*sizeof(float));
+            ix->km[child].center = c;
+            km_build(ix, child, offset, sizes[j]);
+            offset += sizes[j];
+            ++child;
+        }
+    }
+    free(sorted);
+    free(next);
+    free(centers);
+    free(label);
+    free(sizes);
+}
+
+// Build an index over rows of descriptor data.
+// float **rows: n rows of dim values, the rows must outlive the index.
+static match_index *index_rows(float **rows, int n, int dim, match_params p)
+{
+    match_index *ix = calloc(1, sizeof(match_index));
+    int i, t;
+    ix->backend = n ? p.backend : MATCH_BRUTE;
+    ix->metric = p.metric;
+    ix->n = n;
+    ix->dim = dim;
+    ix->checks = MAX(p.checks, 1);
+    ix->branching = MAX(p.branching, 2);
+    ix->rng = 0x9E3779B97F4A7C15ULL;
+    ix->rows = calloc(MAX(n, 1), sizeof(float *));
+    memcpy(ix->rows, rows, n*sizeof(float *));
+
+    if(ix->backend == MATCH_KDTREE){
+        ix->trees = MAX(p.trees, 1);
+        ix->roots = calloc(ix->trees, sizeof(int));
+        ix->order = calloc((size_t)ix->trees*n, sizeof(int));
+        double *mean = calloc(ix->dim, sizeof(double));
+        double *var = calloc(ix->dim, sizeof(double));
+        for(t = 0; t < ix->trees; ++t){
+            for(i = 0; i < n; ++i) ix->order[t*n + i] = i;
+            ix->roots[t] = kd_build(ix, t*n, n, mean, var);
+        }
+        free(mean);
+        free(var);
+    } else if(ix->backend == MATCH_KMEANS){
+        ix->order = calloc(n, sizeof(int));
+        for(i = 0; i < n; ++i) ix->order[i] = i;
+        int root = new_km_node(ix);
+        ix->km[root].center = new_center(ix);
+        km_build(ix, root, 0, n);
+    }
+    return ix;
+}
+
+// Pointers to the rows of a descriptor set.
+static float **set_rows(descriptor_set s)
+{
+    float **rows = calloc(MAX(s.n, 1), sizeof(float *));
+    int i;
+    for(i = 0; i < s.n; ++i) rows[i] = descriptor_row(s, i);
+    return rows;
+}
+
+static float **array_rows(descriptor *d, int n)
+{
+    float **rows = calloc(MAX(n, 1), sizeof(float *));
+    int i;
+    for(i = 0; i < n; ++i) rows[i] = d[i].data;
+    return rows;
+}
+
+// Build a search index over an array of descriptors.
+// descriptor *d: descriptors to index, must outlive the index.
+// int n: number of descriptors.
+// match_params p: backend and its settings.
+// returns: index, free with free_match_index.
+match_index *make_match_index(descriptor *d, int n, match_params p)
+{
+    float **rows = array_rows(d, n);
+    match_index *ix = index_rows(rows, n, n ? d[0].n : 0, p);
+    free(rows);
+    return ix;
+}
+
+// Build a search index over a descriptor set, which must outlive it.
+match_index *make_match_index_set(descriptor_set s, match_params p)
+{
+    float **rows = set_rows(s);
+    match_index *ix = index_rows(rows, s.n, s.d, p);
+    free(rows);
+    return ix;
+}
+
+void free_match_index(match_index *ix)
+{
+    if(!ix) return;
+    free(ix->rows);
+    free(ix->order);
+    free(ix->roots);
+    free(ix->kd);
+    free(ix->km);
+    free(ix->centers);
+    free(ix);
+}
+
+// Scratch one query needs, so queries can run in parallel.
+typedef struct{
+    heap_entry *heap;
+    int *stamp;
+    int query;
+} query_state;
+
+static void check_point(match_index *ix, query_state *s, const float *q, int id,
+        int *best, float *dist, int *checked)
+{
+    if(s->stamp[id] == s->query) return;
+    s->stamp[id] = s->query;
+    ++*checked;
+    float dd = descriptor_distance(ix->metric, q, ix->rows[id], ix->dim, dist[1]);
+    if(dd < dist[0]){
+        best[1] = best[0]; dist[1] = dist[0];
+        best[0] = id; dist[0] = dd;
+    } else if(dd < dist[1]){
+        best[1] = id; dist[1] = dd;
+    }
+}
+
+// Find the two nearest indexed descriptors to a query.
+// float *q: query descriptor.
+// int best[2], float dist[2]: filled with the nearest ids and distances,
+//                             -1 and INFINITY when missing.
+static void query_index(match_index *ix, query_state *s, const float *q, int *best, float *dist)
+{
+    int i, hn = 0, checked = 0;
+    best[0] = best[1] = -1;
+    dist[0] = dist[1] = INFINITY;
+    ++s->query;
+
+    if(ix->backend == MATCH_BRUTE){
+        for(i = 0; i < ix->n; ++i) check_point(ix, s, q, i, best, dist, &checked);
+        return;
+    }
+    if(ix->backend == MATCH_KDTREE){
+        for(i = 0; i < ix->trees; ++i) heap_push(s->heap, &hn, 0, ix->roots[i]);
+        while(hn && checked < ix->checks){
+            heap_entry e = heap_pop(s->heap, &hn);
+            if(e.key >= dist[1]) break;
+            int node = e.node;
+            while(ix->kd[node].dim >= 0){
+                kd_node *k = ix->kd + node;
+                float diff = q[k->dim] - k->split;
+                int side = diff >= 0;
+                float gap = ix->metric == DISTANCE_L2 ? diff*diff : fabsf(diff);
+                heap_push(s->heap, &hn, MAX(e.key, gap), k->child[!side]);
+                node = k->child[side];
+            }
+            for(i = 0; i < ix->kd[node].count; ++i){
+                check_point(ix, s, q, ix->order[ix->kd[node].start + i], best, dist, &checked);
+            }
+        }
+        return;
+    }
+    heap_push(s->heap, &hn, 0, 0);
+    while(hn && checked < ix->checks){
+        int node = heap_pop(s->heap, &hn).node;
+        while(ix->km[node].n){
+            km_node *k = ix->km + node;
+            int nearest = -1;
+            float nd = INFINITY;
+            for(i = 0; i < k->n; ++i){
+                float dd = descriptor_distance(ix->metric, q, ix->centers + ix->km[k->first + i].center, ix->dim, INFINITY);
+                if(dd < nd){
+                    if(nearest >= 0) heap_push(s->heap, &hn, nd, nearest);
+                    nearest = k->first + i;
+                    nd = dd;
+                } else {
+                    heap_push(s->heap, &hn, dd, k->first + i);
+                }
+            }
+            node = nearest;
+        }
+        for(i = 0; i < ix->km[node].count; ++i){
+            check_point(ix, s, q, ix->order[ix->km[node].start + i], best, dist, &checked);
+        }
+    }
+}
+
+// Nodes a query can push onto its heap at most.
+static int heap_capacity(match_index *ix)
+{
+    if(ix->backend == MATCH_KDTREE) return ix->kd_n + ix->trees;
+    if(ix->backend == MATCH_KMEANS) return ix->km_n + 1;
+    return 1;
+}
+
+static void query_rows(match_index *ix, float **q, int qn, int *best, float *dist)
+{
+    #pragma omp parallel
+    {
+        query_state s;
+        s.heap = calloc(heap_capacity(ix), sizeof(heap_entry));
+        s.stamp = calloc(MAX(ix->n, 1), sizeof(int));
+        s.query = 0;
+        int i;
+        #pragma omp for schedule(dynamic, 16)
+        for(i = 0; i < qn; ++i){
+            query_index(ix, &s, q[i], best + 2*i, dist + 2*i);
+        }
+        free(s.heap);
+        free(s.stamp);
+    }
+}
+
+// Query an index with every descriptor of an array.
+// int *best, float *dist: 2 entries per query, see query_index.
+void query_match_index(match_index *ix, descriptor *q, int qn, int *best, float *dist)
+{
+    float **rows = array_rows(q, qn);
+    query_rows(ix, rows, qn, best, dist);
+    free(rows);
+}
+
+// Query an index with every descriptor of a set, see query_match_index.
+void query_match_index_set(match_index *ix, descriptor_set q, int *best, float *dist)
+{
+    float **rows = set_rows(q);
+    query_rows(ix, rows, q.n, best, dist);
+    free(rows);
+}
+
+// Match rows of descriptor data.
+// float **ar, **br: descriptor rows of both images.
+// point *ap, *bp: their locations.
+static match *match_rows(float **ar, point *ap, int an, float **br, point *bp, int bn,
+        int dim, match_params p, int *mn)
+{
+    int i;
+    *mn = 0;
+    if(!an || !bn) return calloc(1, sizeof(match));
+
+    int *best = calloc(2*an, sizeof(int));
+    float *dist = calloc(2*an, sizeof(float));
+    match_index *ib = index_rows(br, bn, dim, p);
+    query_rows(ib, ar, an, best, dist);
+    free_match_index(ib);
+
+    int *back = 0;
+    if(p.mutual){
+        back = calloc(2*bn, sizeof(int));
+        float *bdist = calloc(2*bn, sizeof(float));
+        match_index *ia = index_rows(ar, an, dim, p);
+        query_rows(ia, br, bn, back, bdist);
+        free_match_index(ia);
+        free(bdist);
+    }
+
+    match *m = calloc(an, sizeof(match));
+    int n = 0;
+    for(i = 0; i < an; ++i){
+        int j = best[2*i];
+        if(j < 0) continue;
+        if(p.ratio > 0 && !(dist[2*i] < p.ratio*dist[2*i+1])) continue;
+        if(back && back[2*j] != i) continue;
+        m[n].ai = i;
+        m[n].bi = j;
+        m[n].p = ap[i];
+        m[n].q = bp[j];
+        m[n].distance = dist[2*i];
+        ++n;
+    }
+    free(best);
+    free(dist);
+    free(back);
+
+    // Keep the closest match for every descriptor in b.
+    qsort(m, n, sizeof(match), match_compare);
+    char *seen = calloc(bn, sizeof(char));
+    int kept = 0;
+    for(i = 0; i < n; ++i){
+        if(seen[m[i].bi]) continue;
+        seen[m[i].bi] = 1;
+        m[kept++] = m[i];
+    }
+    free(seen);
+    *mn = kept;
+    return m;
+}
+
+// Finds matches between descriptors of two images.
+// descriptor *a, *b: array of descriptors for pixels in two images.
+// int an, bn: number of descriptors in arrays a and b.
+// match_params p: search backend, ratio test and mutual check.
+// int *mn: pointer to number of matches found, to be filled in by function.
+// returns: matches sorted by distance, each descriptor in b used at most once.
+match *match_descriptors_params(descriptor *a, int an, descriptor *b, int bn, match_params p, int *mn)
+{
+    float **ar = array_rows(a, an);
+    float **br = array_rows(b, bn);
+    point *ap = calloc(MAX(an, 1), sizeof(point));
+    point *bp = calloc(MAX(bn, 1), sizeof(point));
+    int i;
+    for(i = 0; i < an; ++i) ap[i] = a[i].p;
+    for(i = 0; i < bn; ++i) bp[i] = b[i].p;
+    match *m = match_rows(ar, ap, an, br, bp, bn, an ? a[0].n : 0, p, mn);
+    free(ar);
+    free(br);
+    free(ap);
+    free(bp);
+    return m;
+}
+
+// Finds matches between two descriptor sets, see match_descriptors_params.
+match *match_descriptor_sets(descriptor_set a, descriptor_set b, match_params p, int *mn)
+{
+    assert(a.d == b.d || !a.n || !b.n);
+    float **ar = set_rows(a);
+    float **br = set_rows(b);
+    match *m = match_rows(ar, a.p, a.n, br, b.p, b.n, a.d, p, mn);
+    free(ar);
+    free(br);
+    return m;
+}
+
+// Make descriptors with random values, for tests and benchmarks.
+// int n: number of descriptors.
+// int len: values per descriptor.
+// returns: descriptors at random points, free with free_descriptors.
+descriptor *make_random_descriptors(int n, int len)
+{
+    descriptor *d = calloc(n, sizeof(descriptor));
+    int i, j;
+    for(i = 0; i < n; ++i){
+        d[i].p.x = rand()%640;
+        d[i].p.y = rand()%480;
+        d[i].n = len;
+        d[i].data = calloc(len, sizeof(float));
+        for(j = 0; j < len; ++j) d[i].data[j] = (float)rand()/RAND_MAX;
+    }
+    return d;
+}
@@ -25,8 +25,7 @@ matrix make_translation_homography(float dx, float dy)
 void free_matrix(matrix m)
 {
     if (m.data) {
-        int i;
-        if (!m.shallow) for(i = 0; i < m.rows; ++i) free(m.data[i]);
+        if (!m.shallow) free(m.block);
         free(m.data);
     }
 }
@@ -37,9 +36,15 @@ matrix make_matrix(int rows, int cols)
     m.rows = rows;
     m.cols = cols;
     m.shallow = 0;
+    // Every row starts on a cache line of one zeroed block.
+    m.stride = (cols + 7) & ~7;
+    size_t bytes = (size_t)rows*m.stride*sizeof(double);
+    void *block = 0;
+    if(!posix_memalign(&block, 64, bytes ? bytes : 64)) memset(block, 0, bytes);
+    m.block = block;
     m.data = calloc(m.rows, sizeof(double *));
     int i;
-    for(i = 0; i < m.rows; ++i) m.data[i] = calloc(m.cols, sizeof(double));
+    for(i = 0; i < m.rows; ++i) m.data[i] = m.block + (size_t)i*m.stride;
     return m;
 }
 
@@ -81,15 +86,22 @@ matrix make_identity(int rows, int cols)
 }
 
 matrix matrix_mult_matrix(matrix a, matrix b)
+{
+    assert(a.cols == b.rows);
+    matrix p = make_matrix(a.rows, b.cols);
+    gemm(0, 0, 1, a, b, 0, p);
+    return p;
+}
+
+// Original triple loop product, without its racy inner parallel loops,
+// kept for tests and benchmarks.
+matrix matrix_mult_matrix_reference(matrix a, matrix b)
 {
     assert(a.cols == b.rows);
     int i, j, k;
     matrix p = make_matrix(a.rows, b.cols);
-#pragma omp parallel for
 	for(i = 0; i < p.rows; ++i){
-#pragma omp parallel for
 		for(j = 0; j < p.cols; ++j){
-#pragma omp parallel for
 			for(k = 0; k < a.cols; ++k){
                 p.data[i][j] += a.data[i][k]*b.data[k][j];
             }
@@ -142,16 +154,10 @@ matrix axpy_matrix(double a, matrix x, matrix y)
 
 matrix transpose_matrix(matrix m)
 {
-    matrix t;
-    t.rows = m.cols;
-    t.cols = m.rows;
-    t.data = calloc(t.rows, sizeof(double *));
-    t.shallow = 0;
+    matrix t = make_matrix(m.cols, m.rows);
     int i, j;
-#pragma omp parallel for
+#pragma omp parallel for private(j)
 	for(i = 0; i < t.rows; ++i){
-        t.data[i] = calloc(t.cols, sizeof(double));
-#pragma omp parallel for
 		for(j = 0; j < t.cols; ++j){
             t.data[i][j] = m.data[j][i];
         }
@@ -368,16 +374,99 @@ double *sle_solve(matrix A, double *b)
 matrix solve_system(matrix M, matrix b)
 {
     matrix none = {0};
-    matrix Mt = transpose_matrix(M);
-    matrix MtM = matrix_mult_matrix(Mt, M);
+    matrix MtM = make_matrix(M.cols, M.cols);
+    gemm(1, 0, 1, M, M, 0, MtM);
     matrix MtMinv = matrix_invert(MtM);
+    free_matrix(MtM);
     if(!MtMinv.data) return none;
-    matrix Mdag = matrix_mult_matrix(MtMinv, Mt);
+    matrix Mdag = make_matrix(M.cols, M.rows);
+    gemm(0, 1, 1, MtMinv, M, 0, Mdag);
     matrix a = matrix_mult_matrix(Mdag, b);
-    free_matrix(Mt); free_matrix(MtM); free_matrix(MtMinv); free_matrix(Mdag);
+    free_matrix(MtMinv); free_matrix(Mdag);
     return a;
 }
 
+void free_fmatrix(fmatrix m)
+{
+    if (m.data) {
+        if (!m.shallow) free(m.block);
+        free(m.data);
+    }
+}
+
+fmatrix make_fmatrix(int rows, int cols)
+{
+    fmatrix m;
+    m.rows = rows;
+    m.cols = cols;
+    m.shallow = 0;
+    m.stride = (cols + 15) & ~15;
+    size_t bytes = (size_t)rows*m.stride*sizeof(float);
+    void *block = 0;
+    if(!posix_memalign(&block, 64, bytes ? bytes : 64)) memset(block, 0, bytes);
+    m.block = block;
+    m.data = calloc(m.rows, sizeof(float *));
+    int i;
+    for(i = 0; i < m.rows; ++i) m.data[i] = m.block + (size_t)i*m.stride;
+    return m;
+}
+
+fmatrix copy_fmatrix(fmatrix m)
+{
+    fmatrix c = make_fmatrix(m.rows, m.cols);
+    int i;
+    for(i = 0; i < m.rows; ++i) memcpy(c.data[i], m.data[i], m.cols*sizeof(float));
+    return c;
+}
+
+// Same values as random_matrix for the same seed, rounded to float.
+fmatrix random_fmatrix(int rows, int cols, double s)
+{
+    fmatrix m = make_fmatrix(rows, cols);
+    int i, j;
+    for(i = 0; i < rows; ++i){
+        for(j = 0; j < cols; ++j){
+            m.data[i][j] = 2*s*(rand()%1000/1000.0) - s;
+        }
+    }
+    return m;
+}
+
+fmatrix transpose_fmatrix(fmatrix m)
+{
+    fmatrix t = make_fmatrix(m.cols, m.rows);
+    int i, j;
+#pragma omp parallel for private(j)
+	for(i = 0; i < t.rows; ++i){
+		for(j = 0; j < t.cols; ++j){
+            t.data[i][j] = m.data[j][i];
+        }
+    }
+    return t;
+}
+
+fmatrix axpy_fmatrix(float a, fmatrix x, fmatrix y)
+{
+    assert(x.cols == y.cols);
+    assert(x.rows == y.rows);
+    int i, j;
+    fmatrix p = make_fmatrix(x.rows, x.cols);
+    for(i = 0; i < x.rows; ++i){
+        for(j = 0; j < x.cols; ++j){
+            p.data[i][j] = a*x.data[i][j] + y.data[i][j];
+        }
+    }
+    return p;
+}
+
+fmatrix fmatrix_mult_fmatrix(fmatrix a, fmatrix b)
+{
+    assert(a.cols == b.rows);
+    fmatrix p = make_fmatrix(a.rows, b.cols);
+    sgemm(0, 0, 1, a, b, 0, p);
+    return p;
+}
+
 void test_matrix()
 {
     int i;
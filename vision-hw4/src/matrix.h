@@ -1,11 +1,29 @@
 #ifndef MATRIX_H
 #define MATRIX_H
+// A dense matrix of doubles.
+// double **data: row pointers, row i starts at data[i].
+// int shallow: rows belong to another matrix, free only the pointers.
+// int stride: doubles between rows in block.
+// double *block: one 64 byte aligned buffer holding every row, 0 for
+//                shallow matrices.
 typedef struct matrix{
     int rows, cols;
     double **data;
     int shallow;
+    int stride;
+    double *block;
 } matrix;
 
+// Single precision matrix for the classifier, laid out like matrix with
+// rows padded to 64 bytes.
+typedef struct fmatrix{
+    int rows, cols;
+    float **data;
+    int shallow;
+    int stride;
+    float *block;
+} fmatrix;
+
 typedef struct LUP{
     matrix *L;
     matrix *U;
@@ -22,6 +40,8 @@ matrix make_matrix(int rows, int cols);
 matrix copy_matrix(matrix m);
 double *sle_solve(matrix A, double *b);
 matrix matrix_mult_matrix(matrix a, matrix b);
+matrix matrix_mult_matrix_reference(matrix a, matrix b);
+void gemm(int ta, int tb, double alpha, matrix a, matrix b, double beta, matrix c);
 matrix matrix_elmult_matrix(matrix a, matrix b);
 void print_matrix(matrix m);
 double **n_principal_components(matrix m, int n);
@@ -31,4 +51,14 @@ matrix matrix_invert(matrix m);
 matrix random_matrix(int rows, int cols, double s);
 matrix transpose_matrix(matrix m);
 matrix axpy_matrix(double a, matrix x, matrix y);
+
+fmatrix make_fmatrix(int rows, int cols);
+void free_fmatrix(fmatrix m);
+fmatrix copy_fmatrix(fmatrix m);
+fmatrix random_fmatrix(int rows, int cols, double s);
+fmatrix transpose_fmatrix(fmatrix m);
+fmatrix axpy_fmatrix(float a, fmatrix x, fmatrix y);
+fmatrix fmatrix_mult_fmatrix(fmatrix a, fmatrix b);
+void gemm_release();
+void sgemm(int ta, int tb, float alpha, fmatrix a, fmatrix b, float beta, fmatrix c);
 #endif
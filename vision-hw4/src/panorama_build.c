@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+
+// Stitching many images at once. Every image is described once, nearby
+// pairs are matched in parallel, and the pairwise homographies are chained
+// along a maximum spanning tree of the match graph into one homography per
+// image relative to a reference frame. The canvas bounds are computed once
+// and every image is warped into it once, either into memory or a strip of
+// rows at a time straight to disk.
+
+// A link in the match graph.
+// int a, b: images it connects.
+// int inliers: RANSAC inliers of the pair, 0 if the pair failed.
+// matrix H: homography from image a coordinates to image b coordinates.
+typedef struct{
+    int a, b;
+    int inliers;
+    matrix H;
+} pano_edge;
+
+panorama_params default_panorama_params()
+{
+    panorama_params p;
+    p.sigma = 2;
+    p.thresh = 5;
+    p.nms = 3;
+    p.window = 1;
+    p.reference = -1;
+    p.min_inliers = 10;
+    p.max_size = 20000;
+    p.blend = BLEND_NONE;
+    p.bands = 5;
+    p.match = default_match_params();
+    p.ransac = default_ransac_params();
+    return p;
+}
+
+// Pick the links that place each image, strongest first. Grows a maximum
+// spanning tree from the reference and composes homographies as it goes.
+// pano_edge *e: links of the match graph, en of them.
+// matrix *G: filled with the map from reference to image coordinates for
+//            every image the tree reaches, others are left with rows = 0.
+static void chain_homographies(pano_edge *e, int en, int n, int ref, matrix *G)
+{
+    int i, k;
+    for(i = 0; i < n; ++i) G[i].rows = 0;
+    G[ref] = make_identity_homography();
+    for(k = 1; k < n; ++k){
+        int best = -1;
+        for(i = 0; i < en; ++i){
+            if(!e[i].inliers) continue;
+            // Exactly one end already placed.
+            if(!G[e[i].a].rows == !G[e[i].b].rows) continue;
+            if(best < 0 || e[i].inliers > e[best].inliers) best = i;
+        }
+        if(best < 0) break;
+        pano_edge l = e[best];
+        if(G[l.a].rows){
+            G[l.b] = matrix_mult_matrix(l.H, G[l.a]);
+        } else {
+            matrix Hinv = matrix_invert(l.H);
+            G[l.a] = matrix_mult_matrix(Hinv, G[l.b]);
+            free_matrix(Hinv);
+        }
+    }
+}
+
+// Bounding box of an image placed in the reference frame.
+// matrix G: map from reference to image coordinates.
+static void placed_bounds(image im, matrix G, point *topleft, point *botright)
+{
+    matrix Ginv = matrix_invert(G);
+    point c1 = project_point(Ginv, make_point(0, 0));
+    point c2 = project_point(Ginv, make_point(im.w-1, 0));
+    point c3 = project_point(Ginv, make_point(0, im.h-1));
+    point c4 = project_point(Ginv, make_point(im.w-1, im.h-1));
+    free_matrix(Ginv);
+    botright->x = MAX(c1.x, MAX(c2.x, MAX(c3.x, c4.x)));
+    botright->y = MAX(c1.y, MAX(c2.y, MAX(c3.y, c4.y)));
+    topleft->x = MIN(c1.x, MIN(c2.x, MIN(c3.x, c4.x)));
+    topleft->y = MIN(c1.y, MIN(c2.y, MIN(c3.y, c4.y)));
+}
+
+// Place a sequence of overlapping images in a common frame.
+// image *ims: images in capture order, neighbours should overlap.
+// int n: number of images.
+// panorama_params p: detector, matcher, RANSAC and layout settings.
+// returns: homography and footprint of every image and the canvas bounds,
+//          free with free_panorama_layout. Images that no pair links to the
+//          reference are left out.
+panorama_layout panorama_plan(image *ims, int n, panorama_params p)
+{
+    assert(n > 0);
+    int ref = (p.reference >= 0 && p.reference < n) ? p.reference : n/2;
+    int window = MAX(p.window, 1);
+    int i;
+
+    // Describe every image once. The detector is parallel inside.
+    descriptor_set *d = calloc(n, sizeof(descriptor_set));
+    for(i = 0; i < n; ++i){
+        d[i] = harris_corner_descriptors(ims[i], p.sigma, p.thresh, p.nms);
+    }
+
+    // Link each image to the next few, pairs are independent.
+    pano_edge *e = calloc(n*window, sizeof(pano_edge));
+    int en = 0;
+    for(i = 0; i < n; ++i){
+        int j;
+        for(j = i+1; j < n && j <= i + window; ++j){
+            e[en].a = i;
+            e[en].b = j;
+            ++en;
+        }
+    }
+    #pragma omp parallel for schedule(dynamic)
+    for(i = 0; i < en; ++i){
+        int mn = 0, inliers = 0;
+        match *m = match_descriptor_sets(d[e[i].a], d[e[i].b], p.match, &mn);
+        e[i].H = ransac_homography(m, mn, p.ransac, &inliers);
+        e[i].inliers = (inliers >= MAX(p.min_inliers, 4)) ? inliers : 0;
+        free(m);
+    }
+    for(i = 0; i < n; ++i) free_descriptor_set(d[i]);
+    free(d);
+
+    panorama_layout l;
+    l.n = n;
+    l.ref = ref;
+    l.c = ims[ref].c;
+    l.blend = p.blend;
+    l.bands = p.bands;
+    l.G = calloc(n, sizeof(matrix));
+    l.lo = calloc(n, sizeof(point));
+    l.hi = calloc(n, sizeof(point));
+    chain_homographies(e, en, n, ref, l.G);
+    for(i = 0; i < en; ++i) free_matrix(e[i].H);
+    free(e);
+
+    // Canvas bounds over every placed image.
+    float minx = 0, miny = 0, maxx = ims[ref].w - 1, maxy = ims[ref].h - 1;
+    for(i = 0; i < n; ++i){
+        if(!l.G[i].rows){
+            fprintf(stderr, "panorama: image %d not linked, leaving it out\n", i);
+            continue;
+        }
+        placed_bounds(ims[i], l.G[i], l.lo + i, l.hi + i);
+        minx = MIN(minx, l.lo[i].x); miny = MIN(miny, l.lo[i].y);
+        maxx = MAX(maxx, l.hi[i].x); maxy = MAX(maxy, l.hi[i].y);
+    }
+    // Corners within a hundredth of a pixel of a whole pixel snap to it,
+    // so chaining error doesn't add a row or column of border.
+    l.ox = (int)floorf(minx + .01f);
+    l.oy = (int)floorf(miny + .01f);
+    l.w = (int)floorf(maxx + .01f) - l.ox + 1;
+    l.h = (int)floorf(maxy + .01f) - l.oy + 1;
+    return l;
+}
+
+void free_panorama_layout(panorama_layout l)
+{
+    int i;
+    for(i = 0; i < l.n; ++i) if(l.G[i].rows) free_matrix(l.G[i]);
+    free(l.G);
+    free(l.lo);
+    free(l.hi);
+}
+
+// Draw the rows of the panorama that fall in a view.
+// image_view dst: canvas rows y0 to y0 + dst.h, all l.w columns.
+// int y0: first canvas row in dst.
+static void render_rows(image *ims, panorama_layout l, image_view dst, int y0)
+{
+    int i;
+    if(l.blend != BLEND_NONE){
+        blend_images_view(ims, l.G, l.n, l.blend, l.bands, dst, l.ox, l.oy + y0);
+        return;
+    }
+    // Later images are drawn over earlier ones, like chained stitching.
+    for(i = 0; i < l.n; ++i){
+        if(!l.G[i].rows) continue;
+        int x0 = MAX(0, (int)floorf(l.lo[i].x) - l.ox);
+        int x1 = MIN(l.w, (int)ceilf(l.hi[i].x) - l.ox + 1);
+        int ys = MAX(y0, (int)floorf(l.lo[i].y) - l.oy);
+        int ye = MIN(y0 + dst.h, (int)ceilf(l.hi[i].y) - l.oy + 1);
+        if(i == l.ref){
+            // The reference sits at a whole pixel offset, copy it.
+            x0 = -l.ox;
+            x1 = x0 + ims[i].w;
+            ys = MAX(y0, -l.oy);
+            ye = MIN(y0 + dst.h, -l.oy + ims[i].h);
+            if(ye <= ys) continue;
+            copy_view(view_roi(view_image(ims[i]), 0, ys + l.oy, ims[i].w, ye - ys),
+                      view_roi(dst, x0, ys - y0, x1 - x0, ye - ys));
+            continue;
+        }
+        if(x1 <= x0 || ye <= ys) continue;
+        warp_homography_view(view_image(ims[i]), l.G[i],
+                view_roi(dst, x0, ys - y0, x1 - x0, ye - ys), x0 + l.ox, ys + l.oy);
+    }
+}
+
+// Draw a planned panorama into memory.
+// returns: the panorama, or a copy of the reference image if it is larger
+//          than max_size on a side.
+image panorama_render(image *ims, panorama_layout l, int max_size)
+{
+    if(l.w > max_size || l.h > max_size){
+        // Usually this means a bad homography got chained in.
+        fprintf(stderr, "output too big, stopping\n");
+        return copy_image(ims[l.ref]);
+    }
+    image c = make_image(l.w, l.h, l.c);
+    render_rows(ims, l, view_image(c), 0);
+    return c;
+}
+
+// Stitch a sequence of overlapping images into one panorama.
+// image *ims: images in capture order, neighbours should overlap.
+// int n: number of images.
+// panorama_params p: detector, matcher, RANSAC and layout settings.
+// returns: panorama in the frame of the reference image.
+image panorama_build(image *ims, int n, panorama_params p)
+{
+    panorama_layout l = panorama_plan(ims, n, p);
+    image c = panorama_render(ims, l, p.max_size);
+    free_panorama_layout(l);
+    return c;
+}
+
+// Write a planned panorama to a binary PPM (PGM for one channel) a strip of
+// rows at a time, so memory use depends on the strip and not the canvas.
+// char *name: file name without the extension.
+// int strip: rows rendered at once.
+// returns: 1 on success, 0 if the file could not be written.
+int save_panorama_ppm(image *ims, panorama_layout l, const char *name, int strip)
+{
+    char buff[256];
+    sprintf(buff, "%s.%s", name, l.c == 1 ? "pgm" : "ppm");
+    if(l.c != 1 && l.c != 3){
+        fprintf(stderr, "Can't write %d channel panorama %s\n", l.c, buff);
+        return 0;
+    }
+    FILE *fp = fopen(buff, "wb");
+    if(!fp){
+        fprintf(stderr, "Failed to write image %s\n", buff);
+        return 0;
+    }
+    fprintf(fp, "P%d\n%d %d\n255\n", l.c == 1 ? 5 : 6, l.w, l.h);
+
+    strip = MAX(1, MIN(strip, l.h));
+    image rows = make_image_uninit(l.w, strip, l.c);
+    unsigned char *bytes = calloc((size_t)l.w*strip*l.c, sizeof(char));
+    int ok = 1;
+    int y0;
+    for(y0 = 0; ok && y0 < l.h; y0 += strip){
+        int sh = MIN(strip, l.h - y0);
+        memset(rows.data, 0, (size_t)l.w*strip*l.c*sizeof(float));
+        image_view dst = view_roi(view_image(rows), 0, 0, l.w, sh);
+        render_rows(ims, l, dst, y0);
+        int i, k;
+        #pragma omp parallel for private(k)
+        for(i = 0; i < sh; ++i){
+            int x;
+            for(k = 0; k < l.c; ++k){
+                const float *src = view_row(dst, i, k);
+                unsigned char *out = bytes + (size_t)i*l.w*l.c + k;
+                for(x = 0; x < l.w; ++x){
+                    float v = MIN(MAX(src[x], 0), 1);
+                    out[x*l.c] = (unsigned char) roundf(255*v);
+                }
+            }
+        }
+        ok = fwrite(bytes, 1, (size_t)l.w*sh*l.c, fp) == (size_t)l.w*sh*l.c;
+    }
+    free(bytes);
+    free_image(rows);
+    if(fclose(fp) || !ok){
+        fprintf(stderr, "Failed to write image %s\n", buff);
+        return 0;
+    }
+    return 1;
+}
+
+// panorama_build with plain arguments, for the python bindings.
+image panorama_images(image *ims, int n, float sigma, float thresh, int nms, float inlier_thresh, int iters, int cutoff)
+{
+    panorama_params p = default_panorama_params();
+    p.sigma = sigma;
+    p.thresh = thresh;
+    p.nms = nms;
+    p.ransac.thresh = inlier_thresh;
+    p.ransac.max_iters = iters;
+    p.ransac.cutoff = cutoff;
+    return panorama_build(ims, n, p);
+}
@@ -35,20 +35,13 @@ point make_point(float x, float y)
 image both_images(image a, image b)
 {
     image both = make_image(a.w + b.w, a.h > b.h ? a.h : b.h, a.c > b.c ? a.c : b.c);
-    int i,j,k;
+    image_view canvas = view_image(both);
+    int k;
     for(k = 0; k < a.c; ++k){
-        for(j = 0; j < a.h; ++j){
-            for(i = 0; i < a.w; ++i){
-                set_pixel(both, i, j, k, get_pixel(a, i, j, k));
-            }
-        }
+        copy_view(view_channel(view_image(a), k), view_channel(view_roi(canvas, 0, 0, a.w, a.h), k));
     }
     for(k = 0; k < b.c; ++k){
-        for(j = 0; j < b.h; ++j){
-            for(i = 0; i < b.w; ++i){
-                set_pixel(both, i+a.w, j, k, get_pixel(b, i, j, k));
-            }
-        }
+        copy_view(view_channel(view_image(b), k), view_channel(view_roi(canvas, a.w, 0, b.w, b.h), k));
     }
     return both;
 }
@@ -106,8 +99,8 @@ image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms
     mark_corners(b, bd, bn);
     image lines = draw_matches(a, b, m, mn, 0);
 
-    free_descriptors(ad, an);
-    free_descriptors(bd, bn);
+    free_descriptor_block(ad);
+    free_descriptor_block(bd);
     free(m);
     return lines;
 }
@@ -118,11 +111,7 @@ image find_and_draw_matches(image a, image b, float sigma, float thresh, int nms
 // returns: l1 distance between arrays (sum of absolute differences).
 float l1_distance(float *a, float *b, int n)
 {
-	float sum = 0;
-	for (int i = 0; i < n; ++i) {
-		sum += fabs(a[i] - b[i]);
-	}
-    return sum;
+    return l1_distance_bounded(a, b, n, INFINITY);
 }
 
 // Finds best matches between descriptors of two images.
@@ -132,6 +121,12 @@ float l1_distance(float *a, float *b, int n)
 // returns: best matches found. each descriptor in a should match with at most
 //          one other descriptor in b.
 match *match_descriptors(descriptor *a, int an, descriptor *b, int bn, int *mn)
+{
+    return match_descriptors_params(a, an, b, bn, default_match_params(), mn);
+}
+
+// Straightforward version of match_descriptors, kept for tests and benchmarks.
+match *match_descriptors_reference(descriptor *a, int an, descriptor *b, int bn, int *mn)
 {
     // We will have at most an matches.
     *mn = an;
@@ -242,6 +237,8 @@ int model_inliers(matrix H, match *m, int n, float thresh)
 			m[i] = b;
 			m[listEnd] = a;
 			listEnd--;
+			// m[i] now holds an unchecked match.
+			i--;
 		}
 	}
 
@@ -327,14 +324,15 @@ matrix compute_homography(match *matches, int n)
     return H;
 }
 
-// Perform RANdom SAmple Consensus to calculate homography for noisy matches.
+// Original fixed-iteration RANSAC, kept for tests and benchmarks. RANSAC
+// itself lives in ransac.c.
 // match *m: set of matches.
 // int n: number of matches.
 // float thresh: inlier/outlier distance threshold.
 // int k: number of iterations to run.
 // int cutoff: inlier cutoff to exit early.
 // returns: matrix representing most common homography between matches.
-matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
+matrix RANSAC_reference(match *m, int n, float thresh, int k, int cutoff)
 {
 	assert(n >= 4);
 
@@ -368,11 +366,99 @@ matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
     return bestHomografy;
 }
 
+// Canvas that holds image a and image b warped into a's frame.
+// int *dx, *dy: a coordinates of canvas pixel (0, 0).
+// int *w, *h: canvas size.
+// point *topleft, *botright: footprint of b in a coordinates.
+// returns: 0 if the canvas is unreasonably large.
+static int combine_canvas(image a, image b, matrix H, int *dx, int *dy, int *w, int *h, point *topleft, point *botright)
+{
+    matrix Hinv = matrix_invert(H);
+
+    // Project the corners of image b into image a coordinates.
+    point c1 = project_point(Hinv, make_point(0,0));
+    point c2 = project_point(Hinv, make_point(b.w-1, 0));
+    point c3 = project_point(Hinv, make_point(0, b.h-1));
+    point c4 = project_point(Hinv, make_point(b.w-1, b.h-1));
+    free_matrix(Hinv);
+
+    // Find top left and bottom right corners of image b warped into image a.
+    botright->x = MAX(c1.x, MAX(c2.x, MAX(c3.x, c4.x)));
+    botright->y = MAX(c1.y, MAX(c2.y, MAX(c3.y, c4.y)));
+    topleft->x = MIN(c1.x, MIN(c2.x, MIN(c3.x, c4.x)));
+    topleft->y = MIN(c1.y, MIN(c2.y, MIN(c3.y, c4.y)));
+
+    // Find how big our new image should be and the offsets from image a.
+    *dx = MIN(0, topleft->x);
+    *dy = MIN(0, topleft->y);
+    *w = MAX(a.w, botright->x) - *dx;
+    *h = MAX(a.h, botright->y) - *dy;
+
+    // Can disable this if you are making very big panoramas.
+    // Usually this means there was an error in calculating H. This limit
+    // is separate from max_size, which only applies to panorama_build.
+    if(*w > 7000 || *h > 7000){
+        fprintf(stderr, "output too big, stopping\n");
+        return 0;
+    }
+    return 1;
+}
+
 // Stitches two images together using a projective transformation.
 // image a, b: images to stitch.
 // matrix H: homography from image a coordinates to image b coordinates.
 // returns: combined image stitched together.
 image combine_images(image a, image b, matrix H)
+{
+    int dx, dy, w, h;
+    point topleft, botright;
+    if(!combine_canvas(a, b, H, &dx, &dy, &w, &h, &topleft, &botright)) return copy_image(a);
+
+    image c = make_image(w, h, a.c);
+    image_view canvas = view_image(c);
+
+    // Paste image a into the new image offset by dx and dy.
+    int x0 = MAX(0, dx), y0 = MAX(0, dy);
+    int x1 = MIN(a.w, w + dx), y1 = MIN(a.h, h + dy);
+    if(x1 > x0 && y1 > y0){
+        copy_view(view_roi(view_image(a), x0, y0, x1 - x0, y1 - y0),
+                  view_roi(canvas, x0 - dx, y0 - dy, x1 - x0, y1 - y0));
+    }
+
+    // Warp image b into the part of the canvas its corners cover.
+    x0 = MAX(0, (int)floorf(topleft.x) - dx);
+    y0 = MAX(0, (int)floorf(topleft.y) - dy);
+    x1 = MIN(w, (int)ceilf(botright.x) - dx);
+    y1 = MIN(h, (int)ceilf(botright.y) - dy);
+    if(x1 > x0 && y1 > y0){
+        warp_homography_view(view_image(b), H, view_roi(canvas, x0, y0, x1 - x0, y1 - y0), x0 + dx, y0 + dy);
+    }
+    return c;
+}
+
+// Stitches two images together and blends them where they overlap.
+// image a, b: images to stitch.
+// matrix H: homography from image a coordinates to image b coordinates.
+// BLEND mode: how to mix the overlap, BLEND_NONE is combine_images.
+// int bands: pyramid levels for BLEND_MULTIBAND.
+// returns: combined image stitched together.
+image combine_images_blend(image a, image b, matrix H, BLEND mode, int bands)
+{
+    if(mode == BLEND_NONE) return combine_images(a, b, H);
+    int dx, dy, w, h;
+    point topleft, botright;
+    if(!combine_canvas(a, b, H, &dx, &dy, &w, &h, &topleft, &botright)) return copy_image(a);
+
+    image c = make_image(w, h, a.c);
+    image ims[2] = {a, b};
+    matrix G[2] = {make_identity_homography(), H};
+    blend_images_view(ims, G, 2, mode, bands, view_image(c), dx, dy);
+    free_matrix(G[0]);
+    return c;
+}
+
+// Original per-pixel version of combine_images, kept for tests and benchmarks.
+image combine_images_reference(image a, image b, matrix H)
 {
     matrix Hinv = matrix_invert(H);
 
@@ -470,8 +556,8 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
         save_image(inlier_matches, "inliers");
     }
 
-    free_descriptors(ad, an);
-    free_descriptors(bd, bn);
+    free_descriptor_block(ad);
+    free_descriptor_block(bd);
     free(m);
 
     // Stitch the images together with the homography
@@ -484,6 +570,15 @@ image panorama_image(image a, image b, float sigma, float thresh, int nms, float
 // float f: focal length used to take image (in pixels).
 // returns: image projected onto cylinder, then flattened.
 image cylindrical_project(image im, float f)
+{
+    remap_map m = make_cylindrical_map(im.w, im.h, f);
+    image result = remap_image(im, m);
+    free_remap_map(m);
+    return result;
+}
+
+// Original per-pixel version of cylindrical_project, kept for tests and benchmarks.
+image cylindrical_project_reference(image im, float f)
 {
 	image result = make_image(im.w, im.h, im.c);
 
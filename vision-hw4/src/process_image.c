@@ -29,7 +29,7 @@ void set_pixel(image im, int x, int y, int c, float v)
 
 image copy_image(image im)
 {
-    image copy = make_image(im.w, im.h, im.c);
+    image copy = make_image_uninit(im.w, im.h, im.c);
     memcpy(copy.data, im.data, im.w*im.h*im.c*sizeof(float));
     return copy;
 }
@@ -0,0 +1,227 @@
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include "image.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Gaussian and Laplacian pyramids. Going down a level blurs with the 5 tap
+// binomial kernel [1 4 6 4 1]/16 in both directions and keeps every other
+// pixel, in one pass that only filters the pixels it keeps. Coarse pixel
+// (x, y) sits over fine pixel (2x, 2y), and reads past the edge clamp.
+
+#define PYRAMID_BAND 16
+
+// Filter one row horizontally at the even pixels.
+// const float *src: source row of sw pixels.
+// float *dst: (sw+1)/2 outputs.
+static void reduce_row(const float *src, int sw, float *dst)
+{
+    int dw = (sw + 1)/2;
+    int x = 0;
+    // Inner pixels need no clamping.
+    if(sw >= 5){
+        dst[0] = (6*src[0] + 4*(src[0] + src[1]) + src[0] + src[2])*(1.f/16);
+        for(x = 1; 2*x + 2 < sw; ++x){
+            const float *s = src + 2*x;
+            dst[x] = (s[-2] + s[2] + 4*(s[-1] + s[1]) + 6*s[0])*(1.f/16);
+        }
+    }
+    for(; x < dw; ++x){
+        int c = 2*x;
+        float l2 = src[MAX(c-2, 0)], l1 = src[MAX(c-1, 0)];
+        float r1 = src[MIN(c+1, sw-1)], r2 = src[MIN(c+2, sw-1)];
+        dst[x] = (l2 + r2 + 4*(l1 + r1) + 6*src[c])*(1.f/16);
+    }
+}
+
+static int pyramid_threads()
+{
+    int threads = 1;
+#ifdef _OPENMP
+    threads = omp_get_max_threads();
+#endif
+    return threads;
+}
+
+// Blur and halve a view with caller provided rings.
+// float *rings: 5*dst.w floats for each of threads threads.
+static void pyramid_down_rings(image_view src, image_view dst, float *rings, int threads)
+{
+    assert(dst.w == (src.w + 1)/2 && dst.h == (src.h + 1)/2 && dst.c == src.c);
+    int bands = (dst.h + PYRAMID_BAND - 1)/PYRAMID_BAND;
+    int b;
+    #pragma omp parallel for schedule(dynamic) num_threads(threads)
+    for(b = 0; b < src.c*bands; ++b){
+        int k = b / bands;
+        int y0 = (b % bands)*PYRAMID_BAND, y1 = MIN(dst.h, y0 + PYRAMID_BAND);
+        // Horizontally filtered source rows, five at a time. Row r lives in
+        // slot r % 5, so neighbouring output rows share three of them.
+        float *ring = rings;
+#ifdef _OPENMP
+        ring += (size_t)omp_get_thread_num()*5*dst.w;
+#endif
+        int have = -3;
+        int y, x, r;
+        for(y = y0; y < y1; ++y){
+            int c = 2*y;
+            for(r = MAX(c - 2, have + 1); r <= c + 2; ++r){
+                int sr = MIN(MAX(r, 0), src.h - 1);
+                reduce_row(view_row(src, sr, k), src.w, ring + ((r + 5) % 5)*dst.w);
+            }
+            have = c + 2;
+            const float *a = ring + ((c + 3) % 5)*dst.w;
+            const float *bb = ring + ((c + 4) % 5)*dst.w;
+            const float *m = ring + (c % 5)*dst.w;
+            const float *d = ring + ((c + 1) % 5)*dst.w;
+            const float *e = ring + ((c + 2) % 5)*dst.w;
+            float *out = view_row(dst, y, k);
+            for(x = 0; x < dst.w; ++x){
+                out[x] = (a[x] + e[x] + 4*(bb[x] + d[x]) + 6*m[x])*(1.f/16);
+            }
+        }
+    }
+}
+
+// Blur and halve a view in one pass.
+// image_view src: fine level.
+// image_view dst: (src.w+1)/2 x (src.h+1)/2 view with src.c channels.
+void pyramid_down_view(image_view src, image_view dst)
+{
+    int threads = pyramid_threads();
+    image_arena_begin();
+    float *rings = image_arena_alloc((size_t)threads*5*dst.w*sizeof(float));
+    pyramid_down_rings(src, dst, rings, threads);
+    image_arena_end();
+}
+
+// Double a view, the inverse geometry of pyramid_down_view. Fine pixel
+// (x, y) is sampled bilinearly at coarse (x/2, y/2).
+// image_view src: coarse level.
+// image_view dst: fine level, src must be (dst.w+1)/2 x (dst.h+1)/2.
+// int add: add to dst instead of overwriting it.
+void pyramid_up_view(image_view src, image_view dst, int add)
+{
+    assert(src.w == (dst.w + 1)/2 && src.h == (dst.h + 1)/2 && dst.c == src.c);
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < dst.h; ++y){
+        int k, x;
+        int t = y/2, b = MIN((y + 1)/2, src.h - 1);
+        for(k = 0; k < dst.c; ++k){
+            const float *top = view_row(src, t, k);
+            const float *bottom = view_row(src, b, k);
+            float *out = view_row(dst, y, k);
+            for(x = 0; x < dst.w; ++x){
+                int l = x/2, r = MIN((x + 1)/2, src.w - 1);
+                float v = .25f*(top[l] + top[r] + bottom[l] + bottom[r]);
+                out[x] = add ? out[x] + v : v;
+            }
+        }
+    }
+}
+
+// Number of levels a pyramid of an image can have, halving until a side
+// reaches 1 pixel.
+static int pyramid_max_levels(int w, int h)
+{
+    int n = 1;
+    while(w > 1 || h > 1){
+        w = (w + 1)/2;
+        h = (h + 1)/2;
+        ++n;
+    }
+    return n;
+}
+
+// Allocate a pyramid for images of one size.
+// int levels: wanted number of levels, capped where both sides reach 1.
+// returns: pyramid with uninitialized levels, free with free_pyramid.
+pyramid make_empty_pyramid(int w, int h, int c, int levels)
+{
+    pyramid p;
+    p.levels = MAX(1, MIN(levels, pyramid_max_levels(w, h)));
+    p.level = calloc(p.levels, sizeof(image));
+    int i;
+    for(i = 0; i < p.levels; ++i){
+        p.level[i] = make_image(w, h, c);
+        w = (w + 1)/2;
+        h = (h + 1)/2;
+    }
+    return p;
+}
+
+// Rebuild a Gaussian pyramid from a new image, reusing its buffers. The
+// filter rings for every level come from one arena allocation sized for
+// level 1, so after the first frame this doesn't touch the heap.
+// pyramid p: pyramid made for images the size of im.
+// image im: new level 0.
+void update_pyramid(pyramid p, image im)
+{
+    image l0 = p.level[0];
+    assert(im.w == l0.w && im.h == l0.h && im.c == l0.c);
+    memcpy(l0.data, im.data, (size_t)im.w*im.h*im.c*sizeof(float));
+    if(p.levels < 2) return;
+    int threads = pyramid_threads();
+    image_arena_begin();
+    float *rings = image_arena_alloc((size_t)threads*5*p.level[1].w*sizeof(float));
+    int i;
+    for(i = 1; i < p.levels; ++i){
+        pyramid_down_rings(view_image(p.level[i-1]), view_image(p.level[i]), rings, threads);
+    }
+    image_arena_end();
+}
+
+// Build the Gaussian pyramid of an image.
+// image im: level 0.
+// int levels: number of levels, capped where both sides reach 1.
+// returns: pyramid, free with free_pyramid.
+pyramid make_pyramid(image im, int levels)
+{
+    pyramid p = make_empty_pyramid(im.w, im.h, im.c, levels);
+    update_pyramid(p, im);
+    return p;
+}
+
+void free_pyramid(pyramid p)
+{
+    int i;
+    for(i = 0; i < p.levels; ++i) free_image(p.level[i]);
+    free(p.level);
+}
+
+// Laplacian pyramid from a Gaussian one: each level minus the expanded next
+// level, and the coarsest level as is.
+// pyramid g: Gaussian pyramid.
+// returns: Laplacian pyramid, free with free_pyramid.
+pyramid make_laplacian_pyramid(pyramid g)
+{
+    image l0 = g.level[0];
+    pyramid lap = make_empty_pyramid(l0.w, l0.h, l0.c, g.levels);
+    int i, j;
+    for(i = 0; i < g.levels; ++i){
+        image d = lap.level[i];
+        if(i + 1 < g.levels) pyramid_up_view(view_image(g.level[i+1]), view_image(d), 0);
+        else memset(d.data, 0, (size_t)d.w*d.h*d.c*sizeof(float));
+        #pragma omp parallel for
+        for(j = 0; j < d.w*d.h*d.c; ++j) d.data[j] = g.level[i].data[j] - d.data[j];
+    }
+    return lap;
+}
+
+// Sum a Laplacian pyramid back into an image.
+// pyramid lap: Laplacian pyramid.
+// returns: the image it was made from.
+image collapse_pyramid(pyramid lap)
+{
+    image acc = copy_image(lap.level[lap.levels-1]);
+    int i;
+    for(i = lap.levels - 2; i >= 0; --i){
+        image up = copy_image(lap.level[i]);
+        pyramid_up_view(view_image(acc), view_image(up), 1);
+        free_image(acc);
+        acc = up;
+    }
+    return acc;
+}
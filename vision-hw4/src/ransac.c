@@ -0,0 +1,548 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <assert.h>
+#include <limits.h>
+#include "image.h"
+#include "matrix.h"
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+// Homography estimation with adaptive RANSAC. Hypotheses come from a
+// minimal 4-point solve on the stack, samples are drawn PROSAC style from
+// the best scoring matches first, a T(d,d) pre-test throws away most bad
+// hypotheses after d matches, and the number of iterations shrinks as the
+// inlier ratio of the best model grows. Hypotheses are made and scored by
+// several threads at once.
+
+#define RANSAC_SAMPLE 4
+#define RANSAC_BLOCK 100
+#define RANSAC_BATCH 128
+
+// Every hypothesis draws from its own xoshiro256** stream, keyed by the
+// seed and the hypothesis number, so results do not depend on which
+// thread makes which hypothesis.
+typedef struct{
+    unsigned long long s[4];
+} ransac_rng;
+
+static unsigned long long mix64(unsigned long long z)
+{
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static ransac_rng ransac_stream(unsigned long long seed, unsigned long long counter)
+{
+    ransac_rng r;
+    unsigned long long x = seed ^ mix64(counter + 0x9E3779B97F4A7C15ULL);
+    int i;
+    for(i = 0; i < 4; ++i){
+        x += 0x9E3779B97F4A7C15ULL;
+        r.s[i] = mix64(x);
+    }
+    return r;
+}
+
+static unsigned long long rotl(unsigned long long x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static unsigned ransac_rand(ransac_rng *r)
+{
+    unsigned long long *s = r->s;
+    unsigned long long result = rotl(s[1]*5, 7)*9;
+    unsigned long long t = s[1] << 17;
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+    return (unsigned)(result >> 32);
+}
+
+// Default RANSAC settings, see ransac_params in image.h.
+ransac_params default_ransac_params()
+{
+    ransac_params p;
+    p.thresh = 2;
+    p.max_iters = 10000;
+    p.cutoff = INT_MAX;
+    p.confidence = .999;
+    p.prosac = 1;
+    p.pretest = 1;
+    p.preemptive = 0;
+    p.threads = 0;
+    p.reproducible = 1;
+    p.seed = 0x853c49e6748fea9bULL;
+    return p;
+}
+
+// Solve an 8x8 system in place with partial pivoting.
+// double A[64], b[8]: system, b receives the solution.
+// returns: 0 if A is singular.
+static int solve8(double *A, double *b)
+{
+    int i, j, k;
+    for(i = 0; i < 8; ++i){
+        int p = i;
+        for(j = i + 1; j < 8; ++j) if(fabs(A[j*8+i]) > fabs(A[p*8+i])) p = j;
+        if(fabs(A[p*8+i]) < 1e-12) return 0;
+        if(p != i){
+            for(k = 0; k < 8; ++k){
+                double t = A[i*8+k]; A[i*8+k] = A[p*8+k]; A[p*8+k] = t;
+            }
+            double t = b[i]; b[i] = b[p]; b[p] = t;
+        }
+        for(j = i + 1; j < 8; ++j){
+            double f = A[j*8+i]/A[i*8+i];
+            if(f == 0) continue;
+            for(k = i; k < 8; ++k) A[j*8+k] -= f*A[i*8+k];
+            b[j] -= f*b[i];
+        }
+    }
+    for(i = 7; i >= 0; --i){
+        for(k = i + 1; k < 8; ++k) b[i] -= A[i*8+k]*b[k];
+        b[i] /= A[i*8+i];
+    }
+    return 1;
+}
+
+// Similarity that moves points to their centroid and scales their mean
+// distance from it to sqrt(2), for a well conditioned DLT.
+// double *s, *tx, *ty: normalized x = s*x + tx, y = s*y + ty.
+static void normalize_points(const match *m, const int *idx, int n, int second,
+        double *s, double *tx, double *ty)
+{
+    double mx = 0, my = 0, d = 0;
+    int i;
+    for(i = 0; i < n; ++i){
+        point p = second ? m[idx ? idx[i] : i].q : m[idx ? idx[i] : i].p;
+        mx += p.x;
+        my += p.y;
+    }
+    mx /= n;
+    my /= n;
+    for(i = 0; i < n; ++i){
+        point p = second ? m[idx ? idx[i] : i].q : m[idx ? idx[i] : i].p;
+        d += sqrt((p.x - mx)*(p.x - mx) + (p.y - my)*(p.y - my));
+    }
+    d /= n;
+    *s = d > 0 ? sqrt(2.0)/d : 1;
+    *tx = -*s*mx;
+    *ty = -*s*my;
+}
+
+// Fit a homography to matches in the least-squares sense of
+// compute_homography, accumulating the 8x8 normal equations directly.
+// match *m: matches.
+// int *idx: indexes of the matches to use, or 0 for the first n.
+// double *H: 9 values, row-major, H[8] = 1.
+// returns: 0 if the matches do not determine a homography.
+int fit_homography(const match *m, const int *idx, int n, double *H)
+{
+    double A[64] = {0}, b[8] = {0};
+    double sp, txp, typ, sq, txq, tyq;
+    int i, j, k;
+    if(n < RANSAC_SAMPLE) return 0;
+    normalize_points(m, idx, n, 0, &sp, &txp, &typ);
+    normalize_points(m, idx, n, 1, &sq, &txq, &tyq);
+    for(i = 0; i < n; ++i){
+        const match *c = m + (idx ? idx[i] : i);
+        double x = sp*c->p.x + txp, y = sp*c->p.y + typ;
+        double xp = sq*c->q.x + txq, yp = sq*c->q.y + tyq;
+        double r0[8] = {x, y, 1, 0, 0, 0, -x*xp, -y*xp};
+        double r1[8] = {0, 0, 0, x, y, 1, -x*yp, -y*yp};
+        if(n == RANSAC_SAMPLE){
+            // Square system, solve it as is.
+            memcpy(A + 16*i, r0, sizeof(r0));
+            memcpy(A + 16*i + 8, r1, sizeof(r1));
+            b[2*i] = xp;
+            b[2*i+1] = yp;
+            continue;
+        }
+        for(j = 0; j < 8; ++j){
+            for(k = j; k < 8; ++k) A[j*8+k] += r0[j]*r0[k] + r1[j]*r1[k];
+            b[j] += r0[j]*xp + r1[j]*yp;
+        }
+    }
+    if(n != RANSAC_SAMPLE){
+        for(j = 0; j < 8; ++j) for(k = 0; k < j; ++k) A[j*8+k] = A[k*8+j];
+    }
+    if(!solve8(A, b)) return 0;
+
+    // H = Tq^-1 * Hn * Tp
+    double Hn[9] = {b[0], b[1], b[2], b[3], b[4], b[5], b[6], b[7], 1};
+    double Tp[9] = {sp, 0, txp, 0, sp, typ, 0, 0, 1};
+    double Tqi[9] = {1/sq, 0, -txq/sq, 0, 1/sq, -tyq/sq, 0, 0, 1};
+    double t[9];
+    for(i = 0; i < 3; ++i) for(j = 0; j < 3; ++j){
+        t[i*3+j] = Hn[i*3]*Tp[j] + Hn[i*3+1]*Tp[3+j] + Hn[i*3+2]*Tp[6+j];
+    }
+    for(i = 0; i < 3; ++i) for(j = 0; j < 3; ++j){
+        H[i*3+j] = Tqi[i*3]*t[j] + Tqi[i*3+1]*t[3+j] + Tqi[i*3+2]*t[6+j];
+    }
+    if(fabs(H[8]) < 1e-12) return 0;
+    for(i = 0; i < 8; ++i) H[i] /= H[8];
+    H[8] = 1;
+    for(i = 0; i < 9; ++i) if(!isfinite(H[i])) return 0;
+    return 1;
+}
+
+static int is_inlier(const double *H, match c, double thresh2)
+{
+    double w = H[6]*c.p.x + H[7]*c.p.y + H[8];
+    if(w == 0) return 0;
+    double dx = (H[0]*c.p.x + H[1]*c.p.y + H[2])/w - c.q.x;
+    double dy = (H[3]*c.p.x + H[4]*c.p.y + H[5])/w - c.q.y;
+    return dx*dx + dy*dy < thresh2;
+}
+
+static double cross(point a, point b, point c)
+{
+    return (b.x - a.x)*(c.y - a.y) - (b.y - a.y)*(c.x - a.x);
+}
+
+// A homography keeps the orientation of every triangle, so a sample whose
+// triangles flip between the images cannot be all inliers. Collinear
+// triples are degenerate as well.
+static int sample_consistent(const match *m, const int *s)
+{
+    static const int tri[4][3] = {{0,1,2}, {0,1,3}, {0,2,3}, {1,2,3}};
+    int i;
+    for(i = 0; i < 4; ++i){
+        const match *a = m + s[tri[i][0]], *b = m + s[tri[i][1]], *c = m + s[tri[i][2]];
+        double cp = cross(a->p, b->p, c->p);
+        double cq = cross(a->q, b->q, c->q);
+        if(cp*cq <= 0) return 0;
+    }
+    return 1;
+}
+
+// Draw distinct indexes from [0, n) into s[first..RANSAC_SAMPLE).
+static void draw_sample(ransac_rng *r, int *s, int first, int n)
+{
+    int i, j;
+    for(i = first; i < RANSAC_SAMPLE; ++i){
+        int ok;
+        do{
+            s[i] = ransac_rand(r) % n;
+            ok = 1;
+            for(j = 0; j < i; ++j) if(s[j] == s[i]) ok = 0;
+        } while(!ok);
+    }
+}
+
+// PROSAC sampling schedule: samples come from the best n matches, and n
+// grows as iterations go by until every match is in play.
+typedef struct{
+    int n, N;
+    double Tn, Tnp;
+} prosac_state;
+
+static void prosac_init(prosac_state *ps, int N, int iters)
+{
+    int i;
+    ps->N = N;
+    ps->n = RANSAC_SAMPLE;
+    ps->Tn = iters;
+    for(i = 0; i < RANSAC_SAMPLE; ++i) ps->Tn *= (double)(RANSAC_SAMPLE - i)/(N - i);
+    ps->Tnp = 1;
+}
+
+// Advance the schedule to the t-th sample, 1-based.
+// int *pool: filled with how many of the best matches the sample uses.
+// returns: whether the newest match of the pool must be in the sample.
+static int prosac_step(prosac_state *ps, int t, int *pool)
+{
+    if(t > ps->Tnp && ps->n < ps->N){
+        double Tn1 = ps->Tn*(ps->n + 1)/(ps->n + 1 - RANSAC_SAMPLE);
+        ps->Tnp += ceil(Tn1 - ps->Tn);
+        ps->Tn = Tn1;
+        ++ps->n;
+    }
+    *pool = ps->n;
+    return ps->Tnp >= t;
+}
+
+// Draw a sample from the first pool matches, optionally forcing the last.
+static void pool_sample(ransac_rng *r, int pool, int newest, int *s)
+{
+    if(newest){
+        s[0] = pool - 1;
+        draw_sample(r, s, 1, pool - 1);
+    } else {
+        draw_sample(r, s, 0, pool);
+    }
+}
+
+// Iterations needed to draw an all-inlier sample that also passes the
+// pre-test with the given confidence.
+static int needed_iterations(double ratio, int pretest, double confidence, int max_iters)
+{
+    double good = pow(ratio, RANSAC_SAMPLE + pretest);
+    if(good >= 1) return 1;
+    if(good <= 0) return max_iters;
+    double k = log(1 - confidence)/log(1 - good);
+    return k < max_iters ? (int)ceil(k) : max_iters;
+}
+
+// Count inliers, giving up once the model cannot beat a bound.
+// int beat: count to beat, the result is only exact if above it.
+static int count_inliers(const double *H, const match *m, int n, double thresh2, int beat)
+{
+    int i, count = 0;
+    for(i = 0; i < n; ++i){
+        count += is_inlier(H, m[i], thresh2);
+        if(count + (n - i - 1) <= beat) return count;
+    }
+    return count;
+}
+
+// Refit a model to its inliers until the inlier set stops growing.
+// int *idx: n entries of scratch.
+// returns: inliers of the final H.
+static int refine_model(double *H, const match *m, int n, double thresh2, int count, int *idx)
+{
+    int round, i;
+    for(round = 0; round < 4; ++round){
+        double G[9];
+        int k = 0;
+        for(i = 0; i < n; ++i) if(is_inlier(H, m[i], thresh2)) idx[k++] = i;
+        if(!fit_homography(m, idx, k, G)) break;
+        // A least-squares fit with as many inliers beats a minimal one.
+        int c = count_inliers(G, m, n, thresh2, count - 1);
+        if(c < count) break;
+        memcpy(H, G, sizeof(G));
+        if(c == count) break;
+        count = c;
+    }
+    return count;
+}
+
+typedef struct{
+    double H[9];
+    int score;
+} hypothesis;
+
+static int compare_hypotheses(const void *a, const void *b)
+{
+    return ((hypothesis *)b)->score - ((hypothesis *)a)->score;
+}
+
+// Make the t-th hypothesis from its own random stream.
+// int pool, newest: sampling schedule from prosac_step.
+// returns: 0 if the sample was degenerate or failed the pre-test.
+static int make_hypothesis(const match *m, int n, ransac_params p, int t, int pool, int newest, double *H)
+{
+    ransac_rng r = ransac_stream(p.seed, t);
+    double thresh2 = (double)p.thresh*p.thresh;
+    int s[RANSAC_SAMPLE], i;
+    pool_sample(&r, pool, newest, s);
+    if(!sample_consistent(m, s)) return 0;
+    if(!fit_homography(m, s, RANSAC_SAMPLE, H)) return 0;
+
+    // T(d,d): every one of d random matches must agree.
+    for(i = 0; i < p.pretest; ++i){
+        if(!is_inlier(H, m[ransac_rand(&r) % n], thresh2)) return 0;
+    }
+    return 1;
+}
+
+static int ransac_threads(ransac_params p)
+{
+    int threads = 1;
+#ifdef _OPENMP
+    threads = p.threads > 0 ? p.threads : omp_get_max_threads();
+#endif
+    return threads;
+}
+
+// Preemptive scoring: a fixed batch of hypotheses is scored block by block
+// on the same matches and the worse half is dropped after every block, so
+// the total work is bounded regardless of the inlier ratio.
+// returns: inliers of the best hypothesis, 0 if none could be made.
+static int preemptive_search(const match *m, int n, ransac_params p, double *best)
+{
+    int M = p.preemptive, live = 0, tries = 0;
+    double thresh2 = (double)p.thresh*p.thresh;
+    hypothesis *h = calloc(M, sizeof(hypothesis));
+    prosac_state ps;
+    prosac_init(&ps, n, M);
+    int i, j;
+    p.pretest = 0;
+    while(live < M && tries < 10*M){
+        int pool = n, newest = 0;
+        ++tries;
+        if(p.prosac) newest = prosac_step(&ps, tries, &pool);
+        if(!make_hypothesis(m, n, p, tries, pool, newest, h[live].H)) continue;
+        h[live++].score = 0;
+    }
+
+    ransac_rng r = ransac_stream(p.seed, 0);
+    int *obs = calloc(n, sizeof(int));
+    for(i = 0; i < n; ++i) obs[i] = i;
+    for(i = n - 1; i > 0; --i){
+        j = ransac_rand(&r) % (i + 1);
+        int t = obs[i]; obs[i] = obs[j]; obs[j] = t;
+    }
+    int threads = ransac_threads(p);
+    for(i = 0; i < n && live > 1; i += RANSAC_BLOCK){
+        int end = MIN(n, i + RANSAC_BLOCK);
+        #pragma omp parallel for num_threads(threads) schedule(static)
+        for(j = 0; j < live; ++j){
+            int k;
+            for(k = i; k < end; ++k) h[j].score += is_inlier(h[j].H, m[obs[k]], thresh2);
+        }
+        qsort(h, live, sizeof(hypothesis), compare_hypotheses);
+        if(end - i == RANSAC_BLOCK) live = MAX(1, live/2);
+    }
+    int count = 0;
+    if(live){
+        memcpy(best, h[0].H, sizeof(h[0].H));
+        count = count_inliers(best, m, n, thresh2, -1);
+    }
+    free(obs);
+    free(h);
+    return count;
+}
+
+// Estimate the homography between matched points with adaptive RANSAC.
+// match *m: matches, the inliers of the result are moved to the front.
+// int n: number of matches.
+// ransac_params p: thresholds, limits and sampling options.
+// int *inliers: filled with the number of inliers if not 0.
+// returns: 3x3 homography from a's coordinates to b's.
+matrix ransac_homography(match *m, int n, ransac_params p, int *inliers)
+{
+    double thresh2 = (double)p.thresh*p.thresh;
+    int i, t;
+
+    // Same starting model as the original implementation.
+    double best[9] = {1, 0, 256, 0, 1, 0, 0, 0, 1};
+    int best_count = count_inliers(best, m, n, thresh2, -1);
+
+    if(n >= RANSAC_SAMPLE){
+        int *idx = calloc(n, sizeof(int));
+        // PROSAC wants the most distinctive matches first. The matches get
+        // reordered at the end anyway, so sort them in place.
+        if(p.prosac) qsort(m, n, sizeof(match), match_compare);
+
+        if(p.preemptive > 0){
+            double H[9];
+            int count = preemptive_search(m, n, p, H);
+            if(count > best_count){
+                memcpy(best, H, sizeof(H));
+                best_count = refine_model(best, m, n, thresh2, count, idx);
+            }
+        } else {
+            // Hypotheses are made and scored in parallel batches, then
+            // reduced in order. Reproducible runs score every hypothesis
+            // of a batch against the best count from before the batch;
+            // otherwise threads share the best count as they go, which
+            // stops scoring sooner but depends on timing.
+            int threads = ransac_threads(p);
+            hypothesis *batch = calloc(RANSAC_BATCH, sizeof(hypothesis));
+            int *pool = calloc(2*RANSAC_BATCH, sizeof(int));
+            prosac_state ps;
+            prosac_init(&ps, n, p.max_iters);
+            int limit = p.max_iters, done = 0;
+            for(t = 1; t <= limit && !done; t += RANSAC_BATCH){
+                int size = MIN(RANSAC_BATCH, limit - t + 1);
+                for(i = 0; i < size; ++i){
+                    pool[2*i] = n;
+                    pool[2*i+1] = p.prosac ? prosac_step(&ps, t + i, pool + 2*i) : 0;
+                }
+                int bound = best_count;
+                #pragma omp parallel for num_threads(threads) schedule(dynamic, 8)
+                for(i = 0; i < size; ++i){
+                    batch[i].score = -1;
+                    if(!make_hypothesis(m, n, p, t + i, pool[2*i], pool[2*i+1], batch[i].H)) continue;
+                    int beat = bound;
+                    if(!p.reproducible) beat = __atomic_load_n(&bound, __ATOMIC_RELAXED);
+                    int count = count_inliers(batch[i].H, m, n, thresh2, beat);
+                    if(count <= beat) continue;
+                    batch[i].score = count;
+                    if(!p.reproducible){
+                        int seen = __atomic_load_n(&bound, __ATOMIC_RELAXED);
+                        while(count > seen && !__atomic_compare_exchange_n(&bound, &seen, count,
+                                    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+                    }
+                }
+                for(i = 0; i < size && t + i <= limit; ++i){
+                    if(batch[i].score <= best_count) continue;
+                    best_count = refine_model(batch[i].H, m, n, thresh2, batch[i].score, idx);
+                    memcpy(best, batch[i].H, sizeof(best));
+                    if(best_count > p.cutoff){
+                        done = 1;
+                        break;
+                    }
+                    limit = MIN(limit, needed_iterations((double)best_count/n, p.pretest, p.confidence, p.max_iters));
+                }
+            }
+            free(batch);
+            free(pool);
+        }
+        free(idx);
+    }
+
+    matrix H = make_matrix(3, 3);
+    for(i = 0; i < 9; ++i) H.data[i/3][i%3] = best[i];
+    int count = model_inliers(H, m, n, p.thresh);
+    if(inliers) *inliers = count;
+    return H;
+}
+
+// Perform RANdom SAmple Consensus to calculate homography for noisy matches.
+// match *m: set of matches.
+// int n: number of matches.
+// float thresh: inlier/outlier distance threshold.
+// int k: maximum number of iterations to run.
+// int cutoff: inlier cutoff to exit early.
+// returns: matrix representing most common homography between matches.
+matrix RANSAC(match *m, int n, float thresh, int k, int cutoff)
+{
+    ransac_params p = default_ransac_params();
+    p.thresh = thresh;
+    p.max_iters = k;
+    p.cutoff = cutoff;
+    return ransac_homography(m, n, p, 0);
+}
+
+// Make matches between random points and their images under a homography,
+// with some of them replaced by outliers, for tests and benchmarks.
+// double *H: 9 values, row-major.
+// int n: number of matches.
+// float ratio: fraction of inliers.
+// float noise: pixels of uniform noise on inliers.
+// returns: matches, inliers tend to have lower distances.
+match *make_synthetic_matches(const double *H, int n, float ratio, float noise)
+{
+    match *m = calloc(n, sizeof(match));
+    int i;
+    for(i = 0; i < n; ++i){
+        float x = 640.0f*rand()/RAND_MAX, y = 480.0f*rand()/RAND_MAX;
+        m[i].p.x = x;
+        m[i].p.y = y;
+        m[i].ai = m[i].bi = i;
+        if(i < ratio*n){
+            double w = H[6]*x + H[7]*y + H[8];
+            m[i].q.x = (H[0]*x + H[1]*y + H[2])/w + noise*((float)rand()/RAND_MAX - .5f);
+            m[i].q.y = (H[3]*x + H[4]*y + H[5])/w + noise*((float)rand()/RAND_MAX - .5f);
+            m[i].distance = (float)rand()/RAND_MAX;
+        } else {
+            m[i].q.x = 640.0f*rand()/RAND_MAX;
+            m[i].q.y = 480.0f*rand()/RAND_MAX;
+            m[i].distance = .5f + (float)rand()/RAND_MAX;
+        }
+    }
+    for(i = n - 1; i > 0; --i){
+        int j = rand() % (i + 1);
+        match t = m[i]; m[i] = m[j]; m[j] = t;
+    }
+    return m;
+}
@@ -0,0 +1,181 @@
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#if defined(__x86_64__) || defined(__i386__)
+#define REMAP_X86
+#include <immintrin.h>
+#endif
+#include "image.h"
+
+// Lookup table warps. A map stores, for every output pixel, the offset of
+// the top left of its 2x2 source neighbourhood and the bilinear fractions
+// in fixed point, so applying it costs four loads and a few multiplies per
+// channel whatever the geometry was. Maps are made once and applied to any
+// number of images of the size they were made for.
+
+#define REMAP_BITS 15
+#define REMAP_ONE (1 << REMAP_BITS)
+
+remap_map make_remap_map(int w, int h, int sw, int sh)
+{
+    assert(sw >= 2 && sh >= 2);
+    remap_map m;
+    m.w = w;
+    m.h = h;
+    m.sw = sw;
+    m.sh = sh;
+    m.index = calloc((size_t)w*h, sizeof(int));
+    m.fx = calloc((size_t)w*h, sizeof(unsigned short));
+    m.fy = calloc((size_t)w*h, sizeof(unsigned short));
+    int i;
+    for(i = 0; i < w*h; ++i) m.index[i] = -1;
+    return m;
+}
+
+void free_remap_map(remap_map m)
+{
+    free(m.index);
+    free(m.fx);
+    free(m.fy);
+}
+
+// Point an output pixel of a map at a source location.
+// int x, y: output pixel.
+// float sx, sy: source coordinates, outside [0, sw) x [0, sh) leaves the
+//               output pixel at 0.
+void remap_map_set(remap_map m, int x, int y, float sx, float sy)
+{
+    int i = x + y*m.w;
+    if(!(sx >= 0 && sx < m.sw && sy >= 0 && sy < m.sh)){
+        m.index[i] = -1;
+        return;
+    }
+    int left = (int)sx, top = (int)sy;
+    int fx = (int)lrintf((sx - left)*REMAP_ONE);
+    int fy = (int)lrintf((sy - top)*REMAP_ONE);
+    // Keep the 2x2 neighbourhood inside the source. On the last row or
+    // column the clamped neighbour equals the pixel itself, so step back
+    // one and put all the weight on the far side instead.
+    if(left == m.sw - 1){
+        --left;
+        fx = REMAP_ONE;
+    }
+    if(top == m.sh - 1){
+        --top;
+        fy = REMAP_ONE;
+    }
+    m.index[i] = left + top*m.sw;
+    m.fx[i] = fx;
+    m.fy[i] = fy;
+}
+
+// Build the map of cylindrical_project for images of one size.
+// int w, h: image size.
+// float f: focal length used to take the images (in pixels).
+// returns: map from the cylinder to the image, free with free_remap_map.
+remap_map make_cylindrical_map(int w, int h, float f)
+{
+    remap_map m = make_remap_map(w, h, w, h);
+    float xc = w/2.f;
+    float yc = h/2.f;
+    int i;
+    #pragma omp parallel for
+    for(i = 0; i < w; ++i){
+        float theta = (i - xc) / f;
+        float xprime = sinf(theta);
+        float zprime = cosf(theta);
+        float resultx = f * (xprime/zprime) + xc;
+        int j;
+        for(j = 0; j < h; ++j){
+            float yprime = (j - yc)/f;
+            float resulty = f * (yprime/zprime) + yc;
+            remap_map_set(m, i, j, resultx, resulty);
+        }
+    }
+    return m;
+}
+
+static void remap_row_scalar(const float *src, int sw, const int *index,
+        const unsigned short *fx, const unsigned short *fy, float *out, int n)
+{
+    int x;
+    for(x = 0; x < n; ++x){
+        int i = index[x];
+        if(i < 0){
+            out[x] = 0;
+            continue;
+        }
+        float tx = fx[x]*(1.f/REMAP_ONE);
+        float ty = fy[x]*(1.f/REMAP_ONE);
+        float top = src[i] + (src[i+1] - src[i])*tx;
+        float bottom = src[i+sw] + (src[i+sw+1] - src[i+sw])*tx;
+        out[x] = top + (bottom - top)*ty;
+    }
+}
+
+#ifdef REMAP_X86
+__attribute__((target("avx2,fma")))
+static void remap_row_avx2(const float *src, int sw, const int *index,
+        const unsigned short *fx, const unsigned short *fy, float *out, int n)
+{
+    const __m256 scale = _mm256_set1_ps(1.f/REMAP_ONE);
+    const __m256i below = _mm256_set1_epi32(sw);
+    const __m256i one = _mm256_set1_epi32(1);
+    const __m256 zero = _mm256_setzero_ps();
+    int x = 0;
+    for(; x + 8 <= n; x += 8){
+        __m256i i = _mm256_loadu_si256((const __m256i *)(index + x));
+        // Pixels outside the source have index -1 and gather nothing.
+        __m256 valid = _mm256_castsi256_ps(_mm256_cmpgt_epi32(i, _mm256_set1_epi32(-1)));
+        __m256i ib = _mm256_add_epi32(i, below);
+        __m256 tl = _mm256_mask_i32gather_ps(zero, src, i, valid, 4);
+        __m256 tr = _mm256_mask_i32gather_ps(zero, src, _mm256_add_epi32(i, one), valid, 4);
+        __m256 bl = _mm256_mask_i32gather_ps(zero, src, ib, valid, 4);
+        __m256 br = _mm256_mask_i32gather_ps(zero, src, _mm256_add_epi32(ib, one), valid, 4);
+        __m256 tx = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(
+                        _mm_loadu_si128((const __m128i *)(fx + x)))), scale);
+        __m256 ty = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(
+                        _mm_loadu_si128((const __m128i *)(fy + x)))), scale);
+        __m256 top = _mm256_fmadd_ps(_mm256_sub_ps(tr, tl), tx, tl);
+        __m256 bottom = _mm256_fmadd_ps(_mm256_sub_ps(br, bl), tx, bl);
+        _mm256_storeu_ps(out + x, _mm256_fmadd_ps(_mm256_sub_ps(bottom, top), ty, top));
+    }
+    remap_row_scalar(src, sw, index + x, fx + x, fy + x, out + x, n - x);
+}
+#endif
+
+// Warp an image through a map.
+// image im: source, must be the size the map was made for.
+// remap_map m: map to apply.
+// returns: m.w x m.h image, 0 where the map points outside the source.
+image remap_image(image im, remap_map m)
+{
+    assert(im.w == m.sw && im.h == m.sh);
+    image out = make_image_uninit(m.w, m.h, im.c);
+    int simd = 0;
+#ifdef REMAP_X86
+    __builtin_cpu_init();
+    simd = __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+    int y;
+    #pragma omp parallel for
+    for(y = 0; y < m.h; ++y){
+        const int *index = m.index + y*m.w;
+        const unsigned short *fx = m.fx + y*m.w;
+        const unsigned short *fy = m.fy + y*m.w;
+        int k;
+        for(k = 0; k < im.c; ++k){
+            const float *src = im.data + k*im.w*im.h;
+            float *row = out.data + k*m.w*m.h + y*m.w;
+#ifdef REMAP_X86
+            if(simd){
+                remap_row_avx2(src, im.w, index, fx, fy, row, m.w);
+                continue;
+            }
+#endif
+            remap_row_scalar(src, im.w, index, fx, fy, row, m.w);
+        }
+    }
+    (void)simd;
+    return out;
+}
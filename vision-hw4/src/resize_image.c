@@ -59,22 +59,7 @@ float bilinear_interpolate(image im, float x, float y, int c)
 
 image bilinear_resize(image im, int w, int h)
 {
-	image resized = make_image(w, h, im.c);
-
-
-	float rx = (float)(im.w)/(float)(w);
-	float ry = (float)(im.h)/(float)(h);
-
-
-	for (int i = 0; i < resized.w; ++i) {
-		for (int j = 0; j < resized.h; ++j) {
-			for (int k = 0; k < resized.c; ++k) {
-				float result = bilinear_interpolate(im, (i+0.5f)*rx - 0.5f, (j+0.5f)*ry - 0.5f, k);
-				set_pixel(resized, i, j, k, result);
-			}
-		}
-	}
-
+	image resized = make_image_uninit(w, h, im.c);
+	bilinear_resize_view(view_image(im), view_image(resized));
 	return resized;
 }
-
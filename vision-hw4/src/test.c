@@ -248,6 +248,841 @@ void test_convolution(){
     free_image(gt);
 }
 
+void test_convolve_engine(){
+    image im = make_random_image(97, 61, 3);
+    image filters[5];
+    filters[0] = make_gaussian_filter(3);
+    filters[1] = make_box_filter(4);
+    filters[2] = make_highpass_filter();
+    filters[3] = make_emboss_filter();
+    filters[4] = make_random_image(5, 3, 3);
+    int i, preserve;
+    for(i = 0; i < 5; ++i){
+        for(preserve = 0; preserve < 2; ++preserve){
+            image fast = convolve_image(im, filters[i], preserve);
+            image ref = convolve_image_reference(im, filters[i], preserve);
+            TEST(same_image(fast, ref));
+            free_image(fast);
+            free_image(ref);
+        }
+        free_image(filters[i]);
+    }
+    free_image(im);
+}
+
+void test_image_views(){
+    image im = make_random_image(64, 48, 3);
+    image_view roi = view_roi(view_image(im), 5, 7, 40, 30);
+    image crop = view_to_image(roi);
+    TEST(within_eps(crop.data[0], get_pixel(im, 5, 7, 0)));
+    TEST(within_eps(crop.data[2*40*30 + 39 + 29*40], get_pixel(im, 44, 36, 2)));
+
+    image f = make_gaussian_filter(1);
+    image out = make_image(40, 30, 3);
+    convolve_view(roi, f, 1, view_image(out));
+    image gt = convolve_image(crop, f, 1);
+    TEST(same_image(out, gt));
+    free_image(out);
+    free_image(gt);
+    free_image(f);
+
+    image small = make_image(17, 11, 3);
+    bilinear_resize_view(roi, view_image(small));
+    int i, j, k, ok = 1;
+    for(k = 0; k < 3; ++k) for(j = 0; j < 11; ++j) for(i = 0; i < 17; ++i){
+        float x = (i + 0.5f)*40/17.f - 0.5f;
+        float y = (j + 0.5f)*30/11.f - 0.5f;
+        if(!within_eps(get_pixel(small, i, j, k), bilinear_interpolate(crop, x, y, k))) ok = 0;
+    }
+    TEST(ok);
+    free_image(small);
+
+    image green = get_channel(im, 1);
+    TEST(same_image(green, view_as_image(view_channel(view_image(im), 1))));
+    free_image(green);
+
+    image S = make_image(40, 30, 3);
+    structure_matrix_view(roi, 2, view_image(S));
+    image Sgt = structure_matrix(crop, 2);
+    TEST(same_image(S, Sgt));
+    free_image(S);
+    free_image(Sgt);
+
+    free_image(crop);
+    free_image(im);
+}
+
+void test_image_arena(){
+    image im = make_random_image(120, 90, 1);
+    image S = make_image(im.w, im.h, 3);
+    image gt = structure_matrix(im, 2);
+    int frame;
+    for(frame = 0; frame < 3; ++frame){
+        long before = image_heap_allocations();
+        image_arena_begin();
+        image scratch = make_image_uninit(im.w, im.h, 3);
+        TEST(image_arena_owns(scratch.data));
+        structure_matrix_view(view_image(im), 2, view_image(S));
+        image_arena_end();
+        if(frame > 0) TEST(image_heap_allocations() == before);
+    }
+    TEST(same_image(S, gt));
+
+    // Freeing arena memory, here from a worker thread whose own arena is
+    // empty, never reaches the heap.
+    image_arena_begin();
+    image scratch = make_image(im.w, im.h, 1);
+    long before = image_heap_allocations();
+    int t;
+    #pragma omp parallel for num_threads(2)
+    for(t = 0; t < 2; ++t) if(t == 1) free_image(scratch);
+    image_arena_end();
+    TEST(image_heap_allocations() == before);
+    image_arena_release();
+    free_image(gt);
+    free_image(S);
+    free_image(im);
+}
+
+void test_harris_response(){
+    image im = make_random_image(150, 131, 3);
+    image S = structure_matrix(im, 2);
+    image gt = cornerness_response(S);
+    image R = harris_response(im, 2);
+    int i;
+    float big = 0, diff = 0;
+    for(i = 0; i < R.w*R.h; ++i){
+        big = MAX(big, fabsf(gt.data[i]));
+        diff = MAX(diff, fabsf(gt.data[i] - R.data[i]));
+    }
+    TEST(diff <= 1e-4*big);
+    free_image(im);
+    free_image(S);
+    free_image(gt);
+    free_image(R);
+}
+
+void test_nms(){
+    image im = make_random_image(83, 71, 1);
+    int i, w;
+    // Quantize so windows contain ties, which must not suppress.
+    for(i = 0; i < im.w*im.h; ++i) im.data[i] = roundf(im.data[i]*8);
+    for(w = 1; w <= 6; w += 2){
+        image fast = nms_image(im, w);
+        image ref = nms_image_reference(im, w);
+        TEST(0 == memcmp(fast.data, ref.data, im.w*im.h*sizeof(float)));
+
+        // Keypoints come in the detector's column-major scan order.
+        int n = 0, count = 0, ok = 1, x, y;
+        int *keys = nms_keypoints(im, w, 4, &n);
+        for(x = 0; x < im.w; ++x){
+            for(y = 0; y < im.h; ++y){
+                i = x + y*im.w;
+                if(ref.data[i] > 4){
+                    if(count >= n || keys[count] != i) ok = 0;
+                    ++count;
+                }
+            }
+        }
+        TEST(ok && count == n);
+        free(keys);
+        free_image(fast);
+        free_image(ref);
+    }
+    free_image(im);
+}
+
+void test_distance_kernels(){
+    int bytes = 77, n, k, isa;
+    float *a = calloc(130, sizeof(float));
+    float *b = calloc(130, sizeof(float));
+    unsigned char *x = calloc(bytes, 1);
+    unsigned char *y = calloc(bytes, 1);
+    for(k = 0; k < 130; ++k){
+        a[k] = (float)rand()/RAND_MAX - .5;
+        b[k] = (float)rand()/RAND_MAX - .5;
+    }
+    for(k = 0; k < bytes; ++k){
+        x[k] = rand();
+        y[k] = rand();
+    }
+    DISTANCE_ISA active = get_distance_isa();
+    for(isa = 0; isa < DISTANCE_ISAS; ++isa){
+        if(!set_distance_isa(isa)) continue;
+        int ok = 1;
+        for(n = 0; n <= 130; ++n){
+            double l1 = 0, l2 = 0;
+            for(k = 0; k < n; ++k){
+                l1 += fabs(a[k] - b[k]);
+                l2 += (a[k] - b[k])*(a[k] - b[k]);
+            }
+            if(fabs(l1_distance_bounded(a, b, n, INFINITY) - l1) > 1e-5*(1 + l1)) ok = 0;
+            if(fabs(l2sq_distance(a, b, n) - l2) > 1e-5*(1 + l2)) ok = 0;
+            if(n > 64 && !(l1_distance_bounded(a, b, n, l1/4) > l1/4)) ok = 0;
+        }
+        TEST(ok);
+        for(n = 0; n <= bytes; ++n){
+            int bits = 0;
+            for(k = 0; k < n; ++k) bits += __builtin_popcount(x[k] ^ y[k]);
+            if(hamming_distance(x, y, n) != bits) ok = 0;
+        }
+        TEST(ok);
+    }
+    set_distance_isa(active);
+    free(a);
+    free(b);
+    free(x);
+    free(y);
+}
+
+void test_descriptor_set(){
+    image im = make_random_image(120, 90, 3);
+    int n = 0, i, ok = 1;
+    descriptor *d = harris_corner_detector(im, 2, .0005, 3, &n);
+    descriptor_set s = harris_corner_descriptors(im, 2, .0005, 3);
+    TEST(n > 0 && s.n == n && s.d == d[0].n);
+    for(i = 0; i < n; ++i){
+        descriptor e = describe_index(im, d[i].p.x + d[i].p.y*im.w);
+        if(memcmp(e.data, d[i].data, e.n*sizeof(float))) ok = 0;
+        if(memcmp(e.data, descriptor_row(s, i), e.n*sizeof(float))) ok = 0;
+        if(((size_t)descriptor_row(s, i)) % 64) ok = 0;
+        if(s.p[i].x != d[i].p.x || s.p[i].y != d[i].p.y) ok = 0;
+        free(e.data);
+    }
+    TEST(ok);
+
+    int an = 0, sn = 0;
+    match *ma = match_descriptors(d, n, d, n, &an);
+    match *ms = match_descriptor_sets(s, s, default_match_params(), &sn);
+    TEST(an == sn && 0 == memcmp(ma, ms, an*sizeof(match)));
+    free(ma);
+    free(ms);
+
+    descriptor_set copy = descriptor_set_from_array(d, n);
+    TEST(0 == memcmp(copy.data, s.data, n*s.stride*sizeof(float)));
+    free_descriptor_set(copy);
+    free_descriptor_set(s);
+    free_descriptor_block(d);
+    free_image(im);
+}
+
+void test_ransac(){
+    double truth[9] = {.9, -.1, 300, .08, 1.05, -20, 1e-4, -5e-5, 1};
+    int n = 400, i, inliers = 0;
+    match *m = make_synthetic_matches(truth, n, .3, 1);
+
+    double H4[9];
+    matrix G = compute_homography(m, 4);
+    TEST(fit_homography(m, 0, 4, H4));
+    int same = 1;
+    for(i = 0; i < 9; ++i) if(fabs(H4[i] - G.data[i/3][i%3]) > 1e-6*(1 + fabs(H4[i]))) same = 0;
+    TEST(same);
+    free_matrix(G);
+
+    ransac_params p = default_ransac_params();
+    p.thresh = 3;
+    int k;
+    for(k = 0; k < 2; ++k){
+        p.preemptive = k ? 200 : 0;
+        matrix H = ransac_homography(m, n, p, &inliers);
+        TEST(inliers >= .95*.3*n && inliers <= .35*n);
+        TEST(model_inliers(H, m, inliers, p.thresh) == inliers);
+        float err = 0;
+        for(i = 0; i < 4; ++i){
+            point c = {(i & 1)*640, (i/2)*480};
+            double w = truth[6]*c.x + truth[7]*c.y + truth[8];
+            point t = {(truth[0]*c.x + truth[1]*c.y + truth[2])/w, (truth[3]*c.x + truth[4]*c.y + truth[5])/w};
+            point e = project_point(H, c);
+            err = MAX(err, sqrtf((e.x - t.x)*(e.x - t.x) + (e.y - t.y)*(e.y - t.y)));
+        }
+        TEST(err < 1);
+        free_matrix(H);
+    }
+
+    // Reproducible runs must not depend on the number of threads.
+    p.preemptive = 0;
+    p.prosac = 0;
+    match *copy = calloc(n, sizeof(match));
+    memcpy(copy, m, n*sizeof(match));
+    p.threads = 1;
+    matrix H1 = ransac_homography(m, n, p, 0);
+    p.threads = 4;
+    matrix Hn = ransac_homography(copy, n, p, 0);
+    same = 1;
+    for(i = 0; i < 9; ++i) if(H1.data[i/3][i%3] != Hn.data[i/3][i%3]) same = 0;
+    TEST(same);
+    free_matrix(H1);
+    free_matrix(Hn);
+    free(copy);
+    free(m);
+}
+
+void test_combine_images(){
+    image a = make_random_image(160, 120, 3);
+    image b = make_random_image(150, 110, 3);
+    matrix H = make_identity_homography();
+    H.data[0][0] = .95; H.data[0][1] = .05; H.data[0][2] = 90;
+    H.data[1][0] = -.04; H.data[1][1] = 1.02; H.data[1][2] = -30;
+    H.data[2][0] = 2e-4; H.data[2][1] = 1e-4;
+    image ref = combine_images_reference(a, b, H);
+    image fast = combine_images(a, b, H);
+    TEST(ref.w == fast.w && ref.h == fast.h && ref.c == fast.c);
+    // Incremental evaluation can move a projection that lands exactly on
+    // b's border to the other side of it, nothing else may differ.
+    int i, bad = 0;
+    for(i = 0; ref.w == fast.w && ref.h == fast.h && i < ref.w*ref.h*ref.c; ++i){
+        bad += !within_eps(ref.data[i], fast.data[i]);
+    }
+    TEST(ref.w == fast.w && ref.h == fast.h && bad <= 3*ref.c);
+    free_image(ref);
+    free_image(fast);
+    free_matrix(H);
+    free_image(a);
+    free_image(b);
+}
+
+void test_pyramid(){
+    image im = make_random_image(101, 67, 3);
+    pyramid g = make_pyramid(im, 4);
+    TEST(g.levels == 4 && g.level[1].w == 51 && g.level[1].h == 34 && g.level[3].w == 13 && g.level[3].h == 9);
+
+    // Going down a level is a 5x5 binomial blur sampled at even pixels.
+    float k[5] = {1, 4, 6, 4, 1};
+    image f = make_image(5, 5, 1);
+    int x, y, c;
+    for(y = 0; y < 5; ++y) for(x = 0; x < 5; ++x) set_pixel(f, x, y, 0, k[x]*k[y]/256);
+    image blur = convolve_image(g.level[1], f, 1);
+    int ok = 1;
+    for(c = 0; c < 3; ++c){
+        for(y = 0; y < g.level[2].h; ++y){
+            for(x = 0; x < g.level[2].w; ++x){
+                ok &= within_eps(get_pixel(g.level[2], x, y, c), get_pixel(blur, 2*x, 2*y, c));
+            }
+        }
+    }
+    TEST(ok);
+
+    // Laplacian pyramids collapse back to the image.
+    pyramid lap = make_laplacian_pyramid(g);
+    image back = collapse_pyramid(lap);
+    TEST(same_image(back, im));
+
+    // Rebuilding for a new frame reuses the level buffers.
+    image next = make_random_image(101, 67, 3);
+    float *data = g.level[2].data;
+    update_pyramid(g, next);
+    pyramid fresh = make_pyramid(next, 4);
+    TEST(g.level[2].data == data && same_image(g.level[3], fresh.level[3]));
+    long before = image_heap_allocations();
+    update_pyramid(g, im);
+    TEST(image_heap_allocations() == before);
+
+    free_pyramid(fresh);
+    free_image(next);
+    free_image(back);
+    free_pyramid(lap);
+    free_image(blur);
+    free_image(f);
+    free_pyramid(g);
+    free_image(im);
+}
+
+void test_optical_flow_lk(){
+    // The content of im is the content of prev moved by (dx, dy).
+    float dx = 6.4, dy = -4.3;
+    image noise = make_random_image(260, 200, 1);
+    image scene = smooth_image(noise, 2);
+    image prev = make_image(200, 140, 1);
+    image im = make_image(200, 140, 1);
+    int x, y;
+    for(y = 0; y < prev.h; ++y){
+        for(x = 0; x < prev.w; ++x){
+            set_pixel(prev, x, y, 0, get_pixel(scene, x + 30, y + 30, 0));
+            set_pixel(im, x, y, 0, bilinear_interpolate(scene, x + 30 - dx, y + 30 - dy, 0));
+        }
+    }
+    flow_params p = default_flow_params();
+    image v = optical_flow_lk(im, prev, p);
+    TEST(v.w == prev.w/p.stride && v.h == prev.h/p.stride && v.c == 3);
+    // Away from the edges, where content leaves the frame, flow is accurate.
+    int good = 0, count = 0;
+    for(y = 3; y < v.h - 3; ++y){
+        for(x = 3; x < v.w - 3; ++x){
+            good += fabsf(get_pixel(v, x, y, 0) - dx) < .2 && fabsf(get_pixel(v, x, y, 1) - dy) < .2;
+            ++count;
+        }
+    }
+    TEST(good >= .9*count);
+
+    // Sparse tracking of a grid of points.
+    int n = 0;
+    point pts[64], out[64];
+    int status[64];
+    for(y = 0; y < 8; ++y){
+        for(x = 0; x < 8; ++x) pts[n++] = make_point(30 + 20*x, 25 + 12*y);
+    }
+    int tracked = track_points_lk(im, prev, pts, n, p, out, status);
+    int i;
+    good = 0;
+    for(i = 0; i < n; ++i){
+        good += status[i] && fabsf(out[i].x - pts[i].x - dx) < .1 && fabsf(out[i].y - pts[i].y - dy) < .1;
+    }
+    TEST(tracked == n && good >= n - 2);
+
+    free_image(v);
+    free_image(im);
+    free_image(prev);
+    free_image(scene);
+    free_image(noise);
+}
+
+// Largest absolute difference between two matrices of the same size.
+static double matrix_diff(matrix a, matrix b)
+{
+    double d = 0;
+    int i, j;
+    for(i = 0; i < a.rows; ++i){
+        for(j = 0; j < a.cols; ++j) d = MAX(d, fabs(a.data[i][j] - b.data[i][j]));
+    }
+    return d;
+}
+
+void test_gemm(){
+    // Sizes below, at and across every block boundary.
+    int sizes[][3] = {{3, 3, 3}, {7, 13, 300}, {130, 270, 517}, {97, 2100, 40}};
+    int n, ok = 1;
+    for(n = 0; n < 4; ++n){
+        matrix a = random_matrix(sizes[n][0], sizes[n][2], 1);
+        matrix b = random_matrix(sizes[n][2], sizes[n][1], 1);
+        matrix ref = matrix_mult_matrix_reference(a, b);
+        matrix p = matrix_mult_matrix(a, b);
+        ok &= p.rows == ref.rows && p.cols == ref.cols && matrix_diff(p, ref) < 1e-9;
+        free_matrix(a);
+        free_matrix(b);
+        free_matrix(ref);
+        free_matrix(p);
+    }
+    TEST(ok);
+
+    // Transposed operands and scaled accumulation, c = 2*op(a)*op(b) - c.
+    int t;
+    for(t = 0; t < 8; ++t){
+        int ta = t & 1, tb = (t >> 1) & 1;
+        int M = (t & 4) ? 110 : 9, N = (t & 4) ? 75 : 11, K = (t & 4) ? 300 : 13;
+        matrix a = random_matrix(ta ? K : M, ta ? M : K, 1);
+        matrix b = random_matrix(tb ? N : K, tb ? K : N, 1);
+        matrix c = random_matrix(M, N, 1);
+        matrix at = ta ? transpose_matrix(a) : copy_matrix(a);
+        matrix bt = tb ? transpose_matrix(b) : copy_matrix(b);
+        matrix ab = matrix_mult_matrix_reference(at, bt);
+        matrix ref = copy_matrix(ab);
+        int i, j;
+        for(i = 0; i < M; ++i) for(j = 0; j < N; ++j) ref.data[i][j] = 2*ab.data[i][j] - c.data[i][j];
+        gemm(ta, tb, 2, a, b, -1, c);
+        ok &= matrix_diff(c, ref) < 1e-9;
+
+        fmatrix fa = random_fmatrix(a.rows, a.cols, 1);
+        fmatrix fb = random_fmatrix(b.rows, b.cols, 1);
+        fmatrix fc = make_fmatrix(M, N);
+        for(i = 0; i < M; ++i) for(j = 0; j < N; ++j) fc.data[i][j] = 1;
+        sgemm(ta, tb, 1, fa, fb, 0, fc);
+        double d = 0;
+        for(i = 0; i < M; ++i){
+            for(j = 0; j < N; ++j){
+                double sum = 0;
+                int k;
+                for(k = 0; k < K; ++k){
+                    sum += (ta ? fa.data[k][i] : fa.data[i][k])*(tb ? fb.data[j][k] : fb.data[k][j]);
+                }
+                d = MAX(d, fabs(fc.data[i][j] - sum));
+            }
+        }
+        ok &= d < 1e-3;
+        free_matrix(a); free_matrix(b); free_matrix(c);
+        free_matrix(at); free_matrix(bt); free_matrix(ab); free_matrix(ref);
+        free_fmatrix(fa); free_fmatrix(fb); free_fmatrix(fc);
+    }
+    TEST(ok);
+
+    // Rows are aligned, and shallow matrices with rows in any order work.
+    matrix a = random_matrix(50, 60, 1);
+    matrix b = random_matrix(60, 70, 1);
+    TEST(((size_t)a.data[1] & 63) == 0 && a.data[1] - a.data[0] == a.stride);
+    matrix s = {0};
+    s.rows = a.rows;
+    s.cols = a.cols;
+    s.shallow = 1;
+    s.data = calloc(s.rows, sizeof(double *));
+    int i;
+    for(i = 0; i < s.rows; ++i) s.data[i] = a.data[s.rows - 1 - i];
+    matrix ref = matrix_mult_matrix_reference(s, b);
+    matrix p = matrix_mult_matrix(s, b);
+    TEST(matrix_diff(p, ref) < 1e-9);
+
+    // Single precision agrees with double to float rounding.
+    fmatrix fa = random_fmatrix(130, 517, 1);
+    fmatrix fb = random_fmatrix(517, 270, 1);
+    matrix da = make_matrix(fa.rows, fa.cols);
+    matrix db = make_matrix(fb.rows, fb.cols);
+    int j;
+    for(i = 0; i < fa.rows; ++i) for(j = 0; j < fa.cols; ++j) da.data[i][j] = fa.data[i][j];
+    for(i = 0; i < fb.rows; ++i) for(j = 0; j < fb.cols; ++j) db.data[i][j] = fb.data[i][j];
+    fmatrix fp = fmatrix_mult_fmatrix(fa, fb);
+    matrix dp = matrix_mult_matrix(da, db);
+    double d = 0;
+    for(i = 0; i < dp.rows; ++i) for(j = 0; j < dp.cols; ++j) d = MAX(d, fabs(fp.data[i][j] - dp.data[i][j]));
+    TEST(fp.rows == dp.rows && fp.cols == dp.cols && d < 1e-3);
+    free_fmatrix(fa);
+    free_fmatrix(fb);
+    free_fmatrix(fp);
+    free_matrix(da);
+    free_matrix(db);
+    free_matrix(dp);
+    free_matrix(s);
+    free_matrix(a);
+    free_matrix(b);
+    free_matrix(ref);
+    free_matrix(p);
+}
+
+// Two noisy clusters per class, a small MLP separates them.
+static data cluster_data(int n, int d, int k)
+{
+    float centers[6][20];
+    int i, j;
+    for(i = 0; i < 2*k; ++i) for(j = 0; j < d; ++j) centers[i][j] = (float)rand()/RAND_MAX;
+    data train;
+    train.X = make_fmatrix(n, d + 1);
+    train.y = make_fmatrix(n, k);
+    for(i = 0; i < n; ++i){
+        int c = i % (2*k);
+        for(j = 0; j < d; ++j) train.X.data[i][j] = centers[c][j] + .4*((float)rand()/RAND_MAX - .5);
+        train.X.data[i][d] = 1;
+        train.y.data[i][c % k] = 1;
+    }
+    return train;
+}
+
+static model cluster_model(layer *l, int d, int k)
+{
+    l[0] = make_layer(d + 1, 16, LRELU);
+    l[1] = make_layer(16, k, SOFTMAX);
+    model m = {l, 2};
+    return m;
+}
+
+static void free_cluster_model(model m)
+{
+    int i;
+    for(i = 0; i < m.n; ++i){
+        free_fmatrix(m.layers[i].w);
+        free_fmatrix(m.layers[i].v);
+        free_fmatrix(m.layers[i].dw);
+        free_fmatrix(m.layers[i].out);
+    }
+}
+
+void test_train_model(){
+    int d = 20, k = 3, i, j;
+    data train = cluster_data(600, d, k);
+    layer l[2], p[2];
+    model m = cluster_model(l, d, k);
+    train_model(m, train, 32, 300, .1, .9, 0);
+    TEST(accuracy_model(m, train) > .95);
+    free_cluster_model(m);
+
+    // One worker draws and sums exactly like train_model.
+    srand(5);
+    m = cluster_model(l, d, k);
+    model q = cluster_model(p, d, k);
+    for(i = 0; i < m.n; ++i){
+        for(j = 0; j < l[i].w.rows; ++j) memcpy(p[i].w.data[j], l[i].w.data[j], l[i].w.cols*sizeof(float));
+    }
+    srand(7);
+    train_model(m, train, 32, 50, .1, .9, .001);
+    srand(7);
+    train_model_parallel(q, train, 32, 50, .1, .9, .001, 1, 0);
+    int same = 1;
+    for(i = 0; i < m.n; ++i){
+        for(j = 0; j < l[i].w.rows; ++j) same &= !memcmp(p[i].w.data[j], l[i].w.data[j], l[i].w.cols*sizeof(float));
+    }
+    TEST(same);
+    free_cluster_model(m);
+    free_cluster_model(q);
+
+    // Split batches with a tree reduction, and lock-free updates.
+    m = cluster_model(l, d, k);
+    train_model_parallel(m, train, 32, 300, .1, .9, 0, 4, 0);
+    TEST(accuracy_model(m, train) > .95);
+    free_cluster_model(m);
+    m = cluster_model(l, d, k);
+    train_model_parallel(m, train, 32, 300, .1, .9, 0, 4, 1);
+    TEST(accuracy_model(m, train) > .95);
+    free_cluster_model(m);
+    free_data(train);
+}
+
+void test_integral_image(){
+    image im = make_random_image(83, 47, 2);
+    integral_image t = integral_table(view_image(im));
+    int x, y, k, ok = 1;
+    for(k = 0; k < im.c; ++k){
+        for(y = 0; y < im.h; ++y){
+            for(x = 0; x < im.w; ++x){
+                double sum = 0;
+                int i, j;
+                for(j = 0; j <= y; ++j) for(i = 0; i <= x; ++i) sum += get_pixel(im, i, j, k);
+                ok &= fabs(t.data[x + y*im.w + k*im.w*im.h] - sum) < 1e-9;
+            }
+        }
+    }
+    TEST(ok);
+
+    // Streaming in strips gives the same table.
+    integral_stream s = make_integral_stream(im.w, im.c);
+    integral_image strip = make_integral_table(im.w, 7, im.c);
+    int y0;
+    ok = 1;
+    for(y0 = 0; y0 < im.h; y0 += strip.h){
+        int h = MIN(strip.h, im.h - y0);
+        integral_image part = strip;
+        part.h = h;
+        integral_stream_rows(&s, view_roi(view_image(im), 0, y0, im.w, h), part);
+        for(k = 0; k < im.c; ++k){
+            for(y = 0; y < h; ++y){
+                for(x = 0; x < im.w; ++x){
+                    ok &= part.data[x + y*im.w + k*im.w*h] == t.data[x + (y0 + y)*im.w + k*im.w*im.h];
+                }
+            }
+        }
+    }
+    TEST(ok && s.rows == im.h);
+
+    image f = make_integral_image(im);
+    TEST(within_eps(get_pixel(f, im.w-1, im.h-1, 1), t.data[im.w*im.h*2 - 1]));
+
+    free_image(f);
+    free_integral_stream(s);
+    free_integral_table(strip);
+    free_integral_table(t);
+    free_image(im);
+}
+
+void test_box_filter(){
+    image im = make_random_image(41, 23, 5);
+    int sizes[] = {5, 4, 1, 60};
+    int n, x, y, k, ok = 1;
+    for(n = 0; n < 4; ++n){
+        int s = sizes[n];
+        image f = box_filter_image(im, s);
+        for(k = 0; k < im.c; ++k){
+            for(y = 0; y < im.h; ++y){
+                for(x = 0; x < im.w; ++x){
+                    // Average of the part of the window inside the image.
+                    double sum = 0;
+                    int count = 0, i, j;
+                    for(j = y - s/2; j <= y + s - 1 - s/2; ++j){
+                        for(i = x - s/2; i <= x + s - 1 - s/2; ++i){
+                            if(i < 0 || j < 0 || i >= im.w || j >= im.h) continue;
+                            sum += get_pixel(im, i, j, k);
+                            ++count;
+                        }
+                    }
+                    ok &= fabs(get_pixel(f, x, y, k) - sum/count) < 1e-5;
+                }
+            }
+        }
+        free_image(f);
+    }
+    TEST(ok);
+    free_image(im);
+}
+
+void test_velocity_image(){
+    // Random positive definite structure matrices, with every seventh pixel
+    // nearly flat and every eleventh a rank one edge.
+    image S = make_random_image(97, 61, 5);
+    int i, x, y;
+    for(i = 0; i < S.w*S.h; ++i){
+        float xx = S.data[i], yy = S.data[i + S.w*S.h];
+        S.data[i + 2*S.w*S.h] = (S.data[i + 2*S.w*S.h] - .5)*sqrtf(xx*yy);
+        S.data[i + 3*S.w*S.h] -= .5;
+        S.data[i + 4*S.w*S.h] -= .5;
+        if(i % 7 == 0){
+            S.data[i] *= 1e-7;
+            S.data[i + S.w*S.h] *= 1e-7;
+            S.data[i + 2*S.w*S.h] *= 1e-7;
+        } else if(i % 11 == 0) S.data[i + 2*S.w*S.h] = sqrtf(xx*yy);
+    }
+    int stride = 3;
+    image ref = velocity_image_reference(S, stride);
+    image v = velocity_image(S, stride);
+    TEST(v.w == ref.w && v.h == ref.h && v.c == 3);
+    int ok = 1;
+    for(y = 0; y < v.h; ++y){
+        for(x = 0; x < v.w; ++x){
+            int j = (x*stride + (stride-1)/2) + (y*stride + (stride-1)/2)*S.w;
+            float xx = S.data[j], yy = S.data[j + S.w*S.h], xy = S.data[j + 2*S.w*S.h];
+            float lambda = .5*(xx + yy) - sqrtf(.25*(xx - yy)*(xx - yy) + xy*xy);
+            for(i = 0; i < 2; ++i){
+                float a = get_pixel(v, x, y, i), b = get_pixel(ref, x, y, i);
+                // Singular matrices give no flow, well conditioned ones the
+                // same flow as inverting them.
+                if(j % 7 == 0 || j % 11 == 0) ok &= a == 0;
+                else if(lambda > 1e-3) ok &= fabsf(a - b) < 1e-3*(1 + fabsf(b));
+            }
+        }
+    }
+    TEST(ok);
+    free_image(ref);
+    free_image(v);
+    free_image(S);
+}
+
+void test_remap_image(){
+    image im = make_random_image(203, 157, 3);
+    image ref = cylindrical_project_reference(im, 150);
+    image fast = cylindrical_project(im, 150);
+    TEST(same_image(ref, fast));
+
+    // A map is reusable and works for any geometry, here a half pixel shift.
+    remap_map m = make_remap_map(im.w, im.h, im.w, im.h);
+    int x, y;
+    for(y = 0; y < im.h; ++y){
+        for(x = 0; x < im.w; ++x) remap_map_set(m, x, y, x + .5, y);
+    }
+    image shifted = remap_image(im, m);
+    int ok = 1;
+    for(y = 0; y < im.h; ++y){
+        for(x = 0; x < im.w; ++x){
+            ok &= within_eps(get_pixel(shifted, x, y, 1), bilinear_interpolate(im, x + .5, y, 1));
+        }
+    }
+    TEST(ok);
+    free_image(shifted);
+    free_remap_map(m);
+    free_image(ref);
+    free_image(fast);
+    free_image(im);
+}
+
+void test_blend_images(){
+    // Flat images side by side, overlapping by 40 columns.
+    image a = make_image(100, 60, 3);
+    image b = make_image(100, 60, 3);
+    int i, x;
+    for(i = 0; i < a.w*a.h*a.c; ++i){
+        a.data[i] = .2;
+        b.data[i] = .8;
+    }
+    matrix H = make_translation_homography(-60, 0);
+    BLEND modes[] = {BLEND_FEATHER, BLEND_MULTIBAND};
+    for(i = 0; i < 2; ++i){
+        image c = combine_images_blend(a, b, H, modes[i], 4);
+        TEST(c.w == 159 && c.h == 60);
+        // Only a or only b gives back its value, the overlap ramps between.
+        int y = 30, ok = within_eps(get_pixel(c, 10, y, 0), .2) && within_eps(get_pixel(c, 150, y, 1), .8);
+        for(x = 1; x < c.w; ++x){
+            ok &= get_pixel(c, x, y, 2) >= get_pixel(c, x-1, y, 2) - EPS;
+        }
+        TEST(ok);
+        free_image(c);
+    }
+    // The seam of a feathered blend is halfway through the overlap.
+    image c = combine_images_blend(a, b, H, BLEND_FEATHER, 0);
+    TEST(within_eps(get_pixel(c, 79, 30, 0) + get_pixel(c, 80, 30, 0), 1));
+    free_image(c);
+    free_matrix(H);
+    free_image(a);
+    free_image(b);
+}
+
+void test_panorama_build(){
+    // Three overlapping crops of one textured scene, the same scene and the
+    // same RANSAC draws whatever ran before.
+    srand(12);
+    image noise = make_random_image(420, 160, 3);
+    image scene = smooth_image(noise, 1);
+    image ims[3];
+    int i;
+    for(i = 0; i < 3; ++i){
+        ims[i] = make_image(180, 160, 3);
+        copy_view(view_roi(view_image(scene), 120*i, 0, 180, 160), view_image(ims[i]));
+    }
+    panorama_params p = default_panorama_params();
+    p.thresh = .01;
+    // The crops are exact translations, a tight inlier threshold keeps
+    // near misses from pulling the fit off by a fraction of a pixel.
+    p.ransac.thresh = .5;
+    p.ransac.reproducible = 1;
+    p.ransac.seed = 0x853c49e6748fea9bULL;
+    panorama_layout l = panorama_plan(ims, 3, p);
+    image pan = panorama_render(ims, l, p.max_size);
+    TEST(pan.w == scene.w && pan.h == scene.h && pan.c == scene.c);
+    float err = 0;
+    for(i = 0; pan.w == scene.w && pan.h == scene.h && i < pan.w*pan.h*pan.c; ++i){
+        err += fabsf(pan.data[i] - scene.data[i]);
+    }
+    TEST(pan.w == scene.w && pan.h == scene.h && err < .01*pan.w*pan.h*pan.c);
+
+    // Streaming in strips writes the same pixels, rounded to bytes.
+    TEST(save_panorama_ppm(ims, l, "panorama_test", 7));
+    image disk = load_image("panorama_test.ppm");
+    remove("panorama_test.ppm");
+    int same = disk.w == pan.w && disk.h == pan.h && disk.c == pan.c;
+    for(i = 0; same && i < pan.w*pan.h*pan.c; ++i){
+        same = fabsf(disk.data[i] - pan.data[i]) <= .5/255 + EPS;
+    }
+    TEST(same);
+    free_image(disk);
+    free_panorama_layout(l);
+    for(i = 0; i < 3; ++i) free_image(ims[i]);
+    free_image(pan);
+    free_image(scene);
+    free_image(noise);
+}
+
+void test_match_index(){
+    int an = 300, bn = 400, len = 75;
+    descriptor *b = make_random_descriptors(bn, len);
+    descriptor *a = make_random_descriptors(an, len);
+    int i, j;
+    // The first half of a are noisy copies of points in b.
+    for(i = 0; i < an/2; ++i){
+        for(j = 0; j < len; ++j) a[i].data[j] = b[2*i].data[j] + .01*((float)rand()/RAND_MAX - .5);
+    }
+
+    int rn = 0, fn = 0;
+    match *ref = match_descriptors_reference(a, an, b, bn, &rn);
+    match *fast = match_descriptors(a, an, b, bn, &fn);
+    int same = rn == fn;
+    for(i = 0; same && i < rn; ++i){
+        same = ref[i].ai == fast[i].ai && ref[i].bi == fast[i].bi && within_eps(ref[i].distance, fast[i].distance);
+    }
+    TEST(same);
+    free(ref);
+    free(fast);
+
+    MATCHER backends[] = {MATCH_KDTREE, MATCH_KMEANS};
+    int k;
+    for(k = 0; k < 2; ++k){
+        match_params p = default_match_params();
+        p.backend = backends[k];
+        p.ratio = .5;
+        p.mutual = 1;
+        int mn = 0, found = 0, wrong = 0;
+        match *m = match_descriptors_params(a, an, b, bn, p, &mn);
+        for(i = 0; i < mn; ++i){
+            if(m[i].ai < an/2 && m[i].bi == 2*m[i].ai) ++found;
+            else ++wrong;
+        }
+        TEST(found >= .9*an/2 && wrong == 0);
+        free(m);
+    }
+    free_descriptors(a, an);
+    free_descriptors(b, bn);
+}
+
 void test_gaussian_filter(){
     image f = make_gaussian_filter(7);
     int i;
@@ -419,6 +1254,26 @@ void run_tests()
     //test_emboss_filter();
     //test_highpass_filter();
     //test_convolution();
+    test_convolve_engine();
+    test_image_views();
+    test_image_arena();
+    test_harris_response();
+    test_nms();
+    test_distance_kernels();
+    test_match_index();
+    test_descriptor_set();
+    test_ransac();
+    test_combine_images();
+    test_pyramid();
+    test_optical_flow_lk();
+    test_integral_image();
+    test_gemm();
+    test_train_model();
+    test_box_filter();
+    test_velocity_image();
+    test_remap_image();
+    test_blend_images();
+    test_panorama_build();
     //test_gaussian_blur();
     //test_hybrid_image();
     //test_frequency_image();
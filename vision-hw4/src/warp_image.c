@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <math.h>
+#include <assert.h>
+#include "image.h"
+#include "matrix.h"
+
+// Inverse warping through a homography. The homogeneous source coordinate
+// is affine along a destination row, so each pixel costs three adds and a
+// reciprocal. The destination is cut into tiles, tiles whose footprint
+// misses the source are skipped, and the rest run in parallel.
+
+#define WARP_TILE 64
+
+// Sample every channel of a view bilinearly at (x, y), clamping reads to
+// the edges, with the arithmetic of bilinear_interpolate.
+// float *out: dst pixel in channel 0, channels cstride apart.
+static void sample_bilinear(image_view src, float x, float y, float *out, int cstride, int channels)
+{
+    int left = (int) floorf(x);
+    int top = (int) floorf(y);
+    float tx = x - left;
+    float ty = y - top;
+    int xl = MIN(MAX(left, 0), src.w - 1);
+    int xr = MIN(MAX(left + 1, 0), src.w - 1);
+    int yt = MIN(MAX(top, 0), src.h - 1);
+    int yb = MIN(MAX(top + 1, 0), src.h - 1);
+    const float *t = src.data + src.offset + yt*src.stride;
+    const float *b = src.data + src.offset + yb*src.stride;
+    int k;
+    for(k = 0; k < channels; ++k, t += src.cstride, b += src.cstride){
+        float top_row = t[xl] + (t[xr] - t[xl])*tx;
+        float bottom_row = b[xl] + (b[xr] - b[xl])*tx;
+        out[k*cstride] = top_row + (bottom_row - top_row)*ty;
+    }
+}
+
+// Whether a destination rectangle can map inside the source. Only answers
+// no when the homography is well behaved over the rectangle.
+static int tile_hits_source(const double *h, int x0, int y0, int x1, int y1, int w, int h_src)
+{
+    double minx = INFINITY, miny = INFINITY, maxx = -INFINITY, maxy = -INFINITY;
+    int i;
+    for(i = 0; i < 4; ++i){
+        double x = (i & 1) ? x1 : x0;
+        double y = (i & 2) ? y1 : y0;
+        double z = h[6]*x + h[7]*y + h[8];
+        // The plane at infinity crosses the tile, no simple footprint.
+        if(z <= 0) return 1;
+        double u = (h[0]*x + h[1]*y + h[2])/z;
+        double v = (h[3]*x + h[4]*y + h[5])/z;
+        minx = MIN(minx, u); maxx = MAX(maxx, u);
+        miny = MIN(miny, v); maxy = MAX(maxy, v);
+    }
+    // The footprint of a convex tile is the hull of its projected corners.
+    return maxx >= -1 && minx <= w && maxy >= -1 && miny <= h_src;
+}
+
+// Warp a view through a homography into another view. Only destination
+// pixels that land inside the source are written.
+// image_view src: view to sample.
+// matrix H: 3x3 map from destination coordinates to src coordinates.
+// image_view dst: output, its pixel (i, j) has coordinates (i + ox, j + oy).
+// int ox, oy: coordinates of the first destination pixel.
+void warp_homography_view(image_view src, matrix H, image_view dst, int ox, int oy)
+{
+    assert(H.rows == 3 && H.cols == 3);
+    double h[9];
+    int i;
+    for(i = 0; i < 9; ++i) h[i] = H.data[i/3][i%3];
+    int channels = MIN(src.c, dst.c);
+    int tx = (dst.w + WARP_TILE - 1)/WARP_TILE;
+    int ty = (dst.h + WARP_TILE - 1)/WARP_TILE;
+    int t;
+
+    #pragma omp parallel for schedule(dynamic)
+    for(t = 0; t < tx*ty; ++t){
+        int x0 = (t % tx)*WARP_TILE, y0 = (t / tx)*WARP_TILE;
+        int x1 = MIN(dst.w, x0 + WARP_TILE), y1 = MIN(dst.h, y0 + WARP_TILE);
+        if(!tile_hits_source(h, x0 + ox, y0 + oy, x1 - 1 + ox, y1 - 1 + oy, src.w, src.h)) continue;
+        int x, y;
+        for(y = y0; y < y1; ++y){
+            double X = x0 + ox, Y = y + oy;
+            double u = h[0]*X + h[1]*Y + h[2];
+            double v = h[3]*X + h[4]*Y + h[5];
+            double z = h[6]*X + h[7]*Y + h[8];
+            float *out = view_row(dst, y, 0);
+            for(x = x0; x < x1; ++x, u += h[0], v += h[3], z += h[6]){
+                double r = 1/z;
+                float sx = u*r, sy = v*r;
+                if(!(sx >= 0 && sx < src.w && sy >= 0 && sy < src.h)) continue;
+                sample_bilinear(src, sx, sy, out + x, dst.cstride, channels);
+            }
+        }
+    }
+}
@@ -33,7 +33,7 @@ if __name__ == '__main__':
     decay = 0.01
 
     m = neural_net2(train.X.cols, train.y.cols)
-    train_model(m, train, batch, iters, rate, momentum, decay)
+    train_model_parallel(m, train, batch, iters, rate, momentum, decay)
     print("done")
     print()
 
@@ -33,18 +33,28 @@ class MATRIX(Structure):
     _fields_ = [("rows", c_int),
                 ("cols", c_int),
                 ("data", POINTER(POINTER(c_double))),
-                ("shallow", c_int)]
+                ("shallow", c_int),
+                ("stride", c_int),
+                ("block", POINTER(c_double))]
+
+class FMATRIX(Structure):
+    _fields_ = [("rows", c_int),
+                ("cols", c_int),
+                ("data", POINTER(POINTER(c_float))),
+                ("shallow", c_int),
+                ("stride", c_int),
+                ("block", POINTER(c_float))]
 
 class DATA(Structure):
-    _fields_ = [("X", MATRIX),
-                ("y", MATRIX)]
+    _fields_ = [("X", FMATRIX),
+                ("y", FMATRIX)]
 
 class LAYER(Structure):
-    _fields_ = [("in", MATRIX),
-                ("dw", MATRIX),
-                ("w", MATRIX),
-                ("v", MATRIX),
-                ("out", MATRIX),
+    _fields_ = [("in", FMATRIX),
+                ("w", FMATRIX),
+                ("dw", FMATRIX),
+                ("v", FMATRIX),
+                ("out", FMATRIX),
                 ("activation", c_int)]
 
 class MODEL(Structure):
@@ -207,6 +217,10 @@ panorama_image_lib = lib.panorama_image
 panorama_image_lib.argtypes = [IMAGE, IMAGE, c_float, c_float, c_int, c_float, c_int, c_int]
 panorama_image_lib.restype = IMAGE
 
+panorama_images_lib = lib.panorama_images
+panorama_images_lib.argtypes = [POINTER(IMAGE), c_int, c_float, c_float, c_int, c_float, c_int, c_int]
+panorama_images_lib.restype = IMAGE
+
 draw_flow = lib.draw_flow
 draw_flow.argtypes = [IMAGE, IMAGE, c_float]
 draw_flow.restype = None
@@ -226,18 +240,29 @@ optical_flow_webcam.restype = None
 def panorama_image(a, b, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
     return panorama_image_lib(a, b, sigma, thresh, nms, inlier_thresh, iters, cutoff)
 
+def panorama_images(ims, sigma=2, thresh=5, nms=3, inlier_thresh=2, iters=10000, cutoff=30):
+    arr = (IMAGE*len(ims))(*ims)
+    return panorama_images_lib(arr, len(ims), sigma, thresh, nms, inlier_thresh, iters, cutoff)
+
 
 train_model = lib.train_model
 train_model.argtypes = [MODEL, DATA, c_int, c_int, c_double, c_double, c_double]
 train_model.restype = None
 
+train_model_parallel_lib = lib.train_model_parallel
+train_model_parallel_lib.argtypes = [MODEL, DATA, c_int, c_int, c_double, c_double, c_double, c_int, c_int]
+train_model_parallel_lib.restype = None
+
+def train_model_parallel(m, d, batch, iters, rate, momentum, decay, threads=0, hogwild=0):
+    return train_model_parallel_lib(m, d, batch, iters, rate, momentum, decay, threads, hogwild)
+
 accuracy_model = lib.accuracy_model
 accuracy_model.argtypes = [MODEL, DATA]
 accuracy_model.restype = c_double
 
 forward_model = lib.forward_model
-forward_model.argtypes = [MODEL, MATRIX]
-forward_model.restype = MATRIX
+forward_model.argtypes = [MODEL, FMATRIX]
+forward_model.restype = FMATRIX
 
 load_classification_data = lib.load_classification_data
 load_classification_data.argtypes = [c_char_p, c_char_p, c_int]